@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mosquitto.h>
+#include <phoenix.h>
+
+/*
+ * Command dispatch.
+ *
+ * A command message is parsed on the network thread and put on a bounded
+ * queue, nothing else happens there: handlers read and write the database,
+ * and some never return (reboot). COMMAND_WORKERS threads take commands off
+ * the queue, run the handler registered for the command id and publish the
+ * response, if any, on /device/<id>/command/<command id>. When the queue is
+ * full the command is dropped, the network thread is never blocked.
+ *
+ * Without workers, the external event loop, phoenix_process_timers() runs
+ * one queued command per call with command_process().
+ *
+ * Message: command id (8 bytes), command type (2), payload length (2) and
+ * the payload, all big endian.
+ */
+
+typedef struct {
+  phoenix_t *phoenix;
+  uint64_t id;
+  command_type_t cmd;
+  int payload_len;
+  uint8_t payload[COMMAND_PAYLOAD_MAX];
+} command_t;
+
+typedef struct {
+  command_type_t cmd;
+  phoenix_command_handler_t handler;
+} command_handler_t;
+
+static command_handler_t handlers[COMMAND_HANDLERS_MAX];
+static int num_handlers=0;
+static pthread_rwlock_t handlers_lock=PTHREAD_RWLOCK_INITIALIZER;
+
+static command_t queue[COMMAND_QUEUE_SIZE];
+static int queue_head=0, queue_count=0;
+static pthread_mutex_t queue_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond=PTHREAD_COND_INITIALIZER;
+
+static pthread_t workers[COMMAND_WORKERS];
+static int num_workers=0;
+static int workers_run=0;
+
+static command_stats_t stats;
+
+//Replaces the handler of cmd_id, NULL removes it
+int phoenix_command_register(command_type_t cmd_id, phoenix_command_handler_t handler) {
+  int i, status=0;
+
+  pthread_rwlock_wrlock(&handlers_lock);
+  for(i=0;i<num_handlers && handlers[i].cmd != cmd_id;i++) {}
+
+  if(handler == NULL) {
+    if(i < num_handlers) {
+      handlers[i]=handlers[--num_handlers];
+    }
+  }else if(i < num_handlers) {
+    handlers[i].handler=handler;
+  }else if(num_handlers < COMMAND_HANDLERS_MAX) {
+    handlers[num_handlers].cmd=cmd_id;
+    handlers[num_handlers].handler=handler;
+    num_handlers++;
+  }else{
+    print_error("No room for handler of command %d\n", cmd_id);
+    status=-1;
+  }
+  pthread_rwlock_unlock(&handlers_lock);
+
+  return status;
+}
+
+static phoenix_command_handler_t command_handler(command_type_t cmd) {
+  phoenix_command_handler_t handler=NULL;
+  int i;
+
+  pthread_rwlock_rdlock(&handlers_lock);
+  for(i=0;i<num_handlers;i++) {
+    if(handlers[i].cmd == cmd) {
+      handler=handlers[i].handler;
+      break;
+    }
+  }
+  pthread_rwlock_unlock(&handlers_lock);
+
+  return handler;
+}
+
+//Parse and queue a command message, called on the network thread
+int command_submit(phoenix_t *phoenix, const uint8_t *p, int len) {
+  command_t *command;
+  int payload_len;
+
+  if(len < 12 || (payload_len = p[10] << 8 | p[11]) > len-12 || payload_len > COMMAND_PAYLOAD_MAX) {
+    print_error("Malformed command of %d bytes\n", len);
+    pthread_mutex_lock(&queue_mutex);
+    stats.dropped++;
+    pthread_mutex_unlock(&queue_mutex);
+    return -1;
+  }
+
+  pthread_mutex_lock(&queue_mutex);
+  stats.received++;
+  if(queue_count == COMMAND_QUEUE_SIZE) {
+    stats.dropped++;
+    pthread_mutex_unlock(&queue_mutex);
+    print_warning("Command queue full, dropping command\n");
+    return -1;
+  }
+
+  command=&queue[(queue_head+queue_count) % COMMAND_QUEUE_SIZE];
+  command->phoenix=phoenix;
+  command->id =
+      (uint64_t)p[0] << 56 |
+      (uint64_t)p[1] << 48 |
+      (uint64_t)p[2] << 40 |
+      (uint64_t)p[3] << 32 |
+      (uint64_t)p[4] << 24 |
+      (uint64_t)p[5] << 16 |
+      (uint64_t)p[6] << 8 |
+      (uint64_t)p[7] << 0;
+  command->cmd = p[8] << 8 | p[9];
+  command->payload_len=payload_len;
+  memset(command->payload,0,sizeof(command->payload));
+  memcpy(command->payload,p+12,payload_len);
+  queue_count++;
+  pthread_cond_signal(&queue_cond);
+  pthread_mutex_unlock(&queue_mutex);
+
+  return 0;
+}
+
+static void command_execute(command_t *command) {
+  struct mosquitto_message *response=NULL;
+  phoenix_command_handler_t handler=command_handler(command->cmd);
+  char response_topic[1024];
+  int i;
+
+  print_info("Command received: id: %llu, cmd: %d, length: %d\n", (unsigned long long)command->id, command->cmd, command->payload_len);
+  for(i=0;i<command->payload_len;i++) {
+    debug_printf("0x%02x\n", command->payload[i]);
+  }
+
+  if(handler == NULL) {
+    print_error("Unknown command id: %d\n", command->cmd);
+    pthread_mutex_lock(&queue_mutex);
+    stats.unknown++;
+    pthread_mutex_unlock(&queue_mutex);
+    return;
+  }
+
+  handler(command->phoenix,command->payload,command->payload_len,&response);
+
+  if(response != NULL) {
+    sprintf(response_topic, "/device/%s/command/%llu", command->phoenix->device_id, (unsigned long long)command->id);
+    print_info("Sending response to %s, %d bytes\n", response_topic,response->payloadlen);
+    phoenix_mqtt_send(command->phoenix,NULL,response_topic,response->payload,response->payloadlen);
+    free(response->payload);
+    free(response);
+  }
+
+  pthread_mutex_lock(&queue_mutex);
+  stats.executed++;
+  pthread_mutex_unlock(&queue_mutex);
+}
+
+//Take the next command, waiting for one if wait is set. Returns 0 when the
+//queue is empty or the workers are stopping
+static int command_take(command_t *command, int wait) {
+  pthread_mutex_lock(&queue_mutex);
+  while(wait && workers_run && queue_count == 0) {
+    pthread_cond_wait(&queue_cond,&queue_mutex);
+  }
+  if(queue_count == 0 || (wait && !workers_run)) {
+    pthread_mutex_unlock(&queue_mutex);
+    return 0;
+  }
+  *command=queue[queue_head];
+  queue_head=(queue_head+1) % COMMAND_QUEUE_SIZE;
+  queue_count--;
+  pthread_mutex_unlock(&queue_mutex);
+
+  return 1;
+}
+
+static void *command_worker(void *arg) {
+  command_t *command=malloc(sizeof(command_t));
+
+  while(command_take(command,1)) {
+    command_execute(command);
+  }
+  free(command);
+
+  return NULL;
+}
+
+int command_start() {
+  int i;
+
+  pthread_mutex_lock(&queue_mutex);
+  if(num_workers > 0) {
+    pthread_mutex_unlock(&queue_mutex);
+    return 0;
+  }
+  workers_run=1;
+  pthread_mutex_unlock(&queue_mutex);
+
+  for(i=0;i<COMMAND_WORKERS;i++) {
+    if(pthread_create(&workers[i],NULL,command_worker,NULL)) {
+      print_error("Unable to start command worker\n");
+      break;
+    }
+    num_workers++;
+  }
+
+  return num_workers == COMMAND_WORKERS ? 0 : -1;
+}
+
+//Commands still queued are dropped, the one running is finished
+void command_stop() {
+  int i;
+
+  pthread_mutex_lock(&queue_mutex);
+  workers_run=0;
+  pthread_cond_broadcast(&queue_cond);
+  pthread_mutex_unlock(&queue_mutex);
+
+  for(i=0;i<num_workers;i++) {
+    pthread_join(workers[i],NULL);
+  }
+
+  pthread_mutex_lock(&queue_mutex);
+  num_workers=0;
+  stats.dropped+=queue_count;
+  queue_head=0;
+  queue_count=0;
+  pthread_mutex_unlock(&queue_mutex);
+}
+
+int command_pending() {
+  int pending;
+
+  pthread_mutex_lock(&queue_mutex);
+  pending=queue_count;
+  pthread_mutex_unlock(&queue_mutex);
+
+  return pending;
+}
+
+//Run up to max queued commands on the calling thread, for the external
+//event loop. Returns the number run
+int command_process(int max) {
+  command_t *command=malloc(sizeof(command_t));
+  int n;
+
+  for(n=0;n<max && command_take(command,0);n++) {
+    command_execute(command);
+  }
+  free(command);
+
+  return n;
+}
+
+void command_stats(command_stats_t *command_stats) {
+  pthread_mutex_lock(&queue_mutex);
+  *command_stats=stats;
+  command_stats->queued=queue_count;
+  pthread_mutex_unlock(&queue_mutex);
+}
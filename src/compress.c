@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+#include <phoenix.h>
+
+/*
+ * Optional compression of batched sample payloads.
+ *
+ * Frames are deflated in the zlib format, primed with the pre-shared
+ * dictionary when one is set. The zlib header carries the adler32 of the
+ * dictionary, so a receiver with the wrong dictionary fails cleanly. HTTP
+ * bodies use the gzip format, which has no dictionary, so servers can
+ * decode them with plain Content-Encoding: gzip.
+ *
+ * One deflate stream per format is kept and reset between payloads, the
+ * window and hash tables are not allocated for every message.
+ */
+
+static int level=0;
+static size_t threshold=COMPRESS_THRESHOLD;
+static uint8_t *dictionary=NULL;
+static size_t dictionary_len=0;
+
+static z_stream streams[2];
+static int stream_ready[2]={0,0};
+
+static compress_stats_t stats;
+static pthread_mutex_t compress_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+static double compress_time_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1e3 + ts.tv_nsec/1e6;
+}
+
+//Caller must hold compress_mutex
+static void compress_streams_end() {
+  int i;
+
+  for(i=0;i<2;i++) {
+    if(stream_ready[i]) {
+      deflateEnd(&streams[i]);
+      stream_ready[i]=0;
+    }
+  }
+}
+
+//Compress payloads of at least min_size bytes with the zlib level, 1-9.
+//Level 0 turns compression off, payloads are then sent as before
+void compress_set(int compress_level, size_t min_size) {
+  if(compress_level < 0 || compress_level > 9) {
+    compress_level=Z_DEFAULT_COMPRESSION;
+  }
+
+  pthread_mutex_lock(&compress_mutex);
+  if(compress_level != level) {
+    compress_streams_end();
+  }
+  level=compress_level;
+  threshold=min_size;
+  pthread_mutex_unlock(&compress_mutex);
+}
+
+int compress_enabled() {
+  int enabled;
+
+  pthread_mutex_lock(&compress_mutex);
+  enabled = level != 0;
+  pthread_mutex_unlock(&compress_mutex);
+
+  return enabled;
+}
+
+//Pre-shared dictionary, typically the stream codes. The receiver must use
+//the same bytes. NULL removes it
+int compress_dictionary_set(const uint8_t *data, size_t len) {
+  pthread_mutex_lock(&compress_mutex);
+  free(dictionary);
+  dictionary=NULL;
+  dictionary_len=0;
+  if(data && len > 0) {
+    dictionary=malloc(len);
+    memcpy(dictionary,data,len);
+    dictionary_len=len;
+  }
+  pthread_mutex_unlock(&compress_mutex);
+
+  return 0;
+}
+
+size_t compress_bound(size_t len) {
+  //deflateBound() without a stream plus the gzip header and trailer
+  return compressBound(len) + 18;
+}
+
+//Compress len bytes of in into out, which must hold compress_bound(len)
+//bytes. Returns the compressed length, 0 if the payload is left as it is
+//(compression off, below the threshold or not smaller) or -1 on error
+int compress_buffer(compress_format_t format, const uint8_t *in, size_t len, uint8_t *out, size_t size) {
+  z_stream *stream=&streams[format];
+  double start;
+  int status, out_len=0;
+
+  pthread_mutex_lock(&compress_mutex);
+  if(level == 0 || len < threshold) {
+    pthread_mutex_unlock(&compress_mutex);
+    return 0;
+  }
+
+  start=compress_time_ms();
+  if(!stream_ready[format]) {
+    memset(stream,0,sizeof(z_stream));
+    if(deflateInit2(stream,level,Z_DEFLATED,format == COMPRESS_GZIP ? 15+16 : 15,8,Z_DEFAULT_STRATEGY) != Z_OK) {
+      print_error("Could not init deflate: %s\n", stream->msg ? stream->msg : "");
+      out_len=-1;
+      goto cleanup;
+    }
+    stream_ready[format]=1;
+  }else{
+    deflateReset(stream);
+  }
+
+  if(format == COMPRESS_ZLIB && dictionary) {
+    deflateSetDictionary(stream,dictionary,dictionary_len);
+  }
+
+  stream->next_in=(uint8_t *)in;
+  stream->avail_in=len;
+  stream->next_out=out;
+  stream->avail_out=size;
+  status=deflate(stream,Z_FINISH);
+  if(status != Z_STREAM_END) {
+    print_error("Could not deflate %zu bytes: %d\n", len, status);
+    out_len=-1;
+    goto cleanup;
+  }
+
+  stats.buffers++;
+  stats.bytes_in+=len;
+  if(stream->total_out < len) {
+    out_len=stream->total_out;
+    stats.compressed++;
+    stats.bytes_out+=out_len;
+  }else{
+    stats.bytes_out+=len;
+  }
+
+cleanup:
+  stats.cpu_ms+=compress_time_ms()-start;
+  pthread_mutex_unlock(&compress_mutex);
+
+  return out_len;
+}
+
+//Inflate a zlib or gzip payload, the pre-shared dictionary is used when the
+//stream asks for it. *out is allocated, returns 0 or -1
+int compress_inflate(const uint8_t *in, size_t len, uint8_t **out, size_t *out_len) {
+  z_stream stream;
+  size_t size=len*4+256;
+  int status;
+
+  memset(&stream,0,sizeof(stream));
+  //32+15 detects zlib and gzip headers
+  if(inflateInit2(&stream,32+15) != Z_OK) {
+    return -1;
+  }
+
+  *out=malloc(size);
+  stream.next_in=(uint8_t *)in;
+  stream.avail_in=len;
+  stream.next_out=*out;
+  stream.avail_out=size;
+
+  while((status=inflate(&stream,Z_NO_FLUSH)) != Z_STREAM_END) {
+    if(status == Z_NEED_DICT) {
+      pthread_mutex_lock(&compress_mutex);
+      status = dictionary ? inflateSetDictionary(&stream,dictionary,dictionary_len) : Z_DATA_ERROR;
+      pthread_mutex_unlock(&compress_mutex);
+      if(status != Z_OK) {
+        break;
+      }
+    }else if((status == Z_OK || status == Z_BUF_ERROR) && stream.avail_out == 0) {
+      *out=realloc(*out,size*2);
+      stream.next_out=*out+size;
+      stream.avail_out=size;
+      size*=2;
+    }else if(status != Z_OK) {
+      //Z_BUF_ERROR with room left means the input is truncated
+      break;
+    }
+  }
+
+  *out_len=stream.total_out;
+  inflateEnd(&stream);
+
+  if(status != Z_STREAM_END) {
+    print_error("Could not inflate %zu bytes: %d\n", len, status);
+    free(*out);
+    *out=NULL;
+    return -1;
+  }
+
+  return 0;
+}
+
+void compress_stats(compress_stats_t *compress_stats) {
+  pthread_mutex_lock(&compress_mutex);
+  *compress_stats=stats;
+  pthread_mutex_unlock(&compress_mutex);
+}
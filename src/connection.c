@@ -1,9 +1,286 @@
+#include <time.h>
+#include <stdint.h>
 #include "phoenix.h"
 
-int phoenix_connection_handle(phoenix_t *phoenix) {
-  int i, num_samples,status=0;
+/*
+ * Uploader wakeups.
+ *
+ * The connection thread sleeps until enough samples are queued, by count
+ * or bytes, until the oldest queued sample is flush_age_ms old, or until a
+ * PUBACK frees window space while a backlog waits for it. With nothing
+ * queued it only wakes every CONNECTION_IDLE_MS for housekeeping.
+ */
+
+static pthread_mutex_t wake_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond=PTHREAD_COND_INITIALIZER;
+static int queued_samples=0;
+static size_t queued_bytes=0;
+static long long queued_since=0;
+static int acks=0;
+static long long acked_since=0;
+static int woken=0;
+static long long idle_since=0;
+
+static int flush_count=CONNECTION_FLUSH_COUNT;
+static size_t flush_bytes=CONNECTION_FLUSH_BYTES;
+static int flush_age_ms=CONNECTION_FLUSH_MS;
+
+static connection_stats_t stats;
+
+//Wake the uploader once count samples or bytes are queued, or once the
+//oldest queued sample is age_ms old. 0 disables the count and byte limits
+void phoenix_flush_set(int count, size_t bytes, int age_ms) {
+  pthread_mutex_lock(&wake_mutex);
+  flush_count=count;
+  flush_bytes=bytes;
+  flush_age_ms=age_ms;
+  pthread_cond_signal(&wake_cond);
+  pthread_mutex_unlock(&wake_mutex);
+}
+
+void connection_samples_queued(int num_samples, size_t bytes) {
+  pthread_mutex_lock(&wake_mutex);
+  //The first sample arms the age timer, later ones only matter at the limits
+  if(queued_samples == 0) {
+    queued_since=phoenix_get_timestamp();
+    pthread_cond_signal(&wake_cond);
+  }
+  queued_samples+=num_samples;
+  queued_bytes+=bytes;
+  if((flush_count > 0 && queued_samples >= flush_count) || (flush_bytes > 0 && queued_bytes >= flush_bytes)) {
+    pthread_cond_signal(&wake_cond);
+  }
+  pthread_mutex_unlock(&wake_mutex);
+}
+
+void connection_acked() {
+  pthread_mutex_lock(&wake_mutex);
+  if(acks++ == 0) {
+    acked_since=phoenix_get_timestamp();
+  }
+  pthread_cond_signal(&wake_cond);
+  pthread_mutex_unlock(&wake_mutex);
+}
+
+//Wake the uploader now, e.g. to let it see that it should stop
+void connection_wakeup() {
+  pthread_mutex_lock(&wake_mutex);
+  woken=1;
+  pthread_cond_signal(&wake_cond);
+  pthread_mutex_unlock(&wake_mutex);
+}
+
+//Caller must hold wake_mutex. Returns what is due at now, or -1 with
+//*until set to when something will be. Idle time counts from since
+static int connection_due(phoenix_t *phoenix, int backlog, long long since, long long now, long long *until) {
+  if(woken) {
+    return CONNECTION_WAKE_SIGNAL;
+  }
+  if(backlog && (phoenix == NULL || phoenix->http || window_room() > 0)) {
+    return CONNECTION_WAKE_BACKLOG;
+  }
+  if((flush_count > 0 && queued_samples >= flush_count) || (flush_bytes > 0 && queued_bytes >= flush_bytes)) {
+    return CONNECTION_WAKE_SAMPLES;
+  }
+  if(backlog && acks > 0) {
+    return CONNECTION_WAKE_ACK;
+  }
+
+  *until=since + CONNECTION_IDLE_MS;
+  if(queued_samples > 0 && queued_since + flush_age_ms < *until) {
+    *until=queued_since + flush_age_ms;
+  }
+  //Acks are applied to the store in batches, apply the rest in time too
+  if(acks > 0 && acked_since + flush_age_ms < *until) {
+    *until=acked_since + flush_age_ms;
+  }
+  if(phoenix && phoenix->frame_pending_since > 0 && phoenix->frame_pending_since + phoenix->frame_flush_ms < *until) {
+    *until=phoenix->frame_pending_since + phoenix->frame_flush_ms;
+  }
+  //Posting again after the backoff of a failed HTTP batch
+  if(phoenix && phoenix->http && phoenix->http->retry_at > 0 && phoenix->http->retry_at < *until) {
+    *until=phoenix->http->retry_at;
+  }
+
+  if(now >= *until) {
+    return queued_samples > 0 || acks > 0 || (phoenix && phoenix->frame_pending_since > 0) ? CONNECTION_WAKE_TIMER : CONNECTION_WAKE_IDLE;
+  }
+  return -1;
+}
+
+//Caller must hold wake_mutex
+static void connection_woke(connection_wake_t wake) {
+  stats.wakeups[wake]++;
+  woken=0;
+  queued_samples=0;
+  queued_bytes=0;
+  acks=0;
+  idle_since=0;
+}
+
+//Sleep until there is work for phoenix_connection_handle(). backlog is set
+//when the last round left samples in the store, they are sent as soon as
+//the window has room. Returns what woke it
+connection_wake_t connection_wait(phoenix_t *phoenix, int backlog) {
+  struct timespec deadline;
+  long long since=phoenix_get_timestamp(), now=since, until;
+  int wake;
+
+  pthread_mutex_lock(&wake_mutex);
+  while((wake=connection_due(phoenix,backlog,since,now,&until)) < 0) {
+    clock_gettime(CLOCK_REALTIME,&deadline);
+    deadline.tv_sec+=(until-now)/1000;
+    deadline.tv_nsec+=((until-now)%1000)*1000000L;
+    if(deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec-=1000000000L;
+    }
+    pthread_cond_timedwait(&wake_cond,&wake_mutex,&deadline);
+    now=phoenix_get_timestamp();
+  }
+  connection_woke(wake);
+  pthread_mutex_unlock(&wake_mutex);
+
+  return wake;
+}
+
+//connection_wait() without sleeping, for an external event loop. Returns
+//what is due or -1, *timeout_ms is set to the time until something is.
+//With consume 0 it only looks
+int connection_poll(phoenix_t *phoenix, int backlog, int *timeout_ms, int consume) {
+  long long now=phoenix_get_timestamp(), until;
+  int wake;
+
+  pthread_mutex_lock(&wake_mutex);
+  if(idle_since == 0) {
+    idle_since=now;
+  }
+  wake=connection_due(phoenix,backlog,idle_since,now,&until);
+  if(wake >= 0) {
+    if(consume) {
+      connection_woke(wake);
+    }
+    *timeout_ms=0;
+  }else{
+    *timeout_ms=until-now;
+  }
+  pthread_mutex_unlock(&wake_mutex);
+
+  return wake;
+}
+
+void connection_stats(connection_stats_t *connection_stats) {
+  pthread_mutex_lock(&wake_mutex);
+  *connection_stats=stats;
+  pthread_mutex_unlock(&wake_mutex);
+}
+
+//Pack the queued samples into frames. A frame that is not full is held
+//back, its samples stay in the store, until frame_flush_ms has passed.
+//At most room frames are sent, the rest is read again next time
+static int phoenix_connection_send_frames(phoenix_t *phoenix, long long now, int room) {
+  int i, num_samples, status=0;
+  frame_t frame;
+  phoenix_sample_t *samples=calloc(sizeof(phoenix_sample_t),FRAME_MAX_SAMPLES);
+
+  num_samples=db_samples_read(samples, FRAME_MAX_SAMPLES);
+  frame_init(&frame,phoenix->frame_max_size);
+  phoenix->backlog = num_samples == FRAME_MAX_SAMPLES;
+
+  for(i=0;i<num_samples;i++) {
+    switch(frame_add(&frame,&samples[i])) {
+      case 0:
+        continue;
+      case FRAME_UNKNOWN_STREAM:
+        //It can never be sent, do not let it hold up the queue
+        print_error("Dropping sample %lld of unknown stream %d\n", (long long)samples[i].id, samples[i].stream_id);
+        db_sample_sent(samples[i].id,1);
+        continue;
+    }
+
+    //Full, send it and add the sample again to the empty frame
+    status|=phoenix_mqtt_send_frame(phoenix,&frame,0);
+    frame_reset(&frame);
+    if(--room == 0) {
+      phoenix->backlog=1;
+      break;
+    }
+    i--;
+  }
+
+  if(room > 0 && frame.num_samples > 0) {
+    if(phoenix->frame_pending_since == 0) {
+      phoenix->frame_pending_since=now;
+    }
+    if(num_samples == FRAME_MAX_SAMPLES || now - phoenix->frame_pending_since >= phoenix->frame_flush_ms) {
+      status|=phoenix_mqtt_send_frame(phoenix,&frame,0);
+      phoenix->frame_pending_since=0;
+    }
+  }
+
+  frame_free(&frame);
+  free(samples);
+
+  return status;
+}
+
+//Publish unacknowledged batches again under their sequence numbers, one
+//message per batch. A batch of one goes as a sample message unless frames
+//are on, a resent frame goes out whole whatever the frame size is now
+static int phoenix_connection_resume(phoenix_t *phoenix, int room) {
+  phoenix_sample_t *samples=calloc(sizeof(phoenix_sample_t),FRAME_MAX_SAMPLES);
+  int64_t *seqs=calloc(sizeof(int64_t),FRAME_MAX_SAMPLES);
+  int64_t last_seq=0;
+  int i, first, num_samples, batches=0, status=0;
+  frame_t frame;
+
+  num_samples=session_resume_read(samples,seqs,FRAME_MAX_SAMPLES);
+  frame_init(&frame,SIZE_MAX);
+
+  for(first=0;first<num_samples && batches<room;first=i) {
+    for(i=first+1;i<num_samples && seqs[i] == seqs[first];i++) {}
+
+    //libmosquitto still holds it from the last connection and sends it again
+    if(inflight_pending(samples[first].id)) {
+      last_seq=seqs[i-1];
+      continue;
+    }
+
+    if(i-first == 1 && phoenix->frame_max_size == 0) {
+      status=phoenix_mqtt_send_sample(phoenix,&samples[first],seqs[first]);
+    }else{
+      frame_reset(&frame);
+      for(;first<i;first++) {
+        frame_add(&frame,&samples[first]);
+      }
+      if(frame.num_samples > 0) {
+        status=phoenix_mqtt_send_frame(phoenix,&frame,seqs[i-1]);
+      }
+    }
+    //The batch may have reached the server before, it keeps its number and
+    //is resumed again next round
+    if(status) {
+      break;
+    }
+    last_seq=seqs[i-1];
+    batches++;
+  }
+  session_resumed(last_seq,batches);
+  debug_printf("Resumed %d batches up to %lld\n", batches, (long long)last_seq);
+
+  frame_free(&frame);
+  free(samples);
+  free(seqs);
+
+  return status;
+}
+
+//One round of the connection thread, or of the HTTP upload thread
+int connection_handle(phoenix_t *phoenix) {
+  int i, room, num_samples,status=0;
   phoenix_sample_t *sample;
-  phoenix_sample_t *samples=calloc(sizeof(phoenix_sample_t),MAX_SAMPLES_TO_SEND);
+  phoenix_sample_t *samples=NULL;
+  int64_t *ids=NULL, *seqs=NULL;
   long long timestamp=phoenix_get_timestamp();
   time_t unix_time=timestamp/1000;
 
@@ -15,25 +292,79 @@ int phoenix_connection_handle(phoenix_t *phoenix) {
     }
   }
 
-  if(phoenix->messages_in_flight<MIN_MESSAGES_IN_FLIGHT) {
-    num_samples=db_samples_read(samples, MAX_SAMPLES_TO_SEND);
+  //Apply the acks that did not fill a batch
+  inflight_flush();
+
+  //Batches in flight are waited on here, the uploader sleeps when none are
+  if(phoenix->http) {
+    phoenix->backlog = phoenix_http_upload(phoenix,HTTP_POLL_MS);
+    goto cleanup;
+  }
+
+  //Nothing is published while disconnected, the connect callback wakes the
+  //uploader again. Until then it only wakes for new samples and acks
+  if(!phoenix->connected) {
+    phoenix->backlog=0;
+    goto cleanup;
+  }
 
-    if(phoenix->http) {
-      status = phoenix_http_send_samples(phoenix,samples,num_samples);
+  //Every message is a window slot, one sample each unless frames are on
+  window_expire(window_time_ms());
+  room=window_room();
+  //Without room there may be samples waiting, look again on the next ack
+  phoenix->backlog=1;
+  if(room > 0) {
+    if(session_resuming()) {
+      status = phoenix_connection_resume(phoenix,room);
       goto cleanup;
-    }else{
-      debug_printf("Messages in flight: %d\n", phoenix->messages_in_flight);
+    }
+
+    if(phoenix->frame_max_size > 0) {
+      status = phoenix_connection_send_frames(phoenix,timestamp,room);
+      goto cleanup;
+    }
+
+    samples=calloc(sizeof(phoenix_sample_t),room);
+    num_samples=db_samples_read(samples, room);
+    phoenix->backlog = num_samples == room;
+
+    debug_printf("Messages in flight: %d, room %d\n", phoenix->messages_in_flight, room);
+    //One sequence number per message, recorded for the whole round at once
+    ids=calloc(sizeof(int64_t),num_samples ? num_samples : 1);
+    seqs=calloc(sizeof(int64_t),num_samples ? num_samples : 1);
+    for(i=0;i<num_samples;i++) {
+      ids[i]=samples[i].id;
+      seqs[i]=session_next();
+    }
+    if(session_record(ids,seqs,num_samples) == 0) {
       for(i=0;i<num_samples;i++) {
         sample=&(samples[i]);
-        phoenix_mqtt_send_sample(phoenix,sample);
+        //Never published, it goes out under a new number
+        if(phoenix_mqtt_send_sample(phoenix,sample,seqs[i])) {
+          session_forget(&ids[i],1);
+          status=-1;
+        }
       }
     }
   }
 
 cleanup:
   free(samples);
+  free(ids);
+  free(seqs);
 
   return status;
 }
 
+//With the upload thread of phoenix_init_http() running, the thread does the
+//rounds and this returns 0 straight away. Without it, as with MQTT, every
+//call is one round
+int phoenix_connection_handle(phoenix_t *phoenix) {
+  if(phoenix->http && phoenix_http_running(phoenix)) {
+    return 0;
+  }
+
+  return connection_handle(phoenix);
+}
+
 
@@ -3,25 +3,85 @@
 #include <stdint.h>
 #include <linux/limits.h>
 #include <math.h>
+#include <time.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 #include <phoenix.h>
+#include "journal.h"
+#include "hashmap.h"
 
-#define SAMPLES_INSERT_STMT "INSERT INTO samples VALUES(NULL,?,?,?,0,NULL);"
-#define SAMPLES_READ_STMT "SELECT id,code,timestamp,value FROM samples WHERE is_sent=? AND message_id IS NULL ORDER BY timestamp DESC LIMIT ?;"
+#define SAMPLES_INSERT_STMT "INSERT INTO samples(stream_id,timestamp,value) VALUES(?,?,?);"
+//The WHERE clause must match the samples_pending partial index literally
+#define SAMPLES_READ_STMT "SELECT id,stream_id,timestamp,value FROM samples WHERE is_sent=0 AND message_id IS NULL ORDER BY timestamp DESC LIMIT ?;"
 #define SAMPLES_IS_SENT_STMT "UPDATE samples SET is_sent=1 WHERE id = ?;"
-#define SAMPLES_DELETE_STMT "DELETE FROM samples WHERE message_id = ?;"
+#define SAMPLES_DELETE_STMT "DELETE FROM samples WHERE id = ?;"
 #define SAMPLES_MESSAGE_ID_IS_SENT_STMT "UPDATE samples SET is_sent=1 WHERE message_id = ?;"
 #define SAMPLES_MESSAGE_ID_SET_STMT "UPDATE samples SET message_id=? WHERE id = ?;"
+#define SAMPLES_REPLAY_INSERT_STMT "INSERT OR IGNORE INTO samples(id,stream_id,timestamp,value) VALUES(?,?,?,?);"
+#define SAMPLES_RANGE_SENT_STMT "UPDATE samples SET is_sent=1 WHERE id BETWEEN ? AND ?;"
+#define SAMPLES_RANGE_DELETE_STMT "DELETE FROM samples WHERE id BETWEEN ? AND ?;"
+#define SAMPLES_RANGE_SEQ_STMT "UPDATE samples SET message_id=? WHERE id BETWEEN ? AND ?;"
+#define SAMPLES_DELIVERED_READ_STMT "SELECT id,stream_id,timestamp,value,message_id FROM samples WHERE message_id > ? AND is_sent=0 ORDER BY message_id, id LIMIT ?;"
+#define STREAMS_INSERT_STMT "INSERT INTO streams(code) VALUES(?);"
+#define CONF_UPSERT_STMT "INSERT INTO %s(key,value) VALUES(?,?) ON CONFLICT(key) DO UPDATE SET value=excluded.value;"
 
 
 static sqlite3 *db=NULL;
 static char workpath[PATH_MAX-1];
-static pthread_mutex_t db_mutex;
+static db_startup_mode_t startup_mode=DB_STARTUP_RESTORE;
+static pthread_mutex_t db_mutex=PTHREAD_MUTEX_INITIALIZER;
 static sqlite3_stmt *db_sample_insert_stmt;
 static sqlite3_stmt *db_samples_read_stmt;
 static sqlite3_stmt *db_sample_is_sent_stmt;
 static sqlite3_stmt *db_sample_delete_stmt;
 static sqlite3_stmt *db_sample_message_id_set_stmt;
 static sqlite3_stmt *db_sample_message_id_is_sent_stmt;
+static sqlite3_stmt *db_samples_range_sent_stmt;
+static sqlite3_stmt *db_samples_range_delete_stmt;
+static sqlite3_stmt *db_samples_range_seq_stmt;
+static sqlite3_stmt *db_samples_delivered_read_stmt;
+static sqlite3_stmt *db_samples_replay_insert_stmt;
+static int64_t session_seq_replayed=0;
+static sqlite3_stmt *db_stream_insert_stmt;
+
+//Stream code <-> id cache. Codes are never freed, so returned pointers stay valid
+static hashmap_t *stream_ids=NULL;
+static char **stream_codes=NULL;
+static int stream_codes_size=0;
+static pthread_rwlock_t stream_lock=PTHREAD_RWLOCK_INITIALIZER;
+
+//Prepared statements of the generic accessors, keyed by their SQL text
+static hashmap_t *stmt_cache=NULL;
+static int stmt_cache_enabled=1;
+static db_stmt_stats_t stmt_stats;
+
+//Config tables served from memory, see db_conf_load()
+typedef struct {
+  int type;         //SQLITE_INTEGER, SQLITE_FLOAT, SQLITE_TEXT or SQLITE_NULL
+  int64_t int64;
+  double real;
+  char *text;
+  int dirty;
+} conf_value_t;
+
+static const char *conf_tables[]={"conf_str","conf_double"};
+#define CONF_TABLES (sizeof(conf_tables)/sizeof(conf_tables[0]))
+static hashmap_t *conf_cache[CONF_TABLES];
+static sqlite3_stmt *conf_upsert_stmt[CONF_TABLES];
+static int conf_loaded=0;
+static int conf_write_behind=1;
+static int conf_dirty=0;
+static pthread_mutex_t conf_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+static db_snapshot_stats_t snapshot_stats;
+static int snapshot_interval_ms;
+static int snapshot_budget_ms;
+static volatile int snapshot_running=0;
+static pthread_t snapshot_thread;
+static pthread_mutex_t snapshot_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t snapshot_cond=PTHREAD_COND_INITIALIZER;
 
 static const char* const database_structure[] = {
   "CREATE TABLE IF NOT EXISTS conf_str(id INTEGER PRIMARY KEY AUTOINCREMENT, key STRING NOT NULL UNIQUE, value STRING);",
@@ -29,6 +89,19 @@ static const char* const database_structure[] = {
   "CREATE TABLE IF NOT EXISTS samples(id INTEGER PRIMARY KEY AUTOINCREMENT, code STRING NOT NULL, timestamp STRING NOT NULL, value DOUBLE, is_sent INT DEFAULT 0);",
   "DROP TABLE SAMPLES",
   "CREATE TABLE samples(id INTEGER PRIMARY KEY AUTOINCREMENT, code STRING NOT NULL, timestamp INTEGER NOT NULL, value DOUBLE, is_sent INT DEFAULT 0, message_id INTEGER NULL);",
+  "CREATE INDEX IF NOT EXISTS samples_message_id ON samples(message_id) WHERE message_id IS NOT NULL;",
+  //Intern stream codes, samples reference streams by id
+  "CREATE TABLE IF NOT EXISTS streams(id INTEGER PRIMARY KEY AUTOINCREMENT, code STRING NOT NULL UNIQUE);",
+  "INSERT OR IGNORE INTO streams(code) SELECT DISTINCT code FROM samples;",
+  "CREATE TABLE samples_interned(id INTEGER PRIMARY KEY AUTOINCREMENT, stream_id INTEGER NOT NULL, timestamp INTEGER NOT NULL, value DOUBLE, is_sent INT DEFAULT 0, message_id INTEGER NULL);",
+  "INSERT INTO samples_interned SELECT samples.id, streams.id, samples.timestamp, samples.value, samples.is_sent, samples.message_id FROM samples JOIN streams ON streams.code = samples.code;",
+  "DELETE FROM sqlite_sequence WHERE name = 'samples_interned';",
+  "INSERT INTO sqlite_sequence(name,seq) SELECT 'samples_interned', seq FROM sqlite_sequence WHERE name = 'samples';",
+  "DROP TABLE samples;",
+  "ALTER TABLE samples_interned RENAME TO samples;",
+  "CREATE INDEX IF NOT EXISTS samples_message_id ON samples(message_id) WHERE message_id IS NOT NULL;",
+  //Send queue, covers db_samples_read() so fetching a batch never scans the backlog
+  "CREATE INDEX IF NOT EXISTS samples_pending ON samples(timestamp, stream_id, value) WHERE is_sent=0 AND message_id IS NULL;",
 };
 
 int db_copy(sqlite3 *dst, sqlite3 *src) {
@@ -41,8 +114,12 @@ int db_copy(sqlite3 *dst, sqlite3 *src) {
   }
 
   do { 
-    ret=sqlite3_backup_step(backup,1);
-  } while(ret != SQLITE_DONE);
+    ret=sqlite3_backup_step(backup,-1);
+  } while(ret == SQLITE_OK || ret == SQLITE_BUSY || ret == SQLITE_LOCKED);
+
+  if(ret != SQLITE_DONE) {
+    print_error("Database copy failed: %s\n", sqlite3_errstr(ret));
+  }
 
   return sqlite3_backup_finish(backup);
   
@@ -78,35 +155,818 @@ int db_restore() {
   return ret;
 }
 
-int db_save() {
+static double db_time_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1e3 + ts.tv_nsec/1e6;
+}
+
+/*
+ * Copy the in-memory database to phoenix.db without stalling writers.
+ *
+ * Pages are copied in batches while db_mutex is held and the lock is
+ * released between batches. The batch size is adapted so a single step
+ * stays within the stall budget. The copy goes to a temporary file that
+ * replaces phoenix.db once complete, so a power cut never leaves a half
+ * written snapshot behind.
+ */
+int db_snapshot() {
+  char dbpath[PATH_MAX], tmppath[PATH_MAX];
+  sqlite3 *persistent;
+  sqlite3_backup *backup;
+  int ret, fd, status=0;
+  int pages=DB_SNAPSHOT_MIN_PAGES;
+  int budget_ms=snapshot_budget_ms > 0 ? snapshot_budget_ms : DB_SNAPSHOT_STALL_BUDGET_MS;
+  double start, step_start, stall, max_stall=0, total_stall=0;
+
+  sprintf(dbpath,"%s/phoenix.db",workpath);
+  sprintf(tmppath,"%s/phoenix.db.tmp",workpath);
+
+  //Config written behind must be part of the snapshot
+  db_conf_flush();
+
+  pthread_mutex_lock(&snapshot_mutex);
+  start=db_time_ms();
+
+  if(startup_mode == DB_STARTUP_LAZY) {
+    //phoenix.db is the live database, only the WAL needs to be folded in
+    if((ret=sqlite3_wal_checkpoint_v2(db,NULL,SQLITE_CHECKPOINT_PASSIVE,&snapshot_stats.pages,NULL)) != SQLITE_OK) {
+      print_error("Checkpoint failed: %s\n", sqlite3_errstr(ret));
+      status=-1;
+    }
+    goto cleanup;
+  }
+
+  unlink(tmppath);
+
+  if(sqlite3_open(tmppath, &persistent)) {
+    print_error("Can't open snapshot database: %s -> %s\n", tmppath, sqlite3_errmsg(persistent));
+    sqlite3_close(persistent);
+    status=-1;
+    goto cleanup;
+  }
+
+  //The final step commits the copy while db_mutex is held. Skip SQLite's
+  //own syncing there and fsync the file after the lock is released
+  sqlite3_exec(persistent,"PRAGMA synchronous=OFF; PRAGMA journal_mode=OFF;",NULL,0,NULL);
+
+  backup=sqlite3_backup_init(persistent,"main",db,"main");
+  if(backup==NULL) {
+    print_error("Could not start snapshot: %s\n", sqlite3_errmsg(persistent));
+    sqlite3_close(persistent);
+    status=-1;
+    goto cleanup;
+  }
+
+  do {
+    pthread_mutex_lock(&db_mutex);
+    step_start=db_time_ms();
+    ret=sqlite3_backup_step(backup,pages);
+    if(ret == SQLITE_DONE) {
+      //The snapshot holds everything journaled so far. Only the cut is
+      //recorded here, the journal is rotated once db_mutex is released
+      journal_cut();
+    }
+    stall=db_time_ms()-step_start;
+    pthread_mutex_unlock(&db_mutex);
+
+    total_stall+=stall;
+    if(stall > max_stall) {
+      max_stall=stall;
+    }
+
+    if(stall > budget_ms && pages > 1) {
+      pages/=2;
+    }else if(stall*4 < budget_ms && pages < DB_SNAPSHOT_MAX_PAGES) {
+      pages*=2;
+    }
+
+    if(ret != SQLITE_DONE) {
+      sched_yield();
+    }
+  } while(ret == SQLITE_OK || ret == SQLITE_BUSY || ret == SQLITE_LOCKED);
+
+  pthread_mutex_lock(&db_mutex);
+  snapshot_stats.pages=sqlite3_backup_pagecount(backup);
+  pthread_mutex_unlock(&db_mutex);
+
+  if(ret == SQLITE_DONE && journal_rotate()) {
+    print_error("Could not rotate journal\n");
+  }
+
+  sqlite3_backup_finish(backup);
+  sqlite3_close(persistent);
+
+  if(ret != SQLITE_DONE) {
+    print_error("Snapshot failed: %s\n", sqlite3_errstr(ret));
+    unlink(tmppath);
+    status=-1;
+    goto cleanup;
+  }
+
+  fd=open(tmppath,O_RDONLY);
+  if(fd < 0 || fsync(fd)) {
+    print_error("Could not sync snapshot %s: %s\n", tmppath, strerror(errno));
+    if(fd >= 0) {
+      close(fd);
+    }
+    status=-1;
+    goto cleanup;
+  }
+  close(fd);
+
+  if(rename(tmppath,dbpath)) {
+    print_error("Could not replace %s: %s\n", dbpath, strerror(errno));
+    status=-1;
+    goto cleanup;
+  }
+
+  //Make the rename durable before the rotated journal is dropped
+  fd=open(workpath,O_RDONLY);
+  if(fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+  journal_drop_rotated();
+
+cleanup:
+  snapshot_stats.duration_ms=db_time_ms()-start;
+  snapshot_stats.max_stall_ms=max_stall;
+  snapshot_stats.total_stall_ms=total_stall;
+  if(status) {
+    snapshot_stats.failures++;
+  }else{
+    snapshot_stats.snapshots++;
+  }
+  pthread_mutex_unlock(&snapshot_mutex);
+
+  return status;
+}
+
+static void *db_snapshot_handler(void *input) {
+  struct timespec deadline;
+
+  pthread_mutex_lock(&snapshot_mutex);
+  while(snapshot_running) {
+    clock_gettime(CLOCK_REALTIME,&deadline);
+    deadline.tv_sec+=snapshot_interval_ms/1000;
+    deadline.tv_nsec+=(snapshot_interval_ms%1000)*1000000L;
+    if(deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec-=1000000000L;
+    }
+
+    if(pthread_cond_timedwait(&snapshot_cond,&snapshot_mutex,&deadline) == ETIMEDOUT && snapshot_running) {
+      pthread_mutex_unlock(&snapshot_mutex);
+      if(db_snapshot()) {
+        print_error("Periodic snapshot failed\n");
+      }
+      pthread_mutex_lock(&snapshot_mutex);
+    }
+  }
+  pthread_mutex_unlock(&snapshot_mutex);
+
+  return NULL;
+}
+
+int db_snapshot_start(int interval_ms, int stall_budget_ms) {
+  if(snapshot_running) {
+    print_error("Snapshot thread already running\n");
+    return -1;
+  }
+
+  snapshot_interval_ms=interval_ms;
+  snapshot_budget_ms=stall_budget_ms;
+  snapshot_running=1;
+
+  if(pthread_create(&snapshot_thread,NULL,db_snapshot_handler,NULL)) {
+    print_error("Could not start snapshot thread\n");
+    snapshot_running=0;
+    return -1;
+  }
+
+  return 0;
+}
+
+void db_snapshot_stop() {
+  if(!snapshot_running) {
+    return;
+  }
+
+  pthread_mutex_lock(&snapshot_mutex);
+  snapshot_running=0;
+  pthread_cond_signal(&snapshot_cond);
+  pthread_mutex_unlock(&snapshot_mutex);
+
+  pthread_join(snapshot_thread,NULL);
+}
+
+void db_snapshot_stats(db_snapshot_stats_t *stats) {
+  pthread_mutex_lock(&snapshot_mutex);
+  *stats=snapshot_stats;
+  pthread_mutex_unlock(&snapshot_mutex);
+}
+
+static int db_step(sqlite3_stmt *stmt) {
+  int err;
+
+  while((err=sqlite3_step(stmt)) == SQLITE_ROW) {}
+  sqlite3_reset(stmt);
+
+  return err == SQLITE_DONE ? 0 : -1;
+}
+
+//Caller must hold the stream write lock
+static int db_stream_cache_add(int id, const char *code) {
+  int size;
+
+  if(id >= stream_codes_size) {
+    size = stream_codes_size ? stream_codes_size : 64;
+    while(size <= id) {
+      size*=2;
+    }
+    stream_codes=realloc(stream_codes,sizeof(char *)*size);
+    memset(stream_codes+stream_codes_size,0,sizeof(char *)*(size-stream_codes_size));
+    stream_codes_size=size;
+  }
+
+  stream_codes[id]=strdup(code);
+  return hashmap_put(stream_ids,code,(void *)(intptr_t)id);
+}
+
+static int db_streams_load() {
+  sqlite3_stmt *stmt;
+  int num_streams=0;
+
+  stream_ids=hashmap_new(256);
+
+  if(sqlite3_prepare_v2(db,"SELECT id,code FROM streams;",-1,&stmt,NULL)!=SQLITE_OK) {
+    print_error("Error preparing statement: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+
+  pthread_rwlock_wrlock(&stream_lock);
+  while(sqlite3_step(stmt) == SQLITE_ROW) {
+    db_stream_cache_add(sqlite3_column_int(stmt,0),(const char *)sqlite3_column_text(stmt,1));
+    num_streams++;
+  }
+  pthread_rwlock_unlock(&stream_lock);
+  sqlite3_finalize(stmt);
+
+  print_info("Loaded %d streams\n", num_streams);
+  return 0;
+}
+
+//Return the id of the stream, creating it on first use
+int db_stream_id(char *code) {
+  void *value;
+  int id=-1;
+
+  pthread_rwlock_rdlock(&stream_lock);
+  if(hashmap_get(stream_ids,code,&value)) {
+    id=(intptr_t)value;
+  }
+  pthread_rwlock_unlock(&stream_lock);
+
+  if(id >= 0) {
+    return id;
+  }
+
+  pthread_mutex_lock(&db_mutex);
+  pthread_rwlock_wrlock(&stream_lock);
+  if(hashmap_get(stream_ids,code,&value)) {
+    //Created by someone else in the mean time
+    id=(intptr_t)value;
+    goto cleanup;
+  }
+
+  sqlite3_bind_text(db_stream_insert_stmt,1,code,-1,SQLITE_TRANSIENT);
+  if(db_step(db_stream_insert_stmt)) {
+    print_error("Could not create stream %s: %s\n", code, sqlite3_errmsg(db));
+    goto cleanup;
+  }
+
+  id=sqlite3_last_insert_rowid(db);
+  db_stream_cache_add(id,code);
+
+cleanup:
+  pthread_rwlock_unlock(&stream_lock);
+  pthread_mutex_unlock(&db_mutex);
+  return id;
+}
+
+const char *db_stream_code(int stream_id) {
+  const char *code=NULL;
+
+  pthread_rwlock_rdlock(&stream_lock);
+  if(stream_id >= 0 && stream_id < stream_codes_size) {
+    code=stream_codes[stream_id];
+  }
+  pthread_rwlock_unlock(&stream_lock);
+
+  return code;
+}
+
+/*
+ * Statement cache for the generic table accessors.
+ *
+ * The SQL text is built from the table, the operation and the column set,
+ * so it serves as the cache key. Cached statements are only used with
+ * db_mutex held and are reset after every use. db_exec() may change the
+ * schema, so it empties the cache.
+ */
+static void db_stmt_finalize(const char *key, void *value, void *arg) {
+  sqlite3_finalize(value);
+}
+
+//Caller must hold db_mutex
+static void db_stmt_cache_clear() {
+  if(stmt_cache) {
+    hashmap_foreach(stmt_cache,db_stmt_finalize,NULL);
+    hashmap_free(stmt_cache);
+    stmt_cache=NULL;
+  }
+}
+
+//Caller must hold db_mutex
+static sqlite3_stmt *db_stmt_prepare(const char *sql) {
+  sqlite3_stmt *stmt;
+  double start;
+
+  if(stmt_cache_enabled && stmt_cache && hashmap_get(stmt_cache,sql,(void **)&stmt)) {
+    stmt_stats.hits++;
+    return stmt;
+  }
+
+  start=db_time_ms();
+  if(sqlite3_prepare_v2(db,sql,-1,&stmt,NULL)!=SQLITE_OK) {
+    print_error("Error preparing statement '%s': %s\n", sql, sqlite3_errmsg(db));
+    return NULL;
+  }
+  stmt_stats.compiles++;
+  stmt_stats.compile_ms+=db_time_ms()-start;
+
+  if(stmt_cache_enabled) {
+    if(stmt_cache == NULL) {
+      stmt_cache=hashmap_new(64);
+    }
+    hashmap_put(stmt_cache,sql,stmt);
+  }
+
+  return stmt;
+}
+
+//Caller must hold db_mutex
+static void db_stmt_release(sqlite3_stmt *stmt) {
+  if(stmt_cache_enabled) {
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+  }else{
+    sqlite3_finalize(stmt);
+  }
+}
+
+void db_stmt_cache_enable(int enabled) {
+  pthread_mutex_lock(&db_mutex);
+  db_stmt_cache_clear();
+  stmt_cache_enabled=enabled;
+  pthread_mutex_unlock(&db_mutex);
+}
+
+void db_stmt_stats(db_stmt_stats_t *stats) {
+  pthread_mutex_lock(&db_mutex);
+  *stats=stmt_stats;
+  stats->cached = stmt_cache ? stmt_cache->count : 0;
+  pthread_mutex_unlock(&db_mutex);
+}
+
+//Read the value of key from a key/value table. Returns 1 if found
+static int db_value_get(char *table, char *key, database_type_t type, void *result) {
+  char sql[512];
+  sqlite3_stmt *stmt;
+  const char *text;
+  int found=0;
+
+  sprintf(sql,"SELECT value FROM %s WHERE key = ?",table);
+
+  pthread_mutex_lock(&db_mutex);
+  if((stmt=db_stmt_prepare(sql)) == NULL) {
+    pthread_mutex_unlock(&db_mutex);
+    return -1;
+  }
+
+  sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+
+  if(sqlite3_step(stmt) == SQLITE_ROW) {
+    found=1;
+    switch(type) {
+      case DBTYPE_DOUBLE:
+        *(double *)result=sqlite3_column_double(stmt,0);
+        break;
+      case DBTYPE_INT64:
+        *(int64_t *)result=sqlite3_column_int64(stmt,0);
+        break;
+      case DBTYPE_STRING:
+        text=(const char *)sqlite3_column_text(stmt,0);
+        *(char **)result = text ? strdup(text) : NULL;
+        break;
+      default:
+        print_error("Unhandled database type: %d\n", type);
+    }
+  }
+  db_stmt_release(stmt);
+  pthread_mutex_unlock(&db_mutex);
+
+  return found;
+}
+
+/*
+ * Config cache.
+ *
+ * conf_str and conf_double are read into hash maps at db_init() and every
+ * get is served from memory. In restore mode sets are written behind: they
+ * are kept dirty and written in one transaction once DB_CONF_FLUSH_WRITES
+ * are pending and before every snapshot, so nothing is lost that the
+ * snapshot would have saved. In lazy mode every commit is durable on its
+ * own, so sets are written through.
+ */
+static int db_conf_table(char *table) {
+  int i;
+
+  if(!conf_loaded) {
+    return -1;
+  }
+
+  for(i=0;i<CONF_TABLES;i++) {
+    if(strcmp(table,conf_tables[i]) == 0) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static void db_conf_value_free(const char *key, void *value, void *arg) {
+  free(((conf_value_t *)value)->text);
+  free(value);
+}
+
+static void db_conf_free() {
+  int i;
+
+  conf_loaded=0;
+  for(i=0;i<CONF_TABLES;i++) {
+    if(conf_cache[i]) {
+      hashmap_foreach(conf_cache[i],db_conf_value_free,NULL);
+      hashmap_free(conf_cache[i]);
+      conf_cache[i]=NULL;
+    }
+    sqlite3_finalize(conf_upsert_stmt[i]);
+    conf_upsert_stmt[i]=NULL;
+  }
+  conf_dirty=0;
+}
+
+static int db_conf_load() {
+  sqlite3_stmt *stmt;
+  conf_value_t *value;
+  char sql[512];
+  int i;
+
+  pthread_mutex_lock(&conf_mutex);
+  db_conf_free();
+
+  for(i=0;i<CONF_TABLES;i++) {
+    conf_cache[i]=hashmap_new(64);
+
+    sprintf(sql,CONF_UPSERT_STMT,conf_tables[i]);
+    if(sqlite3_prepare_v2(db,sql,-1,&conf_upsert_stmt[i],NULL)!=SQLITE_OK) {
+      print_error("Error preparing statement: %s\n", sqlite3_errmsg(db));
+      goto error;
+    }
+
+    sprintf(sql,"SELECT key,value FROM %s;",conf_tables[i]);
+    if(sqlite3_prepare_v2(db,sql,-1,&stmt,NULL)!=SQLITE_OK) {
+      print_error("Error preparing statement: %s\n", sqlite3_errmsg(db));
+      goto error;
+    }
+
+    while(sqlite3_step(stmt) == SQLITE_ROW) {
+      value=calloc(sizeof(conf_value_t),1);
+      value->type=sqlite3_column_type(stmt,1);
+      value->int64=sqlite3_column_int64(stmt,1);
+      value->real=sqlite3_column_double(stmt,1);
+      if(value->type == SQLITE_TEXT) {
+        value->text=strdup((const char *)sqlite3_column_text(stmt,1));
+      }
+      hashmap_put(conf_cache[i],(const char *)sqlite3_column_text(stmt,0),value);
+    }
+    sqlite3_finalize(stmt);
+  }
+
+  conf_write_behind = startup_mode == DB_STARTUP_RESTORE;
+  conf_loaded=1;
+  pthread_mutex_unlock(&conf_mutex);
+  return 0;
+
+error:
+  db_conf_free();
+  pthread_mutex_unlock(&conf_mutex);
+  return -1;
+}
+
+//Caller must hold conf_mutex
+static int db_conf_write(int table, const char *key, conf_value_t *value) {
+  sqlite3_stmt *stmt=conf_upsert_stmt[table];
+
+  sqlite3_bind_text(stmt,1,key,-1,SQLITE_STATIC);
+  switch(value->type) {
+    case SQLITE_INTEGER:
+      sqlite3_bind_int64(stmt,2,value->int64);
+      break;
+    case SQLITE_FLOAT:
+      sqlite3_bind_double(stmt,2,value->real);
+      break;
+    case SQLITE_TEXT:
+      sqlite3_bind_text(stmt,2,value->text,-1,SQLITE_STATIC);
+      break;
+    default:
+      sqlite3_bind_null(stmt,2);
+  }
+
+  if(db_step(stmt)) {
+    print_error("Could not write %s.%s: %s\n", conf_tables[table], key, sqlite3_errmsg(db));
+    return -1;
+  }
+  value->dirty=0;
+
+  return 0;
+}
+
+typedef struct {
+  int table;
+  int status;
+} conf_flush_t;
+
+static void db_conf_flush_value(const char *key, void *value, void *arg) {
+  conf_flush_t *flush=arg;
+
+  if(((conf_value_t *)value)->dirty && db_conf_write(flush->table,key,value)) {
+    flush->status=-1;
+  }
+}
+
+//Caller must hold conf_mutex
+static int db_conf_flush_locked() {
+  conf_flush_t flush={0,0};
+
+  if(conf_dirty == 0) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&db_mutex);
+  sqlite3_exec(db,"BEGIN;",NULL,NULL,NULL);
+  for(flush.table=0;flush.table<CONF_TABLES;flush.table++) {
+    hashmap_foreach(conf_cache[flush.table],db_conf_flush_value,&flush);
+  }
+  if(sqlite3_exec(db,"COMMIT;",NULL,NULL,NULL) != SQLITE_OK) {
+    print_error("Could not commit config: %s\n", sqlite3_errmsg(db));
+    sqlite3_exec(db,"ROLLBACK;",NULL,NULL,NULL);
+    flush.status=-1;
+  }
+  pthread_mutex_unlock(&db_mutex);
+
+  conf_dirty=0;
+  return flush.status;
+}
+
+int db_conf_flush() {
+  int status;
+
+  pthread_mutex_lock(&conf_mutex);
+  status=db_conf_flush_locked();
+  pthread_mutex_unlock(&conf_mutex);
+
+  return status;
+}
+
+void db_conf_write_behind_set(int enabled) {
+  pthread_mutex_lock(&conf_mutex);
+  if(!enabled) {
+    db_conf_flush_locked();
+  }
+  conf_write_behind=enabled;
+  pthread_mutex_unlock(&conf_mutex);
+}
+
+//Read a cached value as type. Returns -1 if table is not cached, 0 otherwise
+//with result untouched if the key is missing
+static int db_conf_get(char *table, char *key, database_type_t type, void *result) {
+  conf_value_t *value;
+  char text[64];
+  int i=db_conf_table(table);
+
+  if(i < 0) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&conf_mutex);
+  if(hashmap_get(conf_cache[i],key,(void **)&value)) {
+    switch(type) {
+      case DBTYPE_DOUBLE:
+        *(double *)result = value->type == SQLITE_INTEGER ? (double)value->int64 :
+          value->type == SQLITE_TEXT ? strtod(value->text,NULL) : value->real;
+        break;
+      case DBTYPE_INT64:
+        *(int64_t *)result = value->type == SQLITE_FLOAT ? (int64_t)value->real :
+          value->type == SQLITE_TEXT ? strtoll(value->text,NULL,10) : value->int64;
+        break;
+      case DBTYPE_STRING:
+        if(value->type == SQLITE_TEXT) {
+          *(char **)result=strdup(value->text);
+        }else if(value->type == SQLITE_INTEGER) {
+          sprintf(text,"%lld",(long long)value->int64);
+          *(char **)result=strdup(text);
+        }else if(value->type == SQLITE_FLOAT) {
+          //Same formatting as sqlite3_column_text()
+          sqlite3_snprintf(sizeof(text),text,"%!.15g",value->real);
+          *(char **)result=strdup(text);
+        }
+        break;
+      default:
+        break;
+    }
+  }
+  pthread_mutex_unlock(&conf_mutex);
+
+  return 0;
+}
+
+//Store value in the cache. Returns -1 if table is not cached
+static int db_conf_set(char *table, char *key, void *data, database_type_t type) {
+  conf_value_t *value;
+  int status=0;
+  int i=db_conf_table(table);
+
+  if(i < 0) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&conf_mutex);
+  if(!hashmap_get(conf_cache[i],key,(void **)&value)) {
+    value=calloc(sizeof(conf_value_t),1);
+    hashmap_put(conf_cache[i],key,value);
+  }
+
+  free(value->text);
+  value->text=NULL;
+  switch(type) {
+    case DBTYPE_DOUBLE:
+      value->type=SQLITE_FLOAT;
+      value->real=*(double *)data;
+      break;
+    case DBTYPE_INT64:
+      value->type=SQLITE_INTEGER;
+      value->int64=*(int64_t *)data;
+      break;
+    case DBTYPE_STRING:
+      value->type=SQLITE_TEXT;
+      value->text=strdup((char *)data);
+      break;
+    default:
+      value->type=SQLITE_NULL;
+  }
+
+  if(!value->dirty) {
+    value->dirty=1;
+    conf_dirty++;
+  }
+
+  if(!conf_write_behind || conf_dirty >= DB_CONF_FLUSH_WRITES) {
+    status=db_conf_flush_locked();
+  }
+  pthread_mutex_unlock(&conf_mutex);
+
+  return status;
+}
+
+static int db_journal_apply(journal_record_t *record, char *stream) {
+  sqlite3_stmt *stmt;
+
+  switch(record->type) {
+    case JOURNAL_SAMPLE_INSERT:
+      sqlite3_bind_int64(db_samples_replay_insert_stmt,1,record->id);
+      sqlite3_bind_int(db_samples_replay_insert_stmt,2,db_stream_id(stream));
+      sqlite3_bind_int64(db_samples_replay_insert_stmt,3,record->arg);
+      sqlite3_bind_double(db_samples_replay_insert_stmt,4,record->value);
+      return db_step(db_samples_replay_insert_stmt);
+    case JOURNAL_SAMPLE_SENT:
+    case JOURNAL_SAMPLE_DELETE:
+      stmt = record->type == JOURNAL_SAMPLE_SENT ? db_sample_is_sent_stmt : db_sample_delete_stmt;
+      sqlite3_bind_int64(stmt,1,record->id);
+      return db_step(stmt);
+    case JOURNAL_SAMPLE_MESSAGE_ID:
+      sqlite3_bind_int64(db_sample_message_id_set_stmt,1,record->arg);
+      sqlite3_bind_int64(db_sample_message_id_set_stmt,2,record->id);
+      return db_step(db_sample_message_id_set_stmt);
+    case JOURNAL_SAMPLE_SENT_BY_MESSAGE_ID:
+      sqlite3_bind_int64(db_sample_message_id_is_sent_stmt,1,record->arg);
+      return db_step(db_sample_message_id_is_sent_stmt);
+    case JOURNAL_SAMPLES_DELETE_SENT:
+      return sqlite3_exec(db,"DELETE FROM samples WHERE is_sent=1;",NULL,0,NULL);
+    case JOURNAL_SAMPLES_CLEAR_MESSAGE_IDS:
+      return sqlite3_exec(db,"UPDATE samples SET message_id=NULL WHERE message_id IS NOT NULL;",NULL,0,NULL);
+    case JOURNAL_SAMPLES_SENT_RANGE:
+      stmt = record->value ? db_samples_range_delete_stmt : db_samples_range_sent_stmt;
+      sqlite3_bind_int64(stmt,1,record->id);
+      sqlite3_bind_int64(stmt,2,record->arg);
+      return db_step(stmt);
+    case JOURNAL_SAMPLES_SEQ_RANGE:
+      if(record->value) {
+        sqlite3_bind_int64(db_samples_range_seq_stmt,1,(int64_t)record->value);
+      }else{
+        sqlite3_bind_null(db_samples_range_seq_stmt,1);
+      }
+      sqlite3_bind_int64(db_samples_range_seq_stmt,2,record->id);
+      sqlite3_bind_int64(db_samples_range_seq_stmt,3,record->arg);
+      return db_step(db_samples_range_seq_stmt);
+    case JOURNAL_SESSION_SEQ:
+      //The config is only saved with snapshots, db_session_seq_get() takes the larger
+      if(record->arg > session_seq_replayed) {
+        session_seq_replayed=record->arg;
+      }
+      return 0;
+    default:
+      print_error("Unknown journal record type: %d\n", record->type);
+      return -1;
+  }
+}
+
+//Returns the number of records replayed or -1
+static int db_journal_replay() {
   int ret;
-  sqlite3 *persistent = db_open_persistent();
-  if(persistent==NULL){
-    print_error("Could not open persisten database");
+
+  if(sqlite3_exec(db,"BEGIN TRANSACTION;",NULL,0,NULL) != SQLITE_OK) {
+    print_error("Could not begin replay transaction: %s\n", sqlite3_errmsg(db));
     return -1;
   }
-  
-  ret=db_copy(persistent,db);
-  sqlite3_close(persistent);
 
-  return ret;
+  ret=journal_replay(workpath,db_journal_apply);
+
+  if(sqlite3_exec(db,"COMMIT;",NULL,0,NULL) != SQLITE_OK) {
+    print_error("Could not commit replay transaction: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+
+  return ret < 0 ? -1 : ret;
+}
+
+void db_startup_mode_set(db_startup_mode_t mode) {
+  startup_mode=mode;
+}
+
+//Work directly on phoenix.db. Nothing is copied at startup, the page cache
+//pulls in the config tables and the head of the send queue on first use
+static int db_open_lazy() {
+  char dbpath[PATH_MAX];
+
+  sprintf(dbpath,"%s/phoenix.db",workpath);
+  if(sqlite3_open(dbpath, &db)) {
+    print_error("Can't open persistent database: %s -> %s\n", dbpath, sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return -1;
+  }
+
+  if(sqlite3_exec(db,"PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL;",NULL,0,NULL) != SQLITE_OK) {
+    print_error("Could not enable WAL on %s: %s\n", dbpath, sqlite3_errmsg(db));
+    return -1;
+  }
+
+  return 0;
 }
 
 int db_init(char *path) {
-  int ret,database_version; 
+  int ret,database_version,replayed=0; 
   char** pStatement=NULL;
   char *zErrMsg = NULL;
 
 
   sprintf(workpath,"%s",path);
-  if( ret=sqlite3_open(":memory:", &db)) {
-    print_error("Can't open in-memory database: %s\n", sqlite3_errmsg(db));
-    sqlite3_close(db);
-    return -1;
-  }
+  inflight_clear();
+  if(startup_mode == DB_STARTUP_LAZY) {
+    if(db_open_lazy()) {
+      return -1;
+    }
+  }else{
+    if( ret=sqlite3_open(":memory:", &db)) {
+      print_error("Can't open in-memory database: %s\n", sqlite3_errmsg(db));
+      sqlite3_close(db);
+      return -1;
+    }
 
-  if(db_restore()) {
-    print_fatal("Could not copy from persistent database to in-memory database");
+    if(db_restore()) {
+      print_fatal("Could not copy from persistent database to in-memory database");
+    }
   }
 
   database_version=db_int64_get("conf_double","database_version");
@@ -124,48 +984,98 @@ int db_init(char *path) {
   print_info("Database version = %d\n", database_version);
   db_int64_set("conf_double","database_version",database_version);
 
-  if(sqlite3_prepare(db,SAMPLES_INSERT_STMT,strlen(SAMPLES_INSERT_STMT), &db_sample_insert_stmt, NULL)!=SQLITE_OK) {
+  if(sqlite3_prepare_v2(db,SAMPLES_INSERT_STMT,strlen(SAMPLES_INSERT_STMT), &db_sample_insert_stmt, NULL)!=SQLITE_OK) {
     print_error("Error preparing statement: %s\n", sqlite3_errmsg(db));
     return -1;
   }
 
-  if(sqlite3_prepare(db,SAMPLES_READ_STMT,strlen(SAMPLES_READ_STMT), &db_samples_read_stmt, NULL)!=SQLITE_OK) {
+  if(sqlite3_prepare_v2(db,SAMPLES_READ_STMT,strlen(SAMPLES_READ_STMT), &db_samples_read_stmt, NULL)!=SQLITE_OK) {
     print_error("Error preparing statement: %s\n", sqlite3_errmsg(db));
     return -1;
   }
 
-  if(sqlite3_prepare(db,SAMPLES_IS_SENT_STMT,strlen(SAMPLES_IS_SENT_STMT), &db_sample_is_sent_stmt, NULL)!=SQLITE_OK) {
+  if(sqlite3_prepare_v2(db,SAMPLES_IS_SENT_STMT,strlen(SAMPLES_IS_SENT_STMT), &db_sample_is_sent_stmt, NULL)!=SQLITE_OK) {
     print_error("Error preparing statement: %s\n", sqlite3_errmsg(db));
     return -1;
   }
 
-  if(sqlite3_prepare(db,SAMPLES_DELETE_STMT,strlen(SAMPLES_DELETE_STMT), &db_sample_delete_stmt, NULL)!=SQLITE_OK) {
+  if(sqlite3_prepare_v2(db,SAMPLES_DELETE_STMT,strlen(SAMPLES_DELETE_STMT), &db_sample_delete_stmt, NULL)!=SQLITE_OK) {
     print_error("Error preparing delete statement: %s\n", sqlite3_errmsg(db));
     return -1;
   }
 
-  if(sqlite3_prepare(db,SAMPLES_MESSAGE_ID_SET_STMT,strlen(SAMPLES_MESSAGE_ID_SET_STMT), &db_sample_message_id_set_stmt, NULL)!=SQLITE_OK) {
+  if(sqlite3_prepare_v2(db,SAMPLES_MESSAGE_ID_SET_STMT,strlen(SAMPLES_MESSAGE_ID_SET_STMT), &db_sample_message_id_set_stmt, NULL)!=SQLITE_OK) {
     print_error("Error preparing message id statement: %s\n", sqlite3_errmsg(db));
     return -1;
   }
 
-  if(sqlite3_prepare(db,SAMPLES_MESSAGE_ID_IS_SENT_STMT,strlen(SAMPLES_MESSAGE_ID_IS_SENT_STMT), &db_sample_message_id_is_sent_stmt, NULL)!=SQLITE_OK) {
+  if(sqlite3_prepare_v2(db,SAMPLES_MESSAGE_ID_IS_SENT_STMT,strlen(SAMPLES_MESSAGE_ID_IS_SENT_STMT), &db_sample_message_id_is_sent_stmt, NULL)!=SQLITE_OK) {
     print_error("Error preparing message id statement: %s\n", sqlite3_errmsg(db));
     return -1;
   }
 
+  if(sqlite3_prepare_v2(db,SAMPLES_RANGE_SENT_STMT,strlen(SAMPLES_RANGE_SENT_STMT), &db_samples_range_sent_stmt, NULL)!=SQLITE_OK) {
+    print_error("Error preparing range statement: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+
+  if(sqlite3_prepare_v2(db,SAMPLES_RANGE_DELETE_STMT,strlen(SAMPLES_RANGE_DELETE_STMT), &db_samples_range_delete_stmt, NULL)!=SQLITE_OK) {
+    print_error("Error preparing range statement: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+
+  if(sqlite3_prepare_v2(db,SAMPLES_RANGE_SEQ_STMT,strlen(SAMPLES_RANGE_SEQ_STMT), &db_samples_range_seq_stmt, NULL)!=SQLITE_OK) {
+    print_error("Error preparing range statement: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
 
+  if(sqlite3_prepare_v2(db,SAMPLES_DELIVERED_READ_STMT,strlen(SAMPLES_DELIVERED_READ_STMT), &db_samples_delivered_read_stmt, NULL)!=SQLITE_OK) {
+    print_error("Error preparing delivered statement: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
 
+  if(sqlite3_prepare_v2(db,STREAMS_INSERT_STMT,strlen(STREAMS_INSERT_STMT), &db_stream_insert_stmt, NULL)!=SQLITE_OK) {
+    print_error("Error preparing stream statement: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
 
-  //Clear all message ids
-  if(ret=sqlite3_exec(db,"UPDATE samples SET message_id=NULL;",NULL,0,zErrMsg) != SQLITE_OK)  {
-    print_error("Could clear message ids: %d -> %s -> %s \n",ret, zErrMsg, sqlite3_errmsg(db));
-    sqlite3_close(db);
+  if(sqlite3_prepare_v2(db,SAMPLES_REPLAY_INSERT_STMT,strlen(SAMPLES_REPLAY_INSERT_STMT), &db_samples_replay_insert_stmt, NULL)!=SQLITE_OK) {
+    print_error("Error preparing replay statement: %s\n", sqlite3_errmsg(db));
+    return -1;
+  }
+
+  if(db_streams_load()) {
+    return -1;
+  }
+
+  if(db_conf_load()) {
     return -1;
   }
 
 
-  pthread_mutex_init(&db_mutex,NULL);
+
+
+  //Bring the snapshot up to date with everything journaled since it was taken
+  if(startup_mode == DB_STARTUP_RESTORE && (replayed=db_journal_replay()) < 0) {
+    print_fatal("Could not replay sample journal");
+  }
+
+  //Message ids hold delivery sequence numbers now. They are kept, so the
+  //batches that were not acknowledged resume under the same numbers
+
+  //In lazy mode SQLite's WAL already makes every commit durable
+  if(startup_mode == DB_STARTUP_RESTORE) {
+    if(journal_open(workpath)) {
+      print_error("Running without sample journal\n");
+    }
+  }
+
+  //The replayed records are in memory only. Snapshot them right away, that
+  //rotates the journal and drops it once phoenix.db holds them, instead of
+  //replaying the same records on every start until the next snapshot
+  if(replayed > 0 && db_snapshot()) {
+    print_error("Could not snapshot replayed journal, it is replayed again on the next start\n");
+  }
 
   return 0;
 }
@@ -175,134 +1085,102 @@ int db_ready() {
   return db!=NULL;
 }
 
+//Finalize the statements db_init() prepared, sqlite3_close() refuses to
+//close a database with statements left. Caller must hold db_mutex
+static void db_stmts_finalize() {
+  sqlite3_stmt **stmts[]={&db_sample_insert_stmt, &db_samples_read_stmt, &db_sample_is_sent_stmt, &db_sample_delete_stmt,
+    &db_sample_message_id_set_stmt, &db_sample_message_id_is_sent_stmt, &db_samples_range_sent_stmt,
+    &db_samples_range_delete_stmt, &db_samples_range_seq_stmt, &db_samples_delivered_read_stmt,
+    &db_samples_replay_insert_stmt, &db_stream_insert_stmt};
+  int i;
+
+  for(i=0;i<sizeof(stmts)/sizeof(stmts[0]);i++) {
+    sqlite3_finalize(*stmts[i]);
+    *stmts[i]=NULL;
+  }
+}
+
 int db_close() {
   int ret;
+  //Samples still waiting in the ingest ring must reach the store first
+  ingest_close();
+  //Acknowledged samples too
+  inflight_flush();
+  db_snapshot_stop();
+
   //Save current database
   print_info("Save database to hard drive\n");
-  if(ret=db_save()) {
+  if(ret=db_snapshot()) {
     print_error("Could not save database to file: %d\n", ret);
   }
-  sqlite3_close(db);
-}
-
-int db_exec(char *sql) {
-  int ret; 
-  char *zErrMsg = NULL;
-
-  printf("DB: Executing: %s\n", sql);
-  if( ret=sqlite3_exec(db,sql,NULL,0,zErrMsg)) {
-    print_error("Error executing '%s' -> %s\n", sql, sqlite3_errmsg(db));
-    sqlite3_close(db);
-    return -1;
-  }
-
-  return 0;
-}
-
-char *db_string_get(char *table, char *key) {
-  int id;
-  char *value=NULL;
-  sqlite3_stmt* stmt;
-  char *str;
-  char sql[512];
-  
-  sprintf(sql,"SELECT id,value FROM %s WHERE key = ?",table);
-  
-  if(sqlite3_prepare(db,sql,strlen(sql), &stmt, NULL)!=SQLITE_OK) {
-    print_error("Error preparing statement: %s\n", sqlite3_errmsg(db));
-    return NULL;
-  }
+  journal_close();
 
-  sqlite3_bind_text(stmt, 1, key, strlen(key),NULL);
+  pthread_mutex_lock(&conf_mutex);
+  db_conf_free();
+  pthread_mutex_unlock(&conf_mutex);
 
-  while (sqlite3_step(stmt) == SQLITE_ROW)
-  {
-    id = sqlite3_column_int(stmt, 0);
-    str=sqlite3_column_text(stmt,1);
-    value=(char *)calloc(sizeof(char),strlen(str)+1);
-    sprintf(value,"%s", sqlite3_column_text(stmt, 1));
-  }
+  pthread_mutex_lock(&db_mutex);
+  db_stmt_cache_clear();
+  db_stmts_finalize();
+  pthread_mutex_unlock(&db_mutex);
 
+  if((ret=sqlite3_close(db)) != SQLITE_OK) {
+    print_error("Could not close database: %s\n", sqlite3_errstr(ret));
+    return -1;
+  }
+  db=NULL;
 
-  sqlite3_finalize(stmt);
-  return value;
+  return 0;
 }
 
+int db_exec(char *sql) {
+  int ret; 
+  char *zErrMsg = NULL;
 
-int db_string_upsert(char *table, char *key, char *value) {
-  int ret;
-  char sql[512];
-  sqlite3_stmt* stmt;
+  printf("DB: Executing: %s\n", sql);
+  //Raw SQL may touch the config tables, keep the cache coherent with them
+  if(conf_loaded && strstr(sql,"conf_") != NULL) {
+    db_conf_flush();
+  }
 
-  sprintf(sql,"INSERT INTO %s VALUES(NULL,?,?);", table);
+  pthread_mutex_lock(&db_mutex);
+  db_stmt_cache_clear();
+  pthread_mutex_unlock(&db_mutex);
 
-  if(sqlite3_prepare(db,sql,strlen(sql), &stmt, NULL)!=SQLITE_OK) {
-    print_error("Error preparing statement: %s\n", sqlite3_errmsg(db));
+  if( ret=sqlite3_exec(db,sql,NULL,0,zErrMsg)) {
+    print_error("Error executing '%s' -> %s\n", sql, sqlite3_errmsg(db));
+    sqlite3_close(db);
     return -1;
   }
 
-  sqlite3_bind_text(stmt, 1, key, strlen(key),NULL);
-  sqlite3_bind_text(stmt, 2, value, strlen(value),NULL);
-
-  while (ret=sqlite3_step(stmt) == SQLITE_ROW)
-  {
-  print_info("ret: %d\n", ret);
-    int id = sqlite3_column_int(stmt, 0);
-    unsigned char* name = sqlite3_column_text(stmt, 1);
-    printf("%d, %s\n", id, name);
+  if(conf_loaded && strstr(sql,"conf_") != NULL) {
+    db_conf_load();
   }
-  sqlite3_finalize(stmt);
-
-  if(ret != SQLITE_DONE) {
-    //Insert failed, try to update
-    sprintf(sql,"UPDATE %s SET value=? WHERE key=?;", table);
-
-    if(sqlite3_prepare(db,sql,strlen(sql), &stmt, NULL)!=SQLITE_OK) {
-      print_error("Error preparing statement: %s\n", sqlite3_errmsg(db));
-      return -1;
-    }
 
-    sqlite3_bind_text(stmt, 1, value, strlen(value),NULL);
-    sqlite3_bind_text(stmt, 2, key, strlen(key),NULL);
+  return 0;
+}
 
-    while (ret=sqlite3_step(stmt) == SQLITE_ROW)
-    {
-      print_info("ret: %d\n", ret);
-      int id = sqlite3_column_int(stmt, 0);
-      unsigned char* name = sqlite3_column_text(stmt, 1);
-      printf("%d, %s\n", id, name);
-    }
-    sqlite3_finalize(stmt);
+char *db_string_get(char *table, char *key) {
+  char *value=NULL;
 
+  if(db_conf_get(table,key,DBTYPE_STRING,&value) == 0) {
+    return value;
   }
 
-  return 0;
+  db_value_get(table,key,DBTYPE_STRING,&value);
+  return value;
 }
 
+
+
 double db_double_get(char *table, char *key) {
-  int id;
   double value=NAN;
-  sqlite3_stmt* stmt;
-  char *str;
-  char sql[512];
-  
-  sprintf(sql,"SELECT id,value FROM %s WHERE key = ?",table);
-  
-  if(sqlite3_prepare(db,sql,strlen(sql), &stmt, NULL)!=SQLITE_OK) {
-    print_error("Error preparing statement: %s\n", sqlite3_errmsg(db));
-    return NAN;
-  }
-
-  sqlite3_bind_text(stmt, 1, key, strlen(key),NULL);
 
-  while (sqlite3_step(stmt) == SQLITE_ROW)
-  {
-    id = sqlite3_column_int(stmt, 0);
-    value=sqlite3_column_double(stmt,1);
+  if(db_conf_get(table,key,DBTYPE_DOUBLE,&value) == 0) {
+    return value;
   }
 
-
-  sqlite3_finalize(stmt);
+  db_value_get(table,key,DBTYPE_DOUBLE,&value);
   return value;
 }
 
@@ -314,6 +1192,9 @@ int db_bind_value(sqlite3_stmt *stmt, int index, void *value, database_type_t va
       case DBTYPE_INT64:
         sqlite3_bind_int64(stmt, index, *((int64_t *)value));
         break;
+      case DBTYPE_STRING:
+        sqlite3_bind_text(stmt, index, (char *)value, -1, SQLITE_STATIC);
+        break;
       default:
         print_error("Unhandled database type: %d\n", value_type);
         return -1;
@@ -324,53 +1205,34 @@ int db_bind_value(sqlite3_stmt *stmt, int index, void *value, database_type_t va
 }
 
 int db_value_set(char *table, char *key, void *value, database_type_t value_type) {
-  int ret;
+  int status=0;
   char sql[512];
   sqlite3_stmt* stmt;
 
-  sprintf(sql,"INSERT INTO %s VALUES(NULL,?,?);", table);
-
-  if(sqlite3_prepare(db,sql,strlen(sql), &stmt, NULL)!=SQLITE_OK) {
-    print_error("Error preparing statement: %s\n", sqlite3_errmsg(db));
-    return -1;
+  if(db_conf_table(table) >= 0) {
+    return db_conf_set(table,key,value,value_type);
   }
 
-  sqlite3_bind_text(stmt, 1, key, strlen(key),NULL);
-  db_bind_value(stmt,2,value,value_type);
+  //One statement, the key column must be UNIQUE
+  sprintf(sql,"INSERT INTO %s(key,value) VALUES(?,?) ON CONFLICT(key) DO UPDATE SET value=excluded.value;", table);
 
-  while (ret=sqlite3_step(stmt) == SQLITE_ROW)
-  {
-  print_info("ret: %d\n", ret);
-    int id = sqlite3_column_int(stmt, 0);
-    unsigned char* name = sqlite3_column_text(stmt, 1);
-    printf("%d, %s\n", id, name);
+  pthread_mutex_lock(&db_mutex);
+  if((stmt=db_stmt_prepare(sql)) == NULL) {
+    pthread_mutex_unlock(&db_mutex);
+    return -1;
   }
-  sqlite3_finalize(stmt);
-
-  if(ret != SQLITE_DONE) {
-    //Insert failed, try to update
-    sprintf(sql,"UPDATE %s SET value=? WHERE key=?;", table);
 
-    if(sqlite3_prepare(db,sql,strlen(sql), &stmt, NULL)!=SQLITE_OK) {
-      print_error("Error preparing statement: %s\n", sqlite3_errmsg(db));
-      return -1;
-    }
-    
-    db_bind_value(stmt,1,value,value_type);
-    sqlite3_bind_text(stmt, 2, key, strlen(key),NULL);
-
-    while (ret=sqlite3_step(stmt) == SQLITE_ROW)
-    {
-      print_info("ret: %d\n", ret);
-      int id = sqlite3_column_int(stmt, 0);
-      unsigned char* name = sqlite3_column_text(stmt, 1);
-      printf("%d, %s\n", id, name);
-    }
-    sqlite3_finalize(stmt);
+  sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+  db_bind_value(stmt,2,value,value_type);
 
+  if(sqlite3_step(stmt) != SQLITE_DONE) {
+    print_error("Error executing '%s' -> %s\n", sql, sqlite3_errmsg(db));
+    status=-1;
   }
+  db_stmt_release(stmt);
+  pthread_mutex_unlock(&db_mutex);
 
-  return 0;
+  return status;
 }
 
 int db_double_set(char *table, char *key, double value) {
@@ -381,6 +1243,10 @@ int db_int64_set(char *table, char *key, int64_t value) {
   return db_value_set(table, key, &value, DBTYPE_INT64);
 }
 
+int db_string_upsert(char *table, char *key, char *value) {
+  return db_value_set(table, key, value, DBTYPE_STRING);
+}
+
 int db_row_ids(char *table, int **ids) {
   sqlite3_stmt* stmt;
   char sql[512];
@@ -389,9 +1255,10 @@ int db_row_ids(char *table, int **ids) {
   debug_printf("Getting ids from %s\n", table);
   
   sprintf(sql,"SELECT id FROM %s",table);
-  
-  if(sqlite3_prepare(db,sql,strlen(sql), &stmt, NULL)!=SQLITE_OK) {
-    print_error("Error preparing statement: %s\n", sqlite3_errmsg(db));
+
+  pthread_mutex_lock(&db_mutex);
+  if((stmt=db_stmt_prepare(sql)) == NULL) {
+    pthread_mutex_unlock(&db_mutex);
     return -1;
   }
 
@@ -402,7 +1269,8 @@ int db_row_ids(char *table, int **ids) {
     *ids=realloc(*ids, sizeof(int) * (num_ids+1));
     (*ids)[num_ids++]=sqlite3_column_int(stmt, 0);
   }
-  sqlite3_finalize(stmt);
+  db_stmt_release(stmt);
+  pthread_mutex_unlock(&db_mutex);
 
   return num_ids;
 }
@@ -423,20 +1291,22 @@ int db_row_read(char *table, int id, database_column_t *columns, int num_columns
     strcat(keys,columns[i].name);
   }
 
-  sprintf(sql,"select %s from %s where id = %d;", keys,table,id);
+  sprintf(sql,"select %s from %s where id = ?;", keys,table);
 
   debug_printf("SQL: %s\n",sql);
 
-  if(sqlite3_prepare(db,sql,strlen(sql), &stmt, NULL)!=SQLITE_OK) {
-    print_error("Error preparing statement: %s\n", sqlite3_errmsg(db));
+  pthread_mutex_lock(&db_mutex);
+  if((stmt=db_stmt_prepare(sql)) == NULL) {
+    pthread_mutex_unlock(&db_mutex);
     return -1;
   }
+  sqlite3_bind_int(stmt,1,id);
 
   num_rows=0;
   while (sqlite3_step(stmt) == SQLITE_ROW)
   {
     num_rows++;
-    printf("Step\n");
+    debug_printf("Step\n");
     for(i=0;i<num_columns;i++) {
       if(sqlite3_column_type(stmt,i)==SQLITE_NULL) {
         columns[i].value=NULL;
@@ -449,7 +1319,7 @@ int db_row_read(char *table, int id, database_column_t *columns, int num_columns
           break;
         case DBTYPE_STRING:
           text = (const char *)sqlite3_column_text(stmt,i);
-          printf("Text: %s\n", text);
+          debug_printf("Text: %s\n", text);
           columns[i].value=malloc(sizeof(char)*(strlen(text)+1));
           sprintf(columns[i].value,"%s",text);
           break;
@@ -464,7 +1334,8 @@ int db_row_read(char *table, int id, database_column_t *columns, int num_columns
   }
  
 
-  sqlite3_finalize(stmt);
+  db_stmt_release(stmt);
+  pthread_mutex_unlock(&db_mutex);
 
 
   return num_rows;
@@ -490,10 +1361,11 @@ int db_row_write(char *table, database_column_t *columns, int num_columns){
 
   sprintf(sql,"INSERT INTO %s(id%s) VALUES(NULL%s);", table,keys,markers);
 
-  printf("SQL(%ld): '%s'\n",strlen(sql),sql);
+  debug_printf("SQL(%ld): '%s'\n",strlen(sql),sql);
 
-  if(sqlite3_prepare(db,sql,strlen(sql), &stmt, NULL)!=SQLITE_OK) {
-    print_error("Error preparing statement: %s\n", sqlite3_errmsg(db));
+  pthread_mutex_lock(&db_mutex);
+  if((stmt=db_stmt_prepare(sql)) == NULL) {
+    pthread_mutex_unlock(&db_mutex);
     return -1;
   }
 
@@ -525,44 +1397,29 @@ int db_row_write(char *table, database_column_t *columns, int num_columns){
   }
 
   while ((ret=sqlite3_step(stmt)) == SQLITE_ROW){
-    printf("stmt executed\n");
+    debug_printf("stmt executed\n");
   }
+  db_stmt_release(stmt);
+  pthread_mutex_unlock(&db_mutex);
+
   if(ret != SQLITE_DONE) {
     print_error("Error executing '%s' -> %s\n", sql, sqlite3_errmsg(db));
     return -1;
   }
 
-  sqlite3_finalize(stmt);
-
 
   return 0;
 
 }
 
 int64_t db_int64_get(char *table, char *key) {
-  int id;
   int64_t value=0;
-  sqlite3_stmt* stmt;
-  char *str;
-  char sql[512];
-  
-  sprintf(sql,"SELECT id,value FROM %s WHERE key = ?",table);
-  
-  if(sqlite3_prepare(db,sql,strlen(sql), &stmt, NULL)!=SQLITE_OK) {
-    print_error("Error preparing statement: %s\n", sqlite3_errmsg(db));
-    return 0;
-  }
 
-  sqlite3_bind_text(stmt, 1, key, strlen(key),NULL);
-
-  while (sqlite3_step(stmt) == SQLITE_ROW)
-  {
-    id = sqlite3_column_int(stmt, 0);
-    value=sqlite3_column_int64(stmt,1);
+  if(db_conf_get(table,key,DBTYPE_INT64,&value) == 0) {
+    return value;
   }
 
-
-  sqlite3_finalize(stmt);
+  db_value_get(table,key,DBTYPE_INT64,&value);
   return value;
 }
 
@@ -589,44 +1446,134 @@ int db_sample_insert_json(struct json_object *sample) {
   return 0; //db_sample_insert(json_object_get_string(code),json_object_get_string(timestamp),json_object_get_double(value));
 }
 
-int db_sample_insert(char *stream, long long timestamp, double value) {
-  int err, status=0;
-  pthread_mutex_lock(&db_mutex);
+//Bind and step the prepared insert statement. Caller must hold db_mutex.
+//*timestamp is set to the one stored
+static int64_t db_sample_insert_locked(int stream_id, long long *timestamp, double value) {
+  int err;
+  int64_t id;
+
   sqlite3_reset(db_sample_insert_stmt);
 
   //All samples before year 2000 is stamped with now
-  if(timestamp < 946681200) {
-    timestamp=phoenix_get_timestamp();
+  if(*timestamp < 946681200) {
+    *timestamp=phoenix_get_timestamp();
   }
 
-  if(err=sqlite3_bind_text(db_sample_insert_stmt, 1, stream,-1, NULL) != SQLITE_OK) {
-    print_error("Error binding code to sample stmt: %d\n", err);
-    status=-1;
-    goto cleanup;
+  if((err=sqlite3_bind_int(db_sample_insert_stmt, 1, stream_id)) != SQLITE_OK) {
+    print_error("Error binding stream to sample stmt: %d\n", err);
+    return -1;
   }
 
-  if(err=sqlite3_bind_int64(db_sample_insert_stmt, 2, timestamp) != SQLITE_OK) {
+  if((err=sqlite3_bind_int64(db_sample_insert_stmt, 2, *timestamp)) != SQLITE_OK) {
     print_error("Error binding timestamp to sample stmt: %d\n", err);
-    status=-1;
-    goto cleanup;
+    return -1;
   }
 
-  if(err=sqlite3_bind_double(db_sample_insert_stmt, 3, value) != SQLITE_OK) {
+  if((err=sqlite3_bind_double(db_sample_insert_stmt, 3, value)) != SQLITE_OK) {
     print_error("Error binding value to sample stmt: %d\n", err);
+    return -1;
+  }
+
+  while ((err=sqlite3_step(db_sample_insert_stmt)) != SQLITE_DONE) {
+    if(err != SQLITE_ROW) {
+      print_error("Error inserting sample: %d -> %s\n", err, sqlite3_errmsg(db));
+      return -1;
+    }
+  }
+
+  id=sqlite3_last_insert_rowid(db);
+  journal_append(JOURNAL_SAMPLE_INSERT,id,*timestamp,value,(char *)db_stream_code(stream_id));
+
+  return id;
+}
+
+//Legacy message size of a sample, what the flush byte threshold counts
+static size_t db_sample_bytes(int stream_id) {
+  const char *code=db_stream_code(stream_id);
+
+  return sizeof(long long) + sizeof(double) + (code ? strlen(code) : 0);
+}
+
+int db_sample_insert_stream(int stream_id, long long timestamp, double value) {
+  int status;
+  pthread_mutex_lock(&db_mutex);
+  status=db_sample_insert_locked(stream_id,&timestamp,value);
+  pthread_mutex_unlock(&db_mutex);
+
+  if(status >= 0) {
+    connection_samples_queued(1,db_sample_bytes(stream_id));
+  }
+  return status;
+}
+
+int db_sample_insert(char *stream, long long timestamp, double value) {
+  int stream_id=db_stream_id(stream);
+
+  if(stream_id < 0) {
+    return -1;
+  }
+
+  return db_sample_insert_stream(stream_id,timestamp,value);
+}
+
+//Insert all samples in one transaction. The assigned ids, and the stored
+//timestamps of samples stamped with now, are written back to the samples
+//and the range is returned in first_id/last_id
+int db_sample_insert_batch(phoenix_sample_t *samples, int num_samples, int64_t *first_id, int64_t *last_id) {
+  int i,status=0;
+  int64_t id;
+  size_t bytes;
+
+  if(num_samples <= 0) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&db_mutex);
+  if(sqlite3_exec(db,"BEGIN TRANSACTION;",NULL,0,NULL) != SQLITE_OK) {
+    print_error("Could not begin sample transaction: %s\n", sqlite3_errmsg(db));
     status=-1;
     goto cleanup;
   }
 
-  while ((err=sqlite3_step(db_sample_insert_stmt)) != SQLITE_DONE) {
-    print_info("Running sample insert: %d\n", err);
+  for(i=0;i<num_samples;i++) {
+    id=db_sample_insert_locked(samples[i].stream_id,&samples[i].timestamp,samples[i].value);
+    if(id < 0) {
+      goto rollback;
+    }
+    samples[i].id=id;
   }
 
-  //All good return last known id
-  status=sqlite3_last_insert_rowid(db);
+  if(sqlite3_exec(db,"COMMIT;",NULL,0,NULL) != SQLITE_OK) {
+    print_error("Could not commit sample transaction: %s\n", sqlite3_errmsg(db));
+    goto rollback;
+  }
+
+  if(first_id) {
+    *first_id=samples[0].id;
+  }
+  if(last_id) {
+    *last_id=samples[num_samples-1].id;
+  }
 
 cleanup:
   pthread_mutex_unlock(&db_mutex);
+
+  if(status == 0) {
+    for(i=0,bytes=0;i<num_samples;i++) {
+      bytes+=db_sample_bytes(samples[i].stream_id);
+    }
+    connection_samples_queued(num_samples,bytes);
+  }
   return status;
+
+rollback:
+  sqlite3_exec(db,"ROLLBACK;",NULL,0,NULL);
+  //The inserts are already journaled, cancel them again
+  while(--i >= 0) {
+    journal_append(JOURNAL_SAMPLE_DELETE,samples[i].id,0,0,NULL);
+  }
+  pthread_mutex_unlock(&db_mutex);
+  return -1;
 }
 
 int db_sample_sent(int64_t id, int remove) {
@@ -647,19 +1594,78 @@ int db_sample_sent(int64_t id, int remove) {
   }
 
   while(sqlite3_step(stmt) != SQLITE_DONE) {}; 
+  journal_append(remove ? JOURNAL_SAMPLE_DELETE : JOURNAL_SAMPLE_SENT,id,0,0,NULL);
 
 cleanup:
   pthread_mutex_unlock(&db_mutex);
   return status;
 }
 
+static int db_id_compare(const void *a, const void *b) {
+  int64_t x=*(const int64_t *)a, y=*(const int64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+//Mark ids as sent, or delete them, in one transaction. ids are sorted in
+//place and every run of consecutive ids is a single statement. Returns the
+//number of statements executed
+int db_samples_sent(int64_t *ids, int num_ids, int remove) {
+  sqlite3_stmt *stmt = remove ? db_samples_range_delete_stmt : db_samples_range_sent_stmt;
+  int i,first,num_statements=0;
+
+  if(num_ids <= 0) {
+    return 0;
+  }
+
+  qsort(ids,num_ids,sizeof(int64_t),db_id_compare);
+
+  pthread_mutex_lock(&db_mutex);
+  if(sqlite3_exec(db,"BEGIN TRANSACTION;",NULL,0,NULL) != SQLITE_OK) {
+    print_error("Could not begin sent transaction: %s\n", sqlite3_errmsg(db));
+    pthread_mutex_unlock(&db_mutex);
+    return -1;
+  }
+
+  for(first=0;first<num_ids;first=i) {
+    for(i=first+1;i<num_ids && ids[i] <= ids[i-1]+1;i++) {}
+
+    sqlite3_bind_int64(stmt,1,ids[first]);
+    sqlite3_bind_int64(stmt,2,ids[i-1]);
+    if(db_step(stmt)) {
+      print_error("Could not mark samples %lld..%lld sent: %s\n", (long long)ids[first], (long long)ids[i-1], sqlite3_errmsg(db));
+      goto rollback;
+    }
+    //Replaying this after a rollback is harmless, the samples were delivered
+    journal_append(JOURNAL_SAMPLES_SENT_RANGE,ids[first],ids[i-1],remove,NULL);
+    num_statements++;
+  }
+
+  if(sqlite3_exec(db,"COMMIT;",NULL,0,NULL) != SQLITE_OK) {
+    print_error("Could not commit sent transaction: %s\n", sqlite3_errmsg(db));
+    goto rollback;
+  }
+
+  pthread_mutex_unlock(&db_mutex);
+  return num_statements;
+
+rollback:
+  sqlite3_exec(db,"ROLLBACK;",NULL,0,NULL);
+  pthread_mutex_unlock(&db_mutex);
+  return -1;
+}
+
 int db_sample_sent_by_message_id(int mid, int remove) {
   int status=0;
   int err;
   char query[1024];
 
   sprintf(query,"UPDATE samples SET is_sent=1 WHERE message_id=%d;", mid);
-  return sqlite3_exec(db,query,NULL,0,NULL);
+  pthread_mutex_lock(&db_mutex);
+  status=sqlite3_exec(db,query,NULL,0,NULL);
+  journal_append(JOURNAL_SAMPLE_SENT_BY_MESSAGE_ID,0,mid,0,NULL);
+  pthread_mutex_unlock(&db_mutex);
+
+  return status;
 }
 
 
@@ -685,6 +1691,7 @@ int db_sample_set_message_id(int64_t id, int mid){
 
 
   while(sqlite3_step(stmt) != SQLITE_DONE) {}; 
+  journal_append(JOURNAL_SAMPLE_MESSAGE_ID,id,mid,0,NULL);
 
 cleanup:
   pthread_mutex_unlock(&db_mutex);
@@ -701,29 +1708,28 @@ int db_samples_read(phoenix_sample_t *samples, int limit) {
   pthread_mutex_lock(&db_mutex);
   sqlite3_reset(stmt);  
 
-  
-  if(err=sqlite3_bind_int(stmt, 1,0) != SQLITE_OK) {
-    print_error("Could not bind is_sent: %d\n", err);
-    goto cleanup;
-  }
-
-  if(err=sqlite3_bind_int(stmt, 2,limit) != SQLITE_OK) {
+  //Samples waiting for an ack are still unsent in the store, read past them
+  if((err=sqlite3_bind_int(stmt, 1,limit+inflight_count())) != SQLITE_OK) {
     print_error("Could not bind limit: %d\n", err);
     goto cleanup;
   }
 
   debug_printf("Reading samples\n");
-  while( (err=sqlite3_step(stmt)) != SQLITE_DONE){
+  while(num_samples < limit && (err=sqlite3_step(stmt)) != SQLITE_DONE){
     if(err == SQLITE_ROW) {
+      if(inflight_pending(sqlite3_column_int64(stmt,0))) {
+        continue;
+      }
       sample=&(samples[num_samples++]);
-      sample->id=sqlite3_column_int(stmt,0);
-      sprintf(sample->stream,"%s",(char *)sqlite3_column_text(stmt,1));
+      sample->id=sqlite3_column_int64(stmt,0);
+      sample->stream_id=sqlite3_column_int(stmt,1);
       sample->timestamp = sqlite3_column_int64(stmt,2);
       sample->value = sqlite3_column_double(stmt,3);
 
 
     }else{
       print_error("Read samples error: %d\n", err);
+      break;
     }
   }
   
@@ -732,6 +1738,135 @@ cleanup:
   return num_samples;
 }
 
+//Record the delivery sequence number of every id, 0 takes it away again.
+//Runs of consecutive ids under one number are a single statement, all in
+//one transaction
+int db_samples_seq_set(const int64_t *ids, const int64_t *seqs, int num_ids) {
+  sqlite3_stmt *stmt=db_samples_range_seq_stmt;
+  int64_t first_id, last_id;
+  int i,first;
+
+  if(num_ids <= 0) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&db_mutex);
+  if(sqlite3_exec(db,"BEGIN TRANSACTION;",NULL,0,NULL) != SQLITE_OK) {
+    print_error("Could not begin sequence transaction: %s\n", sqlite3_errmsg(db));
+    pthread_mutex_unlock(&db_mutex);
+    return -1;
+  }
+
+  for(first=0;first<num_ids;first=i) {
+    first_id=last_id=ids[first];
+    //Samples are read newest first, runs may go either way
+    for(i=first+1;i<num_ids && seqs[i] == seqs[first] && (ids[i] == first_id-1 || ids[i] == last_id+1);i++) {
+      if(ids[i] < first_id) {
+        first_id=ids[i];
+      }else{
+        last_id=ids[i];
+      }
+    }
+
+    if(seqs[first]) {
+      sqlite3_bind_int64(stmt,1,seqs[first]);
+    }else{
+      sqlite3_bind_null(stmt,1);
+    }
+    sqlite3_bind_int64(stmt,2,first_id);
+    sqlite3_bind_int64(stmt,3,last_id);
+    if(db_step(stmt)) {
+      print_error("Could not set sequence of samples %lld..%lld: %s\n", (long long)first_id, (long long)last_id, sqlite3_errmsg(db));
+      sqlite3_exec(db,"ROLLBACK;",NULL,0,NULL);
+      pthread_mutex_unlock(&db_mutex);
+      return -1;
+    }
+    journal_append(JOURNAL_SAMPLES_SEQ_RANGE,first_id,last_id,(double)seqs[first],NULL);
+  }
+
+  if(sqlite3_exec(db,"COMMIT;",NULL,0,NULL) != SQLITE_OK) {
+    print_error("Could not commit sequence transaction: %s\n", sqlite3_errmsg(db));
+    sqlite3_exec(db,"ROLLBACK;",NULL,0,NULL);
+    pthread_mutex_unlock(&db_mutex);
+    return -1;
+  }
+
+  pthread_mutex_unlock(&db_mutex);
+  return 0;
+}
+
+//Unsent samples delivered under a sequence number above after_seq, in
+//sequence order
+int db_samples_read_delivered(phoenix_sample_t *samples, int64_t *seqs, int limit, int64_t after_seq) {
+  sqlite3_stmt *stmt=db_samples_delivered_read_stmt;
+  int num_samples=0;
+  int err;
+
+  pthread_mutex_lock(&db_mutex);
+  sqlite3_reset(stmt);
+  sqlite3_bind_int64(stmt,1,after_seq);
+  sqlite3_bind_int(stmt,2,limit);
+
+  while(num_samples < limit && (err=sqlite3_step(stmt)) == SQLITE_ROW) {
+    samples[num_samples].id=sqlite3_column_int64(stmt,0);
+    samples[num_samples].stream_id=sqlite3_column_int(stmt,1);
+    samples[num_samples].timestamp=sqlite3_column_int64(stmt,2);
+    samples[num_samples].value=sqlite3_column_double(stmt,3);
+    seqs[num_samples]=sqlite3_column_int64(stmt,4);
+    num_samples++;
+  }
+  if(err != SQLITE_DONE && err != SQLITE_ROW) {
+    print_error("Read delivered samples error: %d\n", err);
+  }
+
+  pthread_mutex_unlock(&db_mutex);
+  return num_samples;
+}
+
+//First sequence number no earlier session may have used
+int64_t db_session_seq_get() {
+  sqlite3_stmt *stmt;
+  int64_t seq=db_int64_get("conf_double","session_seq");
+
+  if(seq < session_seq_replayed) {
+    seq=session_seq_replayed;
+  }
+
+  pthread_mutex_lock(&db_mutex);
+  if(sqlite3_prepare_v2(db,"SELECT MAX(message_id) FROM samples WHERE message_id IS NOT NULL;",-1,&stmt,NULL) == SQLITE_OK) {
+    if(sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int64(stmt,0) >= seq) {
+      seq=sqlite3_column_int64(stmt,0)+1;
+    }
+    sqlite3_finalize(stmt);
+  }
+  pthread_mutex_unlock(&db_mutex);
+
+  return seq > 0 ? seq : 1;
+}
+
+//Sequence numbers below seq are taken, saved in the config and the journal
+int db_session_seq_set(int64_t seq) {
+  int status;
+
+  status=db_int64_set("conf_double","session_seq",seq);
+  if(db_conf_flush()) {
+    status=-1;
+  }
+
+  pthread_mutex_lock(&db_mutex);
+  journal_append(JOURNAL_SESSION_SEQ,0,seq,0,NULL);
+  pthread_mutex_unlock(&db_mutex);
+
+  return status;
+}
+
 int db_samples_delete_sent(void) {
-  return sqlite3_exec(db,"DELETE FROM samples WHERE is_sent=1;",NULL,0,NULL);
+  int status;
+
+  pthread_mutex_lock(&db_mutex);
+  status=sqlite3_exec(db,"DELETE FROM samples WHERE is_sent=1;",NULL,0,NULL);
+  journal_append(JOURNAL_SAMPLES_DELETE_SENT,0,0,0,NULL);
+  pthread_mutex_unlock(&db_mutex);
+
+  return status;
 }
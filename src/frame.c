@@ -0,0 +1,347 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <phoenix.h>
+
+/*
+ * Batch frame, carries many samples in one message.
+ *
+ *   magic "PF", version byte
+ *   varint number of streams, per stream: varint length, code bytes
+ *   varint number of samples
+ *   per sample:
+ *     varint stream index into the stream table
+ *     zigzag varint timestamp, delta to the previous sample in the frame
+ *       (the first one is absolute)
+ *     value XOR the previous value of the same stream (0 for the first):
+ *       one byte (leading zero bytes << 4 | trailing zero bytes) followed
+ *       by the remaining bytes, most significant first. An unchanged value
+ *       is the single byte 0x80
+ *
+ * Samples are encoded into the body as they are added so the frame size is
+ * always known exactly, the stream table is written in front by
+ * frame_encode().
+ *
+ * A compressed frame is magic "PZ" followed by the whole frame as a zlib
+ * stream, see compress.c.
+ */
+
+static size_t varint_size(uint64_t value) {
+  size_t size=1;
+
+  while(value >= 0x80) {
+    value>>=7;
+    size++;
+  }
+
+  return size;
+}
+
+static size_t varint_put(uint8_t *out, uint64_t value) {
+  size_t len=0;
+
+  while(value >= 0x80) {
+    out[len++]=(value & 0x7f) | 0x80;
+    value>>=7;
+  }
+  out[len++]=value;
+
+  return len;
+}
+
+static int varint_get(const uint8_t *data, size_t len, size_t *pos, uint64_t *value) {
+  int shift=0;
+
+  *value=0;
+  while(*pos < len && shift < 64) {
+    *value|=(uint64_t)(data[*pos] & 0x7f) << shift;
+    if((data[(*pos)++] & 0x80) == 0) {
+      return 0;
+    }
+    shift+=7;
+  }
+
+  return -1;
+}
+
+static uint64_t zigzag(int64_t value) {
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value) {
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static size_t xor_put(uint8_t *out, uint64_t bits) {
+  int lead=0, trail=0, i;
+  size_t len=1;
+
+  if(bits == 0) {
+    out[0]=0x80;
+    return 1;
+  }
+
+  while(((bits >> (56-8*lead)) & 0xff) == 0) {
+    lead++;
+  }
+  while(((bits >> (8*trail)) & 0xff) == 0) {
+    trail++;
+  }
+
+  out[0]=lead << 4 | trail;
+  for(i=7-lead;i>=trail;i--) {
+    out[len++]=bits >> (8*i);
+  }
+
+  return len;
+}
+
+static int xor_get(const uint8_t *data, size_t len, size_t *pos, uint64_t *bits) {
+  int lead, trail, i;
+
+  if(*pos >= len) {
+    return -1;
+  }
+
+  lead=data[*pos] >> 4;
+  trail=data[(*pos)++] & 0x0f;
+  *bits=0;
+  if(lead == 8) {
+    return 0;
+  }
+  if(lead+trail > 8 || *pos + (8-lead-trail) > len) {
+    return -1;
+  }
+
+  for(i=7-lead;i>=trail;i--) {
+    *bits|=(uint64_t)data[(*pos)++] << (8*i);
+  }
+
+  return 0;
+}
+
+void frame_init(frame_t *frame, size_t max_size) {
+  memset(frame,0,sizeof(frame_t));
+  frame->max_size = max_size > 0 ? max_size : FRAME_MAX_SIZE;
+}
+
+void frame_reset(frame_t *frame) {
+  frame->body_len=0;
+  frame->num_streams=0;
+  frame->streams_len=0;
+  frame->num_samples=0;
+  frame->last_timestamp=0;
+}
+
+void frame_free(frame_t *frame) {
+  free(frame->body);
+  free(frame->streams);
+  free(frame->last_values);
+  free(frame->ids);
+  memset(frame,0,sizeof(frame_t));
+}
+
+size_t frame_size(frame_t *frame) {
+  return 3 + varint_size(frame->num_streams) + frame->streams_len +
+    varint_size(frame->num_samples) + frame->body_len;
+}
+
+//Returns 0 if the sample was added, FRAME_FULL if it does not fit in the
+//frame and FRAME_UNKNOWN_STREAM if its stream has no code. An empty frame
+//takes any sample of a known stream
+int frame_add(frame_t *frame, phoenix_sample_t *sample) {
+  uint8_t encoded[3*10+9];
+  const char *code;
+  size_t len=0, stream_len=0;
+  uint64_t bits, last;
+  int index;
+
+  for(index=0;index<frame->num_streams;index++) {
+    if(frame->streams[index] == sample->stream_id) {
+      break;
+    }
+  }
+
+  if(index == frame->num_streams) {
+    code=db_stream_code(sample->stream_id);
+    if(code == NULL) {
+      print_error("Unknown stream %d\n", sample->stream_id);
+      return FRAME_UNKNOWN_STREAM;
+    }
+    stream_len=varint_size(strlen(code)) + strlen(code);
+  }
+
+  len+=varint_put(encoded+len,index);
+  len+=varint_put(encoded+len,zigzag(frame->num_samples ? sample->timestamp - frame->last_timestamp : sample->timestamp));
+  memcpy(&bits,&sample->value,sizeof(bits));
+  last=0;
+  if(index < frame->num_streams) {
+    memcpy(&last,&frame->last_values[index],sizeof(last));
+  }
+  len+=xor_put(encoded+len,bits ^ last);
+
+  //Counts may grow a varint byte each
+  if(frame_size(frame) + stream_len + len + 2 > frame->max_size && frame->num_samples > 0) {
+    return FRAME_FULL;
+  }
+
+  if(index == frame->num_streams) {
+    if(frame->num_streams == frame->streams_size) {
+      frame->streams_size = frame->streams_size ? frame->streams_size*2 : 16;
+      frame->streams=realloc(frame->streams,sizeof(int)*frame->streams_size);
+      frame->last_values=realloc(frame->last_values,sizeof(double)*frame->streams_size);
+    }
+    frame->streams[index]=sample->stream_id;
+    frame->num_streams++;
+    frame->streams_len+=stream_len;
+  }
+  frame->last_values[index]=sample->value;
+
+  if(frame->body_len + len > frame->body_size) {
+    frame->body_size = frame->body_size ? frame->body_size*2 : 1024;
+    frame->body=realloc(frame->body,frame->body_size);
+  }
+  memcpy(frame->body+frame->body_len,encoded,len);
+  frame->body_len+=len;
+
+  if(frame->num_samples == frame->ids_size) {
+    frame->ids_size = frame->ids_size ? frame->ids_size*2 : 256;
+    frame->ids=realloc(frame->ids,sizeof(int64_t)*frame->ids_size);
+  }
+  frame->ids[frame->num_samples++]=sample->id;
+  frame->last_timestamp=sample->timestamp;
+
+  return 0;
+}
+
+//Write the complete frame to out, returns its length or -1 if out is too small
+int frame_encode(frame_t *frame, uint8_t *out, size_t size) {
+  const char *code;
+  size_t len=0;
+  int i;
+
+  if(frame_size(frame) > size) {
+    return -1;
+  }
+
+  out[len++]='P';
+  out[len++]='F';
+  out[len++]=FRAME_VERSION;
+
+  len+=varint_put(out+len,frame->num_streams);
+  for(i=0;i<frame->num_streams;i++) {
+    code=db_stream_code(frame->streams[i]);
+    len+=varint_put(out+len,strlen(code));
+    memcpy(out+len,code,strlen(code));
+    len+=strlen(code);
+  }
+
+  len+=varint_put(out+len,frame->num_samples);
+  memcpy(out+len,frame->body,frame->body_len);
+  len+=frame->body_len;
+
+  return len;
+}
+
+//Encode the frame into *out, compressed when that is on and pays off.
+//Returns the length or -1
+int frame_encode_compressed(frame_t *frame, uint8_t **out) {
+  uint8_t *plain=malloc(frame_size(frame));
+  int len, compressed;
+
+  len=frame_encode(frame,plain,frame_size(frame));
+  if(len < 0 || !compress_enabled()) {
+    *out=plain;
+    return len;
+  }
+
+  *out=malloc(2+compress_bound(len));
+  compressed=compress_buffer(COMPRESS_ZLIB,plain,len,*out+2,compress_bound(len));
+  if(compressed <= 0) {
+    free(*out);
+    *out=plain;
+    return len;
+  }
+
+  (*out)[0]='P';
+  (*out)[1]='Z';
+  free(plain);
+
+  return 2+compressed;
+}
+
+//Call callback for every sample in the frame, returns the number of samples
+//or -1 if the frame is malformed. Samples in front of the damage have been
+//passed to callback by then
+int frame_decode(const uint8_t *data, size_t len, frame_callback_t callback, void *arg) {
+  uint64_t num_streams, num_samples, value, delta, bits;
+  size_t pos=3;
+  char **codes=NULL;
+  uint64_t *last=NULL;
+  long long timestamp=0;
+  double sample;
+  int i, status=-1;
+  uint8_t *plain;
+  size_t plain_len;
+
+  if(len > 2 && data[0] == 'P' && data[1] == 'Z') {
+    if(compress_inflate(data+2,len-2,&plain,&plain_len)) {
+      return -1;
+    }
+    status=frame_decode(plain,plain_len,callback,arg);
+    free(plain);
+    return status;
+  }
+
+  if(len < 3 || data[0] != 'P' || data[1] != 'F') {
+    print_error("Not a sample frame\n");
+    return -1;
+  }
+  if(data[2] != FRAME_VERSION) {
+    print_error("Unsupported frame version %d\n", data[2]);
+    return -1;
+  }
+
+  if(varint_get(data,len,&pos,&num_streams) || num_streams > len) {
+    return -1;
+  }
+
+  codes=calloc(sizeof(char *),num_streams+1);
+  last=calloc(sizeof(uint64_t),num_streams+1);
+  for(i=0;i<num_streams;i++) {
+    if(varint_get(data,len,&pos,&value) || pos + value > len) {
+      goto cleanup;
+    }
+    codes[i]=strndup((const char *)data+pos,value);
+    pos+=value;
+  }
+
+  if(varint_get(data,len,&pos,&num_samples)) {
+    goto cleanup;
+  }
+
+  for(i=0;i<num_samples;i++) {
+    if(varint_get(data,len,&pos,&value) || value >= num_streams ||
+        varint_get(data,len,&pos,&delta) || xor_get(data,len,&pos,&bits)) {
+      goto cleanup;
+    }
+    timestamp = i ? timestamp + unzigzag(delta) : unzigzag(delta);
+    last[value]^=bits;
+    memcpy(&sample,&last[value],sizeof(sample));
+    callback(codes[value],timestamp,sample,arg);
+  }
+  status=num_samples;
+
+cleanup:
+  for(i=0;i<num_streams;i++) {
+    free(codes[i]);
+  }
+  free(codes);
+  free(last);
+
+  if(status < 0) {
+    print_error("Malformed sample frame\n");
+  }
+  return status;
+}
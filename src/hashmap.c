@@ -0,0 +1,128 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "hashmap.h"
+
+//FNV-1a
+static uint64_t hashmap_hash(const char *key) {
+  uint64_t hash=14695981039346656037ULL;
+
+  while(*key) {
+    hash^=(unsigned char)*key++;
+    hash*=1099511628211ULL;
+  }
+
+  return hash;
+}
+
+hashmap_t *hashmap_new(size_t size) {
+  hashmap_t *map=calloc(sizeof(hashmap_t),1);
+  size_t capacity=16;
+
+  if(map == NULL) {
+    return NULL;
+  }
+
+  //Power of two, at most half full
+  while(capacity < size*2) {
+    capacity<<=1;
+  }
+
+  map->entries=calloc(sizeof(hashmap_entry_t),capacity);
+  if(map->entries == NULL) {
+    free(map);
+    return NULL;
+  }
+  map->size=capacity;
+
+  return map;
+}
+
+void hashmap_free(hashmap_t *map) {
+  size_t i;
+
+  if(map == NULL) {
+    return;
+  }
+
+  for(i=0;i<map->size;i++) {
+    free(map->entries[i].key);
+  }
+  free(map->entries);
+  free(map);
+}
+
+static hashmap_entry_t *hashmap_find(hashmap_entry_t *entries, size_t size, const char *key) {
+  size_t i=hashmap_hash(key) & (size-1);
+
+  while(entries[i].key != NULL && strcmp(entries[i].key,key) != 0) {
+    i=(i+1) & (size-1);
+  }
+
+  return &entries[i];
+}
+
+static int hashmap_grow(hashmap_t *map) {
+  size_t i, size=map->size*2;
+  hashmap_entry_t *entries=calloc(sizeof(hashmap_entry_t),size);
+
+  if(entries == NULL) {
+    return -1;
+  }
+
+  for(i=0;i<map->size;i++) {
+    if(map->entries[i].key != NULL) {
+      *hashmap_find(entries,size,map->entries[i].key)=map->entries[i];
+    }
+  }
+
+  free(map->entries);
+  map->entries=entries;
+  map->size=size;
+
+  return 0;
+}
+
+//Returns 1 and sets value if key is present
+int hashmap_get(hashmap_t *map, const char *key, void **value) {
+  hashmap_entry_t *entry=hashmap_find(map->entries,map->size,key);
+
+  if(entry->key == NULL) {
+    return 0;
+  }
+
+  if(value) {
+    *value=entry->value;
+  }
+  return 1;
+}
+
+int hashmap_put(hashmap_t *map, const char *key, void *value) {
+  hashmap_entry_t *entry;
+
+  if((map->count+1)*2 > map->size && hashmap_grow(map)) {
+    return -1;
+  }
+
+  entry=hashmap_find(map->entries,map->size,key);
+  if(entry->key == NULL) {
+    entry->key=strdup(key);
+    if(entry->key == NULL) {
+      return -1;
+    }
+    map->count++;
+  }
+  entry->value=value;
+
+  return 0;
+}
+
+void hashmap_foreach(hashmap_t *map, hashmap_callback_t callback, void *arg) {
+  size_t i;
+
+  for(i=0;i<map->size;i++) {
+    if(map->entries[i].key != NULL) {
+      callback(map->entries[i].key,map->entries[i].value,arg);
+    }
+  }
+}
@@ -0,0 +1,21 @@
+#include <stddef.h>
+
+//Open addressing string keyed hash map. Keys are copied, values are not owned
+typedef struct {
+  char *key;
+  void *value;
+} hashmap_entry_t;
+
+typedef struct {
+  hashmap_entry_t *entries;
+  size_t size;
+  size_t count;
+} hashmap_t;
+
+typedef void (*hashmap_callback_t)(const char *key, void *value, void *arg);
+
+hashmap_t *hashmap_new(size_t size);
+void hashmap_free(hashmap_t *map);
+int hashmap_get(hashmap_t *map, const char *key, void **value);
+int hashmap_put(hashmap_t *map, const char *key, void *value);
+void hashmap_foreach(hashmap_t *map, hashmap_callback_t callback, void *arg);
@@ -127,6 +127,8 @@ phoenix_t *phoenix_init_http(unsigned char *server, const char *device_id) {
 
 
   phoenix->http=calloc(sizeof(phoenix_http_t),1);
+  pthread_mutex_init(&phoenix->http->mutex,NULL);
+  phoenix->http->concurrency=HTTP_CONCURRENCY;
   
   phoenix->device_id = (char *)calloc(sizeof(char),strlen(device_id)+1);
   sprintf(phoenix->device_id,"%s",device_id);
@@ -141,6 +143,9 @@ phoenix_t *phoenix_init_http(unsigned char *server, const char *device_id) {
     print_fatal("Provisioning failed\n");
   }
 
+  //Uploads run on their own thread, phoenix_connection_handle() leaves them to it
+  phoenix_http_start(phoenix);
+
   return phoenix;
 
 
@@ -162,54 +167,265 @@ size_t http_post_writer(void *data, size_t size, size_t nmemb, void *userp){
   return realsize;
 }
 
-int phoenix_http_post(phoenix_t *phoenix, const char *msg) {
-  char url[1024];
-  char auth_header[1024];
-  http_response_t body;
-  CURL *curl;
-  CURLcode curl_code;
-  struct curl_slist *list = NULL;
-  long response_code;
-
-  memset(&body,0,sizeof(body));
+static pthread_once_t http_global_once=PTHREAD_ONCE_INIT;
 
+//Once per process, curl_global_init() is not thread safe and slow
+static void http_global_init() {
   curl_global_init(CURL_GLOBAL_ALL);
-  curl=curl_easy_init();
+}
 
+//The upload thread and posts from the application use the share at once
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST]={[0 ... CURL_LOCK_DATA_LAST-1]=PTHREAD_MUTEX_INITIALIZER};
+
+static void http_share_lock(CURL *curl, curl_lock_data data, curl_lock_access access, void *userptr) {
+  pthread_mutex_lock(&share_locks[data]);
+}
+
+static void http_share_unlock(CURL *curl, curl_lock_data data, void *userptr) {
+  pthread_mutex_unlock(&share_locks[data]);
+}
+
+//Caller must hold http->mutex
+static void phoenix_http_reset_locked(phoenix_t *phoenix) {
+  phoenix_http_t *http=phoenix->http;
+
+  if(http->curl != NULL) {
+    curl_easy_cleanup(http->curl);
+    http->curl=NULL;
+  }
+  if(http->in_flight > 0 || http->posting > 0) {
+    return;
+  }
+  curl_slist_free_all(http->headers);
+  curl_slist_free_all(http->headers_gzip);
+  curl_slist_free_all(http->headers_frame);
+  http->headers=NULL;
+  http->headers_gzip=NULL;
+  http->headers_frame=NULL;
+  free(http->headers_hash);
+  http->headers_hash=NULL;
+}
+
+//Drop the easy handle and its connection, the next post builds a new one.
+//TLS sessions in the share survive, so do headers posts in flight use
+void phoenix_http_reset(phoenix_t *phoenix) {
+  phoenix_http_t *http=phoenix->http;
+
+  pthread_mutex_lock(&http->mutex);
+  phoenix_http_reset_locked(phoenix);
+  pthread_mutex_unlock(&http->mutex);
+}
+
+void phoenix_http_stats(phoenix_t *phoenix, http_stats_t *stats) {
+  phoenix_http_t *http=phoenix->http;
+
+  pthread_mutex_lock(&http->mutex);
+  *stats=http->stats;
+  stats->queued=http->queued;
+  stats->in_flight=http->in_flight;
+  stats->batch_latency_ms = stats->batches ? http->latency_sum_ms/stats->batches : 0;
+  pthread_mutex_unlock(&http->mutex);
+}
+
+//Header lists for the certificate hash in the Authorization header. Returns
+//1 when they were built, 0 when they are current and -1 when the hash
+//changed but posts in flight still use the old ones. Caller must hold
+//http->mutex, the headers stay valid while in_flight or posting counts it
+static int phoenix_http_headers(phoenix_t *phoenix) {
+  phoenix_http_t *http=phoenix->http;
+  char auth_header[1024];
+
+  if(http->headers_hash != NULL && strcmp(http->headers_hash,phoenix->certificate_hash) == 0) {
+    return 0;
+  }
+  if(http->in_flight > 0 || http->posting > 0) {
+    return -1;
+  }
+  phoenix_http_reset_locked(phoenix);
 
   sprintf(auth_header,"Authorization: Bearer %s", phoenix->certificate_hash);
-  list = curl_slist_append(list, auth_header);
-  list = curl_slist_append(list, "Content-Type: application/json");
-  list = curl_slist_append(list, "Expect:");
+  http->headers = curl_slist_append(http->headers, auth_header);
+  http->headers = curl_slist_append(http->headers, "Content-Type: application/json");
+  http->headers = curl_slist_append(http->headers, "Expect:");
+  http->headers_gzip = curl_slist_append(http->headers_gzip, auth_header);
+  http->headers_gzip = curl_slist_append(http->headers_gzip, "Content-Type: application/json");
+  http->headers_gzip = curl_slist_append(http->headers_gzip, "Expect:");
+  http->headers_gzip = curl_slist_append(http->headers_gzip, "Content-Encoding: gzip");
+  http->headers_frame = curl_slist_append(http->headers_frame, auth_header);
+  http->headers_frame = curl_slist_append(http->headers_frame, "Content-Type: " MQTT_CONTENT_TYPE_FRAME);
+  http->headers_frame = curl_slist_append(http->headers_frame, "Expect:");
+  http->headers_hash=strdup(phoenix->certificate_hash);
+
+  return 1;
+}
 
+//A new easy handle for the notification URL, sharing TLS sessions and DNS
+static CURL *phoenix_http_easy(phoenix_t *phoenix) {
+  phoenix_http_t *http=phoenix->http;
+  char url[1024];
+  CURL *curl;
 
-  sprintf(url,"%s://%s/device/%s/notification",phoenix->http->scheme,phoenix->server,phoenix->device_id);
+  pthread_once(&http_global_once,http_global_init);
+  pthread_mutex_lock(&share_locks[CURL_LOCK_DATA_SHARE]);
+  if(http->share == NULL) {
+    http->share=curl_share_init();
+    curl_share_setopt(http->share,CURLSHOPT_LOCKFUNC,http_share_lock);
+    curl_share_setopt(http->share,CURLSHOPT_UNLOCKFUNC,http_share_unlock);
+    curl_share_setopt(http->share,CURLSHOPT_SHARE,CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(http->share,CURLSHOPT_SHARE,CURL_LOCK_DATA_DNS);
+  }
+  pthread_mutex_unlock(&share_locks[CURL_LOCK_DATA_SHARE]);
+  if((curl=curl_easy_init()) == NULL) {
+    print_error("Could not create curl handle\n");
+    return NULL;
+  }
 
-  debug_printf("Posting: %s -> %s\n", url,msg);
+  sprintf(url,"%s://%s/device/%s/notification",http->scheme,phoenix->server,phoenix->device_id);
 
   curl_easy_setopt(curl,CURLOPT_URL,url);
   curl_easy_setopt(curl,CURLOPT_POST,1L);
-  curl_easy_setopt(curl,CURLOPT_POSTFIELDS,msg);
-  curl_easy_setopt(curl,CURLOPT_POSTFIELDSIZE,strlen(msg));
   curl_easy_setopt(curl,CURLOPT_WRITEFUNCTION,http_post_writer);
-  curl_easy_setopt(curl,CURLOPT_WRITEDATA,&body);
+  curl_easy_setopt(curl,CURLOPT_SHARE,http->share);
+  curl_easy_setopt(curl,CURLOPT_TCP_KEEPALIVE,1L);
+  curl_easy_setopt(curl,CURLOPT_TCP_KEEPIDLE,HTTP_KEEPALIVE_IDLE_S);
+  curl_easy_setopt(curl,CURLOPT_TCP_KEEPINTVL,HTTP_KEEPALIVE_INTERVAL_S);
+  curl_easy_setopt(curl,CURLOPT_NOSIGNAL,1L);
   curl_easy_setopt(curl,CURLOPT_VERBOSE,debug);
-  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);  
+  if(http->ca_file != NULL) {
+    curl_easy_setopt(curl,CURLOPT_CAINFO,http->ca_file);
+  }
 #ifdef CLOUDGATE
   curl_easy_setopt(curl, CURLOPT_CAINFO, "/etc/ssl/certs/cacert.pem");
 #endif 
-  
-  curl_code=curl_easy_perform(curl);
+  pthread_mutex_lock(&http->mutex);
+  http->stats.handles++;
+  pthread_mutex_unlock(&http->mutex);
+
+  return curl;
+}
+
+//Done with the handle of phoenix_http_handle(). It is kept for the next
+//post unless keep is 0 or another post kept its own first
+static void phoenix_http_release(phoenix_t *phoenix, CURL *curl, int keep) {
+  phoenix_http_t *http=phoenix->http;
+
+  pthread_mutex_lock(&http->mutex);
+  http->posting--;
+  if(curl != NULL && keep && http->curl == NULL) {
+    http->curl=curl;
+    curl=NULL;
+  }
+  pthread_mutex_unlock(&http->mutex);
+
+  if(curl != NULL) {
+    curl_easy_cleanup(curl);
+  }
+}
+
+//The easy handle of synchronous posts, kept alive with its connection and
+//TLS session from post to post. A post takes it, so posts from other
+//threads meanwhile build their own, and gives it back with
+//phoenix_http_release(). The headers stay valid until then
+static CURL *phoenix_http_handle(phoenix_t *phoenix) {
+  phoenix_http_t *http=phoenix->http;
+  CURL *curl;
+
+  pthread_mutex_lock(&http->mutex);
+  if(phoenix_http_headers(phoenix) < 0) {
+    pthread_mutex_unlock(&http->mutex);
+    return NULL;
+  }
+  curl=http->curl;
+  http->curl=NULL;
+  http->posting++;
+  pthread_mutex_unlock(&http->mutex);
+
+  if(curl == NULL && (curl=phoenix_http_easy(phoenix)) == NULL) {
+    phoenix_http_release(phoenix,NULL,0);
+  }
+
+  return curl;
+}
+
+//Count a finished transfer, returns the response code or 0
+static long phoenix_http_done(phoenix_t *phoenix, CURL *curl, CURLcode curl_code) {
+  phoenix_http_t *http=phoenix->http;
+  curl_off_t downloaded=0;
+  long response_code=0, connects=0, request_size=0, header_size=0;
+
+  pthread_mutex_lock(&http->mutex);
   if(curl_code != CURLE_OK) {
     print_error("Curl error: %s\n", curl_easy_strerror(curl_code));
   }else{
     curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-    debug_printf("http status: %ld\n", response_code);
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+    curl_easy_getinfo(curl, CURLINFO_REQUEST_SIZE, &request_size);
+    curl_easy_getinfo(curl, CURLINFO_HEADER_SIZE, &header_size);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &downloaded);
+    http->stats.connects+=connects;
+    //Headers and a body sent with them, as curl counts it
+    http->stats.bytes_sent+=request_size;
+    http->stats.bytes_received+=header_size+downloaded;
+    debug_printf("http status: %ld, %ld new connections\n", response_code, connects);
+  }
+  if(response_code != 200) {
+    http->stats.failed++;
+  }
+  pthread_mutex_unlock(&http->mutex);
+
+  return response_code;
+}
+
+//Set the body of a post on curl, gzip when compression is on and pays
+//off. *compressed is to be freed when the transfer is done
+static void phoenix_http_body(phoenix_t *phoenix, CURL *curl, const char *msg, int len, uint8_t **compressed) {
+  int compressed_len=0;
+
+  *compressed=NULL;
+  if(compress_enabled()) {
+    *compressed=malloc(compress_bound(len));
+    compressed_len=compress_buffer(COMPRESS_GZIP,(const uint8_t *)msg,len,*compressed,compress_bound(len));
+  }
+
+  if(compressed_len > 0) {
+    curl_easy_setopt(curl,CURLOPT_POSTFIELDS,*compressed);
+    curl_easy_setopt(curl,CURLOPT_POSTFIELDSIZE,(long)compressed_len);
+    curl_easy_setopt(curl,CURLOPT_HTTPHEADER,phoenix->http->headers_gzip);
+  }else{
+    curl_easy_setopt(curl,CURLOPT_POSTFIELDS,msg);
+    curl_easy_setopt(curl,CURLOPT_POSTFIELDSIZE,(long)len);
+    curl_easy_setopt(curl,CURLOPT_HTTPHEADER,phoenix->http->headers);
+  }
+}
+
+int phoenix_http_post(phoenix_t *phoenix, const char *msg, int len) {
+  phoenix_http_t *http=phoenix->http;
+  uint8_t *compressed;
+  http_response_t body;
+  CURL *curl;
+  CURLcode curl_code;
+  long response_code;
+
+  memset(&body,0,sizeof(body));
+
+  if((curl=phoenix_http_handle(phoenix)) == NULL) {
+    return -1;
   }
 
-  curl_easy_cleanup(curl);
-  curl_global_cleanup();
-  curl_slist_free_all(list);
+  debug_printf("Posting: %s\n", msg);
+
+  phoenix_http_body(phoenix,curl,msg,len,&compressed);
+  curl_easy_setopt(curl,CURLOPT_WRITEDATA,&body);
+  
+  pthread_mutex_lock(&http->mutex);
+  http->stats.posts++;
+  pthread_mutex_unlock(&http->mutex);
+  curl_code=curl_easy_perform(curl);
+  response_code=phoenix_http_done(phoenix,curl,curl_code);
+  //Start over with a fresh connection after an error
+  phoenix_http_release(phoenix,curl,curl_code == CURLE_OK);
+
+  free(compressed);
 
   if(response_code == 200) {
     check_pending_commands(&body);
@@ -223,7 +439,7 @@ int phoenix_http_post(phoenix_t *phoenix, const char *msg) {
 }
 
 int phoenix_http_send(phoenix_t *phoenix, const char *msg, int len){
-  return phoenix_http_post(phoenix,msg);
+  return phoenix_http_post(phoenix,msg,len);
 }
 
 struct json_object *phoenix_notification_init(char *notification) {
@@ -247,48 +463,486 @@ struct json_object *copy_json_object(struct json_object *src) {
 }
 
 int phoenix_http_send_samples(phoenix_t *phoenix, phoenix_sample_t *samples, int num_samples){
-  char ts[100];
-  int msg_len,i;
+  int i;
   int status=0;
-  char *json_str;
-  struct json_object *notification, *parameters;  
-  struct json_object *sample;
-  
-  //Get compatible timestamp in string format
+  notification_t notification;
 
-  
-  notification = phoenix_notification_init("streams");
-  if(!json_object_object_get_ex(notification,"parameters", &parameters)) {
-    print_error("Missing parameters for notification\n");
+  memset(&notification,0,sizeof(notification));
+  if(notification_streams(&notification,samples,num_samples) < 0) {
+    return -1;
   }
 
-  for(i=0;i<num_samples;i++) {
-    sample = json_object_new_object();
-  
-    getRFC3339(samples[i].timestamp,ts);
+  if(!phoenix_http_send(phoenix,notification.data,notification.len)){
+    //Delivery successfull. Clear the queue in one transaction
+    int64_t *ids=calloc(sizeof(int64_t),num_samples+1);
+    for(i=0;i<num_samples;i++) {
+      ids[i]=samples[i].id;
+    }
+    db_samples_sent(ids,num_samples,1);
+    free(ids);
+  }
+  notification_free(&notification);
+
+  return status;
+}
+
+/*
+ * Asynchronous uploads.
+ *
+ * The store is drained into a bounded queue of encoded batches, at most
+ * HTTP_QUEUE_MAX. A full batch is encoded as soon as the store has one, a
+ * partial batch only when the uploader is flushing: after
+ * connection_wait() returned for the flush count, bytes or age, see
+ * phoenix_flush_set(). Up to concurrency batches from the queue are posted
+ * at once on a curl multi handle, over parallel connections or multiplexed
+ * on one HTTP/2 connection.
+ *
+ * The sample ids of a batch are in the in-flight table under the batch
+ * number from the time it is encoded, so db_samples_read() skips them. A
+ * batch answered with 200 is acked and marked sent with the next flush,
+ * any other outcome forgets it and its samples are read again.
+ *
+ * The body is the streams notification in JSON, or with
+ * phoenix_http_format_set() a batch frame as MQTT carries it (frame.c),
+ * content type MQTT_CONTENT_TYPE_FRAME. A server that answers a frame with
+ * 415 Unsupported Media Type only gets JSON from then on, frames still
+ * queued are encoded again.
+ *
+ * phoenix_init_http() runs all of it on its own thread, the application
+ * only stores samples. While that thread runs phoenix_connection_handle()
+ * returns without doing anything, the multi handle and the batches belong
+ * to the thread.
+ */
+typedef struct {
+  int id;                   //0 for a free slot
+  CURL *curl;               //Set while it is posted
+  int num_samples;
+  long long queued_at;
+  notification_t body;      //Kept with the slot, grown once
+  uint8_t *frame;           //Instead of body with HTTP_FORMAT_FRAME
+  int frame_len;
+  uint8_t *compressed;
+  http_response_t response;
+} http_batch_t;
+
+//Body of the batches, JSON unless the server takes frames. Frames are
+//encoded as MQTT sends them, compressed when compression is on
+void phoenix_http_format_set(phoenix_t *phoenix, http_format_t format) {
+  phoenix_http_t *http=phoenix->http;
+
+  pthread_mutex_lock(&http->mutex);
+  http->format=format;
+  pthread_mutex_unlock(&http->mutex);
+}
 
-    json_object_object_add(sample, "code", json_object_new_string(samples[i].stream));
-    json_object_object_add(sample, "timestamp", json_object_new_string(ts));
-    json_object_object_add(sample, "value", json_object_new_double(samples[i].value));
+//The format is set by the application and the uploader, read it locked
+static http_format_t phoenix_http_format(phoenix_t *phoenix) {
+  phoenix_http_t *http=phoenix->http;
+  http_format_t format;
 
+  pthread_mutex_lock(&http->mutex);
+  format=http->format;
+  pthread_mutex_unlock(&http->mutex);
 
-    json_object_array_add(parameters,sample);
+  return format;
+}
+
+//Number of batches posted at once, 1 is one batch per round trip
+void phoenix_http_concurrency_set(phoenix_t *phoenix, int concurrency) {
+  if(concurrency < 1) {
+    concurrency=1;
+  }
+  if(concurrency > HTTP_CONCURRENCY_MAX) {
+    concurrency=HTTP_CONCURRENCY_MAX;
+  }
+  phoenix->http->concurrency=concurrency;
+  if(phoenix->http->multi != NULL) {
+    curl_multi_setopt(phoenix->http->multi,CURLMOPT_MAX_HOST_CONNECTIONS,(long)concurrency);
+  }
+}
+
+static void phoenix_http_batch_free(http_batch_t *batch) {
+  notification_t body=batch->body;
+
+  if(batch->curl != NULL) {
+    curl_easy_cleanup(batch->curl);
+  }
+  free(batch->frame);
+  free(batch->compressed);
+  free(batch->response.data);
+  memset(batch,0,sizeof(http_batch_t));
+  batch->body=body;
+}
+
+//Ack or forget the batches curl is done with
+static void phoenix_http_completed(phoenix_t *phoenix) {
+  phoenix_http_t *http=phoenix->http;
+  http_batch_t *batch;
+  CURLMsg *msg;
+  long response_code;
+  double latency;
+  int left;
+
+  while((msg=curl_multi_info_read(http->multi,&left)) != NULL) {
+    if(msg->msg != CURLMSG_DONE) {
+      continue;
+    }
+    curl_easy_getinfo(msg->easy_handle,CURLINFO_PRIVATE,(char **)&batch);
+    response_code=phoenix_http_done(phoenix,batch->curl,msg->data.result);
+    curl_multi_remove_handle(http->multi,batch->curl);
+
+    if(response_code == 200) {
+      http->failures=0;
+      http->retry_at=0;
+      //Delivered over HTTP the samples are deleted, as the synchronous post does
+      inflight_ack(batch->id,1);
+      if(batch->response.data != NULL) {
+        check_pending_commands(&batch->response);
+      }
+      latency=phoenix_get_timestamp()-batch->queued_at;
+      pthread_mutex_lock(&http->mutex);
+      http->stats.batches++;
+      http->latency_sum_ms+=latency;
+      if(latency > http->stats.batch_latency_max_ms) {
+        http->stats.batch_latency_max_ms=latency;
+      }
+      pthread_mutex_unlock(&http->mutex);
+    }else{
+      print_warning("Batch %d of %d samples failed: %ld\n", batch->id, batch->num_samples, response_code);
+      inflight_forget(batch->id);
+      if(response_code == 415 && batch->frame != NULL && phoenix_http_format(phoenix) == HTTP_FORMAT_FRAME) {
+        print_warning("Server does not take frames, posting JSON\n");
+        pthread_mutex_lock(&http->mutex);
+        http->format=HTTP_FORMAT_JSON;
+        http->stats.rejected++;
+        pthread_mutex_unlock(&http->mutex);
+      }else{
+        //Back off as MQTT reconnects do, the batch is posted again after
+        http->retry_at=phoenix_get_timestamp()+session_backoff_ms(http->failures++);
+      }
+    }
+    debug_printf("Batch %d of %d samples done: %ld\n", batch->id, batch->num_samples, response_code);
+
+    phoenix_http_batch_free(batch);
+    pthread_mutex_lock(&http->mutex);
+    http->in_flight--;
+    pthread_mutex_unlock(&http->mutex);
+  }
+}
+
+//The samples as a frame in batch->frame. Returns how many fit or -1
+static int phoenix_http_encode_frame(phoenix_t *phoenix, http_batch_t *batch, phoenix_sample_t *samples, int num_samples) {
+  phoenix_http_t *http=phoenix->http;
+  frame_t *frame;
+  int i;
+
+  if(http->frame == NULL) {
+    http->frame=malloc(sizeof(frame_t));
+    frame_init(http->frame,HTTP_FRAME_MAX_SIZE);
   }
+  frame=http->frame;
+  frame_reset(frame);
+  for(i=0;i<num_samples && frame_add(frame,&samples[i]) == 0;i++) {}
+  if(i == 0 || (batch->frame_len=frame_encode_compressed(frame,&batch->frame)) < 0) {
+    free(batch->frame);
+    batch->frame=NULL;
+    return -1;
+  }
+
+  return i;
+}
+
+//Encode batches from the store into free queue slots, full ones only
+//unless flush is set. Returns 1 when the store may hold more full batches
+static int phoenix_http_encode(phoenix_t *phoenix, int flush) {
+  phoenix_http_t *http=phoenix->http;
+  http_batch_t *batches=http->batches, *batch;
+  phoenix_sample_t *samples=calloc(sizeof(phoenix_sample_t),MAX_SAMPLES_TO_SEND);
+  int i, slot=0, num_read=MAX_SAMPLES_TO_SEND, num_samples;
+
+  while(http->queued+http->in_flight < HTTP_QUEUE_MAX) {
+    num_read=db_samples_read(samples,MAX_SAMPLES_TO_SEND);
+    if(num_read <= 0 || (num_read < MAX_SAMPLES_TO_SEND && !flush)) {
+      break;
+    }
+
+    //A sample of an unknown stream can never be sent, it would fail every
+    //batch it is read into
+    for(i=0,num_samples=0;i<num_read;i++) {
+      if(db_stream_code(samples[i].stream_id) == NULL) {
+        print_error("Dropping sample %lld of unknown stream %d\n", (long long)samples[i].id, samples[i].stream_id);
+        db_sample_sent(samples[i].id,1);
+        continue;
+      }
+      samples[num_samples++]=samples[i];
+    }
+    if(num_samples < num_read) {
+      continue;
+    }
 
-  json_str = json_object_to_json_string_ext(notification,JSON_C_TO_STRING_PLAIN);
+    for(;batches[slot].id != 0;slot++) {}
+    batch=&batches[slot];
+
+    //Samples that do not fit in the frame are read again for the next one
+    if(phoenix_http_format(phoenix) == HTTP_FORMAT_FRAME) {
+      num_samples=phoenix_http_encode_frame(phoenix,batch,samples,num_read);
+    }else{
+      num_samples = notification_streams(&batch->body,samples,num_read) < 0 ? -1 : num_read;
+    }
+    if(num_samples < 0) {
+      break;
+    }
 
-  if(!phoenix_http_send(phoenix,json_str,strlen(json_str))){
-    //Delivery successfull. Clear the queue
+    //Batch numbers only need to be unique among the batches in flight
+    batch->id = http->next_batch = http->next_batch % INT32_MAX + 1;
+    batch->num_samples=num_samples;
+    batch->queued_at=phoenix_get_timestamp();
     for(i=0;i<num_samples;i++) {
-      //Entries from database, has an id, which need to be marked as sent
-      db_sample_sent(samples[i].id,1);
+      inflight_add(batch->id,samples[i].id);
+    }
+    pthread_mutex_lock(&http->mutex);
+    http->queued++;
+    pthread_mutex_unlock(&http->mutex);
+
+    if(num_read < MAX_SAMPLES_TO_SEND) {
+      break;
     }
   }
-  json_object_put(notification);
+  free(samples);
 
+  return num_read == MAX_SAMPLES_TO_SEND;
+}
 
+//Post the oldest queued batches while fewer than concurrency are in flight
+static void phoenix_http_post_queued(phoenix_t *phoenix) {
+  phoenix_http_t *http=phoenix->http;
+  http_batch_t *batches=http->batches, *batch;
+  int i, headers;
+
+  while(http->queued > 0 && http->in_flight < http->concurrency) {
+    //In flight from here on, so synchronous posts leave the headers alone
+    pthread_mutex_lock(&http->mutex);
+    if((headers=phoenix_http_headers(phoenix)) >= 0) {
+      http->in_flight++;
+    }
+    pthread_mutex_unlock(&http->mutex);
+    if(headers < 0) {
+      return;
+    }
 
-  return status;
+    batch=NULL;
+    for(i=0;i<HTTP_QUEUE_MAX;i++) {
+      if(batches[i].id != 0 && batches[i].curl == NULL && (batch == NULL || batches[i].queued_at < batch->queued_at ||
+            (batches[i].queued_at == batch->queued_at && batches[i].id < batch->id))) {
+        batch=&batches[i];
+      }
+    }
+    //Frames queued before the server turned them down go back to the store
+    if(batch->frame != NULL && phoenix_http_format(phoenix) != HTTP_FORMAT_FRAME) {
+      inflight_forget(batch->id);
+      phoenix_http_batch_free(batch);
+      pthread_mutex_lock(&http->mutex);
+      http->queued--;
+      http->in_flight--;
+      pthread_mutex_unlock(&http->mutex);
+      continue;
+    }
+    if((batch->curl=phoenix_http_easy(phoenix)) == NULL) {
+      pthread_mutex_lock(&http->mutex);
+      http->in_flight--;
+      pthread_mutex_unlock(&http->mutex);
+      return;
+    }
+
+    if(batch->frame != NULL) {
+      curl_easy_setopt(batch->curl,CURLOPT_POSTFIELDS,batch->frame);
+      curl_easy_setopt(batch->curl,CURLOPT_POSTFIELDSIZE,(long)batch->frame_len);
+      curl_easy_setopt(batch->curl,CURLOPT_HTTPHEADER,http->headers_frame);
+      pthread_mutex_lock(&http->mutex);
+      http->stats.frames++;
+      pthread_mutex_unlock(&http->mutex);
+    }else{
+      phoenix_http_body(phoenix,batch->curl,batch->body.data,batch->body.len,&batch->compressed);
+    }
+    curl_easy_setopt(batch->curl,CURLOPT_WRITEDATA,&batch->response);
+    curl_easy_setopt(batch->curl,CURLOPT_PRIVATE,batch);
+    curl_easy_setopt(batch->curl,CURLOPT_PIPEWAIT,1L);
+    curl_multi_add_handle(http->multi,batch->curl);
+
+    pthread_mutex_lock(&http->mutex);
+    http->queued--;
+    http->stats.posts++;
+    pthread_mutex_unlock(&http->mutex);
+  }
+}
+
+static void phoenix_http_multi(phoenix_t *phoenix) {
+  phoenix_http_t *http=phoenix->http;
+
+  if(http->multi != NULL) {
+    return;
+  }
+  pthread_once(&http_global_once,http_global_init);
+  http->multi=curl_multi_init();
+  curl_multi_setopt(http->multi,CURLMOPT_PIPELINING,CURLPIPE_MULTIPLEX);
+  http->batches=calloc(sizeof(http_batch_t),HTTP_QUEUE_MAX);
+  if(http->concurrency == 0) {
+    http->concurrency=HTTP_CONCURRENCY;
+  }
+  phoenix_http_concurrency_set(phoenix,http->concurrency);
+}
+
+//One round of the uploader: finish what is done, encode and post new
+//batches while there is room and wait up to timeout_ms for the network.
+//Returns 1 when there is more to do, batches in flight or samples left, 0
+//when idle or backing off after a failed batch
+int phoenix_http_upload(phoenix_t *phoenix, int timeout_ms) {
+  phoenix_http_t *http=phoenix->http;
+  int running, numfds, more=0;
+  //Without the upload thread every call flushes, as before
+  int flush = http->flush || !phoenix_http_running(phoenix);
+
+  phoenix_http_multi(phoenix);
+  http->flush=0;
+
+  curl_multi_perform(http->multi,&running);
+  phoenix_http_completed(phoenix);
+  inflight_flush();
+
+  //connection_wait() wakes the uploader again at retry_at
+  if(phoenix_get_timestamp() >= http->retry_at) {
+    http->retry_at=0;
+    more=phoenix_http_encode(phoenix,flush);
+    phoenix_http_post_queued(phoenix);
+  }
+
+  if(http->in_flight == 0) {
+    return more;
+  }
+
+  curl_multi_perform(http->multi,&running);
+  curl_multi_poll(http->multi,NULL,0,timeout_ms,&numfds);
+  curl_multi_perform(http->multi,&running);
+  phoenix_http_completed(phoenix);
+
+  return 1;
+}
+
+int phoenix_http_in_flight(phoenix_t *phoenix) {
+  phoenix_http_t *http=phoenix->http;
+  int in_flight;
+
+  pthread_mutex_lock(&http->mutex);
+  in_flight=http->in_flight;
+  pthread_mutex_unlock(&http->mutex);
+
+  return in_flight;
+}
+
+//Whether the upload thread of phoenix_http_start() runs the uploader
+int phoenix_http_running(phoenix_t *phoenix) {
+  phoenix_http_t *http=phoenix->http;
+  int run;
+
+  pthread_mutex_lock(&http->mutex);
+  run=http->run;
+  pthread_mutex_unlock(&http->mutex);
+
+  return run;
+}
+
+//Upload thread of phoenix_init_http(). Sockets are waited on in
+//phoenix_http_upload() while batches are in flight, the store otherwise
+static void *phoenix_http_handler(void *input) {
+  phoenix_t *phoenix = (phoenix_t *)input;
+  phoenix_http_t *http=phoenix->http;
+
+  //Wait for database
+  while(!db_ready() && phoenix_http_running(phoenix)){
+    print_info("Waiting for database\n");
+    sleep(1);
+  }
+
+  phoenix->backlog=1;
+  http->flush=1;
+  while(phoenix_http_running(phoenix)) {
+    connection_handle(phoenix);
+
+    if(http->in_flight == 0 && phoenix_http_running(phoenix)) {
+      connection_wait(phoenix,phoenix->backlog);
+      http->flush=1;
+    }
+  }
+
+  print_info("Upload thread ended\n");
+  return NULL;
+}
+
+int phoenix_http_start(phoenix_t *phoenix) {
+  phoenix_http_t *http=phoenix->http;
+
+  phoenix_http_multi(phoenix);
+  pthread_mutex_lock(&http->mutex);
+  http->run=1;
+  pthread_mutex_unlock(&http->mutex);
+  if(pthread_create(&(phoenix->connection_thread), NULL, phoenix_http_handler, phoenix)) {
+    print_error("Unable to start upload thread\n");
+    pthread_mutex_lock(&http->mutex);
+    http->run=0;
+    pthread_mutex_unlock(&http->mutex);
+    return -1;
+  }
+
+  return 0;
 }
 
+void phoenix_http_close(phoenix_t *phoenix) {
+  phoenix_http_t *http=phoenix->http;
+  http_batch_t *batches=http->batches;
+  int i;
+
+  if(phoenix_http_running(phoenix)) {
+    pthread_mutex_lock(&http->mutex);
+    http->run=0;
+    pthread_mutex_unlock(&http->mutex);
+    connection_wakeup();
+    if(http->multi != NULL) {
+      curl_multi_wakeup(http->multi);
+    }
+    pthread_join(phoenix->connection_thread,NULL);
+  }
+
+  //Batches not answered yet are posted again next time
+  for(i=0;batches && i<HTTP_QUEUE_MAX;i++) {
+    if(batches[i].id != 0) {
+      if(batches[i].curl != NULL) {
+        curl_multi_remove_handle(http->multi,batches[i].curl);
+      }
+      inflight_forget(batches[i].id);
+      phoenix_http_batch_free(&batches[i]);
+    }
+    notification_free(&batches[i].body);
+  }
+  pthread_mutex_lock(&http->mutex);
+  http->in_flight=0;
+  http->queued=0;
+  pthread_mutex_unlock(&http->mutex);
+  free(http->batches);
+  http->batches=NULL;
+  if(http->multi != NULL) {
+    curl_multi_cleanup(http->multi);
+    http->multi=NULL;
+  }
+
+  if(http->frame != NULL) {
+    frame_free(http->frame);
+    free(http->frame);
+    http->frame=NULL;
+  }
 
+  phoenix_http_reset(phoenix);
+  if(http->share != NULL) {
+    curl_share_cleanup(http->share);
+    http->share=NULL;
+  }
+}
@@ -0,0 +1,361 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <phoenix.h>
+
+/*
+ * In-flight table.
+ *
+ * Maps the mid of every published message to the sample ids it carries,
+ * stored as ranges of consecutive ids. Nothing is written to the store
+ * when a message is published. Acknowledged messages are applied together
+ * by inflight_flush() with db_samples_sent(), one statement per id range in
+ * one transaction. Samples of messages acked with remove set are deleted,
+ * the others are marked sent.
+ *
+ * A sample stays in the id set until its ack has been applied, so
+ * db_samples_read() never hands it out twice.
+ */
+
+#define INFLIGHT_BUCKETS 256
+
+typedef struct {
+  int64_t first;
+  int64_t last;
+} inflight_range_t;
+
+typedef struct inflight_message {
+  int mid;
+  int acked;
+  int remove;
+  int num_ranges;
+  int size;
+  inflight_range_t *ranges;
+  struct inflight_message *next;
+} inflight_message_t;
+
+static inflight_message_t *buckets[INFLIGHT_BUCKETS];
+static inflight_message_t *free_messages=NULL;
+static int num_acked=0;
+
+//Open addressing set of the sample ids in flight, 0 marks an empty slot
+static int64_t *ids=NULL;
+static size_t ids_size=0, ids_count=0;
+
+static inflight_stats_t stats;
+static pthread_mutex_t inflight_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+static size_t inflight_slot(int64_t id) {
+  uint64_t hash=(uint64_t)id * 0x9E3779B97F4A7C15ULL;
+  return (hash >> 32) & (ids_size-1);
+}
+
+static void inflight_id_put(int64_t id);
+
+static void inflight_ids_grow() {
+  int64_t *old=ids;
+  size_t i, old_size=ids_size;
+
+  ids_size = ids_size ? ids_size*2 : 1024;
+  ids=calloc(sizeof(int64_t),ids_size);
+  ids_count=0;
+
+  for(i=0;i<old_size;i++) {
+    if(old[i]) {
+      inflight_id_put(old[i]);
+    }
+  }
+  free(old);
+}
+
+static void inflight_id_put(int64_t id) {
+  size_t i;
+
+  if((ids_count+1)*2 > ids_size) {
+    inflight_ids_grow();
+  }
+
+  for(i=inflight_slot(id);ids[i] && ids[i] != id;i=(i+1) & (ids_size-1)) {}
+  if(ids[i] == 0) {
+    ids[i]=id;
+    ids_count++;
+  }
+}
+
+//Linear probing delete, shift later entries of the cluster back
+static void inflight_id_remove(int64_t id) {
+  size_t i, j, home;
+
+  for(i=inflight_slot(id);ids[i] && ids[i] != id;i=(i+1) & (ids_size-1)) {}
+  if(ids[i] == 0) {
+    return;
+  }
+
+  ids[i]=0;
+  ids_count--;
+  for(j=(i+1) & (ids_size-1);ids[j];j=(j+1) & (ids_size-1)) {
+    home=inflight_slot(ids[j]);
+    //Move ids[j] into the hole unless its home lies cyclically in (i,j]
+    if((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j))) {
+      ids[i]=ids[j];
+      ids[j]=0;
+      i=j;
+    }
+  }
+}
+
+//Only unacknowledged messages match, the broker may reuse a mid as soon as
+//it has acked it, before the ack is flushed
+static inflight_message_t **inflight_find(int mid) {
+  inflight_message_t **message=&buckets[mid & (INFLIGHT_BUCKETS-1)];
+
+  while(*message && ((*message)->mid != mid || (*message)->acked)) {
+    message=&(*message)->next;
+  }
+
+  return message;
+}
+
+int inflight_add(int mid, int64_t id) {
+  inflight_message_t **slot, *message;
+  inflight_range_t *range;
+
+  pthread_mutex_lock(&inflight_mutex);
+  slot=inflight_find(mid);
+  message=*slot;
+  if(message == NULL) {
+    if(free_messages) {
+      message=free_messages;
+      free_messages=message->next;
+    }else{
+      message=calloc(sizeof(inflight_message_t),1);
+    }
+    message->mid=mid;
+    message->acked=0;
+    message->num_ranges=0;
+    message->next=NULL;
+    *slot=message;
+    stats.messages++;
+  }
+
+  range = message->num_ranges ? &message->ranges[message->num_ranges-1] : NULL;
+  if(range && range->last+1 == id) {
+    range->last=id;
+  }else if(range && range->first-1 == id) {
+    //Samples are read newest first
+    range->first=id;
+  }else{
+    if(message->num_ranges == message->size) {
+      message->size = message->size ? message->size*2 : 4;
+      message->ranges=realloc(message->ranges,sizeof(inflight_range_t)*message->size);
+    }
+    range=&message->ranges[message->num_ranges++];
+    range->first=id;
+    range->last=id;
+  }
+
+  inflight_id_put(id);
+  stats.published++;
+  stats.in_flight=ids_count;
+  pthread_mutex_unlock(&inflight_mutex);
+
+  return 0;
+}
+
+int inflight_ack(int mid, int remove) {
+  inflight_message_t *message;
+  int flush=0;
+
+  pthread_mutex_lock(&inflight_mutex);
+  message=*inflight_find(mid);
+  if(message) {
+    message->acked=1;
+    message->remove=remove;
+    stats.acked++;
+    flush = ++num_acked >= INFLIGHT_ACK_BATCH;
+  }
+  pthread_mutex_unlock(&inflight_mutex);
+
+  if(message == NULL) {
+    //QoS 0 publishes are reported too
+    debug_printf("Ack for unknown message %d\n", mid);
+    return -1;
+  }
+
+  return flush ? inflight_flush() : 0;
+}
+
+int inflight_pending(int64_t id) {
+  size_t i;
+  int found=0;
+
+  pthread_mutex_lock(&inflight_mutex);
+  if(ids_count > 0) {
+    for(i=inflight_slot(id);ids[i];i=(i+1) & (ids_size-1)) {
+      if(ids[i] == id) {
+        found=1;
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&inflight_mutex);
+
+  return found;
+}
+
+int inflight_count() {
+  int count;
+
+  pthread_mutex_lock(&inflight_mutex);
+  count=ids_count;
+  pthread_mutex_unlock(&inflight_mutex);
+
+  return count;
+}
+
+static void inflight_ids_append(int64_t **ids, int *num_ids, int *size, inflight_message_t *message) {
+  int64_t id;
+  int i;
+
+  for(i=0;i<message->num_ranges;i++) {
+    for(id=message->ranges[i].first;id<=message->ranges[i].last;id++) {
+      if(*num_ids == *size) {
+        *size = *size ? *size*2 : 256;
+        *ids=realloc(*ids,sizeof(int64_t) * *size);
+      }
+      (*ids)[(*num_ids)++]=id;
+    }
+  }
+}
+
+//Write every acknowledged message to the store in one transaction per mode
+int inflight_flush() {
+  static pthread_mutex_t flush_mutex=PTHREAD_MUTEX_INITIALIZER;
+  inflight_message_t **slot, *message, *acked=NULL;
+  int64_t *sent=NULL, *removed=NULL;
+  int i, b, num_sent=0, sent_size=0, num_removed=0, removed_size=0;
+  int status=0, removed_status=0;
+
+  pthread_mutex_lock(&flush_mutex);
+
+  pthread_mutex_lock(&inflight_mutex);
+  for(b=0;b<INFLIGHT_BUCKETS && num_acked > 0;b++) {
+    slot=&buckets[b];
+    while(*slot) {
+      message=*slot;
+      if(!message->acked) {
+        slot=&message->next;
+        continue;
+      }
+
+      *slot=message->next;
+      message->next=acked;
+      acked=message;
+      num_acked--;
+
+      if(message->remove) {
+        inflight_ids_append(&removed,&num_removed,&removed_size,message);
+      }else{
+        inflight_ids_append(&sent,&num_sent,&sent_size,message);
+      }
+    }
+  }
+  pthread_mutex_unlock(&inflight_mutex);
+
+  if(acked == NULL) {
+    pthread_mutex_unlock(&flush_mutex);
+    return 0;
+  }
+
+  //The ids stay in flight until the store says they are sent. If that
+  //fails they are read and sent again
+  status=db_samples_sent(sent,num_sent,0);
+  removed_status=db_samples_sent(removed,num_removed,1);
+
+  pthread_mutex_lock(&inflight_mutex);
+  if(status >= 0) {
+    stats.transactions+= num_sent > 0;
+    stats.statements+=status;
+    stats.applied+=num_sent;
+  }
+  if(removed_status >= 0) {
+    stats.transactions+= num_removed > 0;
+    stats.statements+=removed_status;
+    stats.applied+=num_removed;
+  }
+  for(i=0;i<num_sent;i++) {
+    inflight_id_remove(sent[i]);
+  }
+  for(i=0;i<num_removed;i++) {
+    inflight_id_remove(removed[i]);
+  }
+  while(acked) {
+    message=acked;
+    acked=message->next;
+    message->next=free_messages;
+    free_messages=message;
+    stats.messages--;
+  }
+  stats.in_flight=ids_count;
+  pthread_mutex_unlock(&inflight_mutex);
+
+  pthread_mutex_unlock(&flush_mutex);
+  free(sent);
+  free(removed);
+
+  return status < 0 || removed_status < 0 ? -1 : 0;
+}
+
+//Forget one message that will not be acked, its samples are sent again
+void inflight_forget(int mid) {
+  inflight_message_t **slot, *message;
+  int64_t id;
+  int i;
+
+  pthread_mutex_lock(&inflight_mutex);
+  slot=inflight_find(mid);
+  if((message=*slot) != NULL) {
+    *slot=message->next;
+    for(i=0;i<message->num_ranges;i++) {
+      for(id=message->ranges[i].first;id<=message->ranges[i].last;id++) {
+        inflight_id_remove(id);
+      }
+    }
+    message->next=free_messages;
+    free_messages=message;
+    stats.messages--;
+    stats.in_flight=ids_count;
+  }
+  pthread_mutex_unlock(&inflight_mutex);
+}
+
+//Forget everything in flight, the samples are sent again
+void inflight_clear() {
+  inflight_message_t *message;
+  int b;
+
+  pthread_mutex_lock(&inflight_mutex);
+  for(b=0;b<INFLIGHT_BUCKETS;b++) {
+    while(buckets[b]) {
+      message=buckets[b];
+      buckets[b]=message->next;
+      message->next=free_messages;
+      free_messages=message;
+    }
+  }
+  if(ids) {
+    memset(ids,0,sizeof(int64_t)*ids_size);
+  }
+  ids_count=0;
+  num_acked=0;
+  stats.messages=0;
+  stats.in_flight=0;
+  pthread_mutex_unlock(&inflight_mutex);
+}
+
+void inflight_stats(inflight_stats_t *inflight_stats) {
+  pthread_mutex_lock(&inflight_mutex);
+  *inflight_stats=stats;
+  pthread_mutex_unlock(&inflight_mutex);
+}
@@ -0,0 +1,364 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <phoenix.h>
+
+/*
+ * Bounded ring of fixed size sample records in front of the sample store.
+ *
+ * Producers claim slots with a CAS on the enqueue position and publish them
+ * through the per slot sequence number (Vyukov's bounded queue), so
+ * phoenix_send_sample() never takes a lock. The drainer thread moves the
+ * records into the samples table with db_sample_insert_batch().
+ *
+ * The dequeue side has several consumers too: with
+ * INGEST_OVERFLOW_DROP_OLDEST a producer that finds the ring full dequeues
+ * the oldest record itself, concurrently with the drainer, so dequeue must
+ * keep its CAS on the dequeue position.
+ *
+ * A batch the store refuses is lost, it is counted as dropped and in
+ * store_errors, not as drained.
+ *
+ * With INGEST_OVERFLOW_BLOCK a producer that finds the ring full sleeps on
+ * space_cond, the drainer wakes it once it has dequeued a batch.
+ *
+ * ingest_close() stops taking samples before it frees the ring. Producers
+ * count themselves in producers while they use it, the closer waits for
+ * the count to reach 0. A sample pushed once closing started goes straight
+ * to the store, as without the ring.
+ */
+
+typedef struct {
+  atomic_size_t sequence;
+  phoenix_sample_t sample;
+} ingest_cell_t;
+
+static ingest_cell_t *cells=NULL;
+static size_t mask;
+static atomic_size_t enqueue_pos;
+static atomic_size_t dequeue_pos;
+static ingest_overflow_t overflow_policy;
+
+static atomic_ullong stat_pushed;
+static atomic_ullong stat_drained;
+static atomic_ullong stat_dropped;
+static atomic_ullong stat_store_errors;
+static atomic_ullong stat_spilled;
+static atomic_ullong stat_blocked;
+static atomic_ullong stat_high_water;
+
+static atomic_int running;
+static atomic_int accepting;
+static atomic_int producers;
+static pthread_t drain_thread;
+static pthread_mutex_t drain_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drain_cond=PTHREAD_COND_INITIALIZER;
+
+//Producers blocked on a full ring and ingest_close() wait on space_cond
+static atomic_int space_waiters;
+static pthread_mutex_t space_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t space_cond=PTHREAD_COND_INITIALIZER;
+
+static int ingest_enqueue(phoenix_sample_t *sample) {
+  ingest_cell_t *cell;
+  size_t pos=atomic_load_explicit(&enqueue_pos,memory_order_relaxed);
+  size_t seq;
+  intptr_t diff;
+
+  for(;;) {
+    cell=&cells[pos & mask];
+    seq=atomic_load_explicit(&cell->sequence,memory_order_acquire);
+    diff=(intptr_t)seq - (intptr_t)pos;
+    if(diff == 0) {
+      if(atomic_compare_exchange_weak_explicit(&enqueue_pos,&pos,pos+1,memory_order_relaxed,memory_order_relaxed)) {
+        break;
+      }
+    }else if(diff < 0) {
+      //Full
+      return -1;
+    }else{
+      pos=atomic_load_explicit(&enqueue_pos,memory_order_relaxed);
+    }
+  }
+
+  cell->sample=*sample;
+  atomic_store_explicit(&cell->sequence,pos+1,memory_order_release);
+  return 0;
+}
+
+static int ingest_dequeue(phoenix_sample_t *sample) {
+  ingest_cell_t *cell;
+  size_t pos=atomic_load_explicit(&dequeue_pos,memory_order_relaxed);
+  size_t seq;
+  intptr_t diff;
+
+  for(;;) {
+    cell=&cells[pos & mask];
+    seq=atomic_load_explicit(&cell->sequence,memory_order_acquire);
+    diff=(intptr_t)seq - (intptr_t)(pos+1);
+    if(diff == 0) {
+      if(atomic_compare_exchange_weak_explicit(&dequeue_pos,&pos,pos+1,memory_order_relaxed,memory_order_relaxed)) {
+        break;
+      }
+    }else if(diff < 0) {
+      //Empty
+      return -1;
+    }else{
+      pos=atomic_load_explicit(&dequeue_pos,memory_order_relaxed);
+    }
+  }
+
+  *sample=cell->sample;
+  atomic_store_explicit(&cell->sequence,pos+mask+1,memory_order_release);
+  return 0;
+}
+
+static void ingest_update_high_water(void) {
+  unsigned long long depth=atomic_load_explicit(&enqueue_pos,memory_order_relaxed) - atomic_load_explicit(&dequeue_pos,memory_order_relaxed);
+  unsigned long long high=atomic_load_explicit(&stat_high_water,memory_order_relaxed);
+
+  while(depth > high) {
+    if(atomic_compare_exchange_weak_explicit(&stat_high_water,&high,depth,memory_order_relaxed,memory_order_relaxed)) {
+      break;
+    }
+  }
+
+  //Concurrent producers may step over the exact size, every push past it
+  //signals. Without a waiter that is only a load in the condition
+  if(depth >= INGEST_BATCH_SIZE) {
+    pthread_cond_signal(&drain_cond);
+  }
+}
+
+//Wake producers blocked on a full ring. The fence orders the dequeues
+//before the waiter count, a producer counted later sees the room
+static void ingest_space_wakeup(void) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if(atomic_load(&space_waiters) > 0) {
+    pthread_mutex_lock(&space_mutex);
+    pthread_cond_broadcast(&space_cond);
+    pthread_mutex_unlock(&space_mutex);
+  }
+}
+
+//INGEST_OVERFLOW_BLOCK: sleep until the drainer made room. Other producers
+//may take it first, the caller tries again
+static void ingest_wait_room(void) {
+  pthread_mutex_lock(&space_mutex);
+  atomic_fetch_add(&space_waiters,1);
+  while(atomic_load(&enqueue_pos) - atomic_load(&dequeue_pos) > mask) {
+    pthread_cond_signal(&drain_cond);
+    pthread_cond_wait(&space_cond,&space_mutex);
+  }
+  atomic_fetch_sub(&space_waiters,1);
+  pthread_mutex_unlock(&space_mutex);
+}
+
+//Move everything currently in the ring to the sample store
+static int ingest_drain(void) {
+  static phoenix_sample_t batch[INGEST_BATCH_SIZE];
+  int num_samples,total=0;
+
+  do {
+    num_samples=0;
+    while(num_samples<INGEST_BATCH_SIZE && ingest_dequeue(&batch[num_samples])==0) {
+      num_samples++;
+    }
+
+    if(num_samples > 0) {
+      ingest_space_wakeup();
+      if(db_sample_insert_batch(batch,num_samples,NULL,NULL)) {
+        print_error("Could not store %d samples from ingest ring, dropped\n", num_samples);
+        atomic_fetch_add(&stat_dropped,num_samples);
+        atomic_fetch_add(&stat_store_errors,1);
+      }else{
+        atomic_fetch_add(&stat_drained,num_samples);
+      }
+      total+=num_samples;
+    }
+  } while(num_samples == INGEST_BATCH_SIZE);
+
+  return total;
+}
+
+static void *ingest_drain_handler(void *input) {
+  struct timespec deadline;
+
+  while(atomic_load(&running)) {
+    pthread_mutex_lock(&drain_mutex);
+    clock_gettime(CLOCK_REALTIME,&deadline);
+    deadline.tv_nsec+=INGEST_DRAIN_INTERVAL_MS*1000000L;
+    if(deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec-=1000000000L;
+    }
+    pthread_cond_timedwait(&drain_cond,&drain_mutex,&deadline);
+
+    //drain_mutex also keeps ingest_flush() from draining at the same time
+    ingest_drain();
+    pthread_mutex_unlock(&drain_mutex);
+  }
+
+  return NULL;
+}
+
+int ingest_init(int capacity, ingest_overflow_t overflow) {
+  size_t i,size=1;
+
+  if(cells != NULL) {
+    print_error("Ingest ring already initialized\n");
+    return -1;
+  }
+
+  //Round capacity up to a power of two
+  while(size < capacity) {
+    size<<=1;
+  }
+
+  cells=calloc(sizeof(ingest_cell_t),size);
+  if(cells == NULL) {
+    print_error("Could not allocate ingest ring of %zu samples\n", size);
+    return -1;
+  }
+
+  mask=size-1;
+  for(i=0;i<size;i++) {
+    atomic_init(&cells[i].sequence,i);
+  }
+  atomic_init(&enqueue_pos,0);
+  atomic_init(&dequeue_pos,0);
+  atomic_store(&stat_pushed,0);
+  atomic_store(&stat_drained,0);
+  atomic_store(&stat_dropped,0);
+  atomic_store(&stat_store_errors,0);
+  atomic_store(&stat_spilled,0);
+  atomic_store(&stat_blocked,0);
+  atomic_store(&stat_high_water,0);
+  overflow_policy=overflow;
+
+  atomic_store(&producers,0);
+  atomic_store(&running,1);
+  if(pthread_create(&drain_thread,NULL,ingest_drain_handler,NULL)) {
+    print_error("Could not start ingest drain thread\n");
+    atomic_store(&running,0);
+    free(cells);
+    cells=NULL;
+    return -1;
+  }
+  atomic_store(&accepting,1);
+
+  print_info("Ingest ring started with %zu samples\n", size);
+  return 0;
+}
+
+int ingest_enabled() {
+  return atomic_load(&accepting);
+}
+
+//Leave the ring, the last producer out wakes ingest_close()
+static void ingest_leave(void) {
+  if(atomic_fetch_sub(&producers,1) == 1 && !atomic_load(&accepting)) {
+    pthread_mutex_lock(&space_mutex);
+    pthread_cond_broadcast(&space_cond);
+    pthread_mutex_unlock(&space_mutex);
+  }
+}
+
+int ingest_push(int stream_id, long long timestamp, double value) {
+  phoenix_sample_t sample, oldest;
+
+  //Stamp samples before year 2000 at ingest time, not when drained
+  if(timestamp < 946681200) {
+    timestamp=phoenix_get_timestamp();
+  }
+
+  sample.id=0;
+  sample.stream_id=stream_id;
+  sample.timestamp=timestamp;
+  sample.value=value;
+
+  //Counted before accepting is read, so ingest_close() either waits for
+  //this push or it sees the ring closed
+  atomic_fetch_add(&producers,1);
+  if(!atomic_load(&accepting)) {
+    ingest_leave();
+    return db_sample_insert_stream(sample.stream_id,sample.timestamp,sample.value) < 0 ? -1 : 0;
+  }
+
+  while(ingest_enqueue(&sample)) {
+    switch(overflow_policy) {
+      case INGEST_OVERFLOW_DROP_OLDEST:
+        if(ingest_dequeue(&oldest)==0) {
+          atomic_fetch_add(&stat_dropped,1);
+        }
+        break;
+      case INGEST_OVERFLOW_SPILL:
+        atomic_fetch_add(&stat_spilled,1);
+        atomic_fetch_add(&stat_pushed,1);
+        ingest_leave();
+        return db_sample_insert_stream(sample.stream_id,sample.timestamp,sample.value) < 0 ? -1 : 0;
+      case INGEST_OVERFLOW_BLOCK:
+      default:
+        atomic_fetch_add(&stat_blocked,1);
+        ingest_wait_room();
+        break;
+    }
+  }
+
+  atomic_fetch_add_explicit(&stat_pushed,1,memory_order_relaxed);
+  ingest_update_high_water();
+  ingest_leave();
+  return 0;
+}
+
+int ingest_flush() {
+  int num_samples;
+
+  if(cells == NULL) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&drain_mutex);
+  num_samples=ingest_drain();
+  pthread_mutex_unlock(&drain_mutex);
+
+  return num_samples;
+}
+
+void ingest_close() {
+  if(!atomic_load(&running)) {
+    return;
+  }
+
+  //Let the producers inside finish, blocked ones get room from the drainer
+  atomic_store(&accepting,0);
+  pthread_mutex_lock(&space_mutex);
+  while(atomic_load(&producers) > 0) {
+    pthread_cond_signal(&drain_cond);
+    pthread_cond_wait(&space_cond,&space_mutex);
+  }
+  pthread_mutex_unlock(&space_mutex);
+
+  atomic_store(&running,0);
+  pthread_cond_signal(&drain_cond);
+  pthread_join(drain_thread,NULL);
+
+  ingest_flush();
+  free(cells);
+  cells=NULL;
+}
+
+void ingest_stats(ingest_stats_t *stats) {
+  stats->pushed=atomic_load(&stat_pushed);
+  stats->drained=atomic_load(&stat_drained);
+  stats->dropped=atomic_load(&stat_dropped);
+  stats->store_errors=atomic_load(&stat_store_errors);
+  stats->spilled=atomic_load(&stat_spilled);
+  stats->blocked=atomic_load(&stat_blocked);
+  stats->high_water=atomic_load(&stat_high_water);
+  stats->depth=cells ? atomic_load(&enqueue_pos) - atomic_load(&dequeue_pos) : 0;
+}
@@ -0,0 +1,453 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+#include <zlib.h>
+#include "journal.h"
+
+/*
+ * Append-only write-ahead journal for the in-memory sample store.
+ *
+ * Records are appended to a memory buffer while db_mutex is held, so the
+ * journal order matches the database order. The journal thread writes the
+ * buffer and fsyncs it once commit_records records are pending, or
+ * commit_interval_ms after the first pending record, whichever comes first.
+ */
+
+static int fd=-1;
+static char journal_path[PATH_MAX];
+static char rotated_path[PATH_MAX];
+
+static char *buffer=NULL, *spare=NULL;
+static size_t buffer_len=0, buffer_size=0, spare_size=0;
+static int pending_records=0;
+static struct timespec first_pending;
+
+//Records appended before the last journal_cut(), not yet rotated
+static char *cut_buffer=NULL;
+static size_t cut_len=0, cut_size=0;
+static int cut_records=0, cut_pending=0;
+
+static int commit_records=JOURNAL_COMMIT_RECORDS;
+static int commit_interval_ms=JOURNAL_COMMIT_INTERVAL_MS;
+static journal_stats_t stats;
+
+static volatile int running=0;
+static pthread_t journal_thread;
+static pthread_mutex_t journal_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t io_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_cond=PTHREAD_COND_INITIALIZER;
+
+static uint32_t journal_crc(journal_record_t *record, char *stream) {
+  uLong crc=crc32(0L,Z_NULL,0);
+  crc=crc32(crc,(const Bytef *)record + sizeof(record->crc), sizeof(journal_record_t) - sizeof(record->crc));
+  if(record->length > 0) {
+    crc=crc32(crc,(const Bytef *)stream,record->length);
+  }
+  return crc;
+}
+
+static int journal_write(char *data, size_t len) {
+  ssize_t ret;
+
+  while(len > 0) {
+    ret=write(fd,data,len);
+    if(ret < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      print_error("Could not write journal: %s\n", strerror(errno));
+      return -1;
+    }
+    data+=ret;
+    len-=ret;
+  }
+
+  return 0;
+}
+
+//Close the journal at the cut and continue in a fresh one. The closed
+//journal becomes the rotated one, or is merged into it when an earlier
+//snapshot never made it to disk. Caller must hold io_mutex
+static int journal_switch() {
+  char data[64*1024];
+  ssize_t len;
+  int in, out, status=0;
+
+  close(fd);
+
+  if(access(rotated_path,F_OK) == 0) {
+    //An earlier snapshot never made it to disk, its journal is still needed
+    in=open(journal_path,O_RDONLY);
+    out=open(rotated_path,O_WRONLY|O_APPEND);
+    if(in < 0 || out < 0) {
+      print_error("Could not merge journal into %s: %s\n", rotated_path, strerror(errno));
+      status=-1;
+    }else{
+      while((len=read(in,data,sizeof(data))) > 0) {
+        if(write(out,data,len) != len) {
+          print_error("Could not merge journal into %s: %s\n", rotated_path, strerror(errno));
+          status=-1;
+          break;
+        }
+      }
+    }
+    if(in >= 0) {
+      close(in);
+    }
+    if(out >= 0) {
+      close(out);
+    }
+    if(status == 0) {
+      unlink(journal_path);
+    }
+  }else if(rename(journal_path,rotated_path)) {
+    print_error("Could not rotate journal: %s\n", strerror(errno));
+    status=-1;
+  }
+
+  fd=open(journal_path,O_WRONLY|O_CREAT|O_APPEND,0644);
+  if(fd < 0) {
+    print_error("Could not reopen journal %s: %s\n", journal_path, strerror(errno));
+    status=-1;
+  }
+
+  return status;
+}
+
+//Write everything appended so far and fsync it if sync is set. Records
+//before a cut go to the journal being rotated, the rest to the fresh one.
+//Caller must hold io_mutex
+static int journal_flush(int sync) {
+  char *data, *cut_data;
+  size_t len, size, cut_data_len, cut_data_size;
+  int records, rotate, status=0;
+
+  pthread_mutex_lock(&journal_mutex);
+  data=buffer;
+  len=buffer_len;
+  size=buffer_size;
+  records=pending_records;
+
+  buffer=spare;
+  buffer_size=spare_size;
+  buffer_len=0;
+  pending_records=0;
+
+  //Taken out, journal_cut() may hand out a new cut meanwhile
+  rotate=cut_pending;
+  cut_data=cut_buffer;
+  cut_data_len=cut_len;
+  cut_data_size=cut_size;
+  records+=cut_records;
+  cut_buffer=NULL;
+  cut_size=0;
+  cut_len=0;
+  cut_records=0;
+  cut_pending=0;
+  pthread_mutex_unlock(&journal_mutex);
+
+  if(rotate && fd >= 0) {
+    //The rotated journal replaces the snapshot until the next one is on disk
+    if(cut_data_len > 0 && journal_write(cut_data,cut_data_len)) {
+      status=-1;
+    }else if(fdatasync(fd)) {
+      print_error("Could not sync journal: %s\n", strerror(errno));
+      status=-1;
+    }
+    if(journal_switch()) {
+      status=-1;
+    }
+  }
+
+  if(len > 0 && fd >= 0) {
+    if(journal_write(data,len)) {
+      status=-1;
+    }else if(sync && fdatasync(fd)) {
+      print_error("Could not sync journal: %s\n", strerror(errno));
+      status=-1;
+    }
+  }
+
+  pthread_mutex_lock(&journal_mutex);
+  spare=data;
+  spare_size=size;
+  if(cut_buffer == NULL) {
+    cut_buffer=cut_data;
+    cut_size=cut_data_size;
+  }else{
+    free(cut_data);
+  }
+  if((len > 0 && sync) || (rotate && cut_data_len > 0)) {
+    stats.commits++;
+    stats.records+=records;
+    stats.bytes+=len+cut_data_len;
+  }
+  pthread_mutex_unlock(&journal_mutex);
+
+  return status;
+}
+
+static void *journal_handler(void *input) {
+  struct timespec deadline;
+
+  pthread_mutex_lock(&journal_mutex);
+  while(running) {
+    if(pending_records == 0) {
+      pthread_cond_wait(&journal_cond,&journal_mutex);
+      continue;
+    }
+
+    if(pending_records < commit_records) {
+      deadline=first_pending;
+      deadline.tv_sec+=commit_interval_ms/1000;
+      deadline.tv_nsec+=(commit_interval_ms%1000)*1000000L;
+      if(deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec-=1000000000L;
+      }
+      if(pthread_cond_timedwait(&journal_cond,&journal_mutex,&deadline) != ETIMEDOUT) {
+        continue;
+      }
+    }
+    pthread_mutex_unlock(&journal_mutex);
+
+    pthread_mutex_lock(&io_mutex);
+    journal_flush(1);
+    pthread_mutex_unlock(&io_mutex);
+
+    pthread_mutex_lock(&journal_mutex);
+  }
+  pthread_mutex_unlock(&journal_mutex);
+
+  return NULL;
+}
+
+int journal_open(char *path) {
+  sprintf(journal_path,"%s/%s",path,JOURNAL_FILENAME);
+  sprintf(rotated_path,"%s/%s.old",path,JOURNAL_FILENAME);
+
+  fd=open(journal_path,O_WRONLY|O_CREAT|O_APPEND,0644);
+  if(fd < 0) {
+    print_error("Could not open journal %s: %s\n", journal_path, strerror(errno));
+    return -1;
+  }
+
+  running=1;
+  if(pthread_create(&journal_thread,NULL,journal_handler,NULL)) {
+    print_error("Could not start journal thread\n");
+    running=0;
+    close(fd);
+    fd=-1;
+    return -1;
+  }
+
+  return 0;
+}
+
+void journal_close() {
+  if(fd < 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&journal_mutex);
+  running=0;
+  pthread_cond_signal(&journal_cond);
+  pthread_mutex_unlock(&journal_mutex);
+  pthread_join(journal_thread,NULL);
+
+  journal_sync();
+
+  close(fd);
+  fd=-1;
+}
+
+int journal_append(journal_type_t type, int64_t id, int64_t arg, double value, char *stream) {
+  journal_record_t record;
+  size_t length = stream ? strlen(stream) : 0;
+  size_t needed = sizeof(record) + length;
+
+  if(fd < 0) {
+    return 0;
+  }
+
+  memset(&record,0,sizeof(record));
+  record.length=length;
+  record.type=type;
+  record.id=id;
+  record.arg=arg;
+  record.value=value;
+  record.crc=journal_crc(&record,stream);
+
+  pthread_mutex_lock(&journal_mutex);
+  if(buffer_len + needed > buffer_size) {
+    buffer_size = buffer_size ? buffer_size*2 : 64*1024;
+    while(buffer_len + needed > buffer_size) {
+      buffer_size*=2;
+    }
+    buffer=realloc(buffer,buffer_size);
+  }
+
+  memcpy(buffer+buffer_len,&record,sizeof(record));
+  memcpy(buffer+buffer_len+sizeof(record),stream,length);
+  buffer_len+=needed;
+
+  if(pending_records++ == 0) {
+    clock_gettime(CLOCK_REALTIME,&first_pending);
+    pthread_cond_signal(&journal_cond);
+  }else if(pending_records >= commit_records) {
+    pthread_cond_signal(&journal_cond);
+  }
+  pthread_mutex_unlock(&journal_mutex);
+
+  return 0;
+}
+
+int journal_sync() {
+  int status;
+
+  pthread_mutex_lock(&io_mutex);
+  status=journal_flush(1);
+  pthread_mutex_unlock(&io_mutex);
+
+  return status;
+}
+
+//Mark the records appended so far as the ones the snapshot contains.
+//Called with db_mutex held right as a snapshot completes, so it only moves
+//the buffer aside, journal_rotate() does the file work
+int journal_cut() {
+  char *data;
+  size_t size;
+
+  if(fd < 0) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&journal_mutex);
+  if(cut_pending) {
+    //The earlier cut was never rotated, this one covers it
+    if(cut_len + buffer_len > cut_size) {
+      cut_size=cut_len + buffer_len;
+      cut_buffer=realloc(cut_buffer,cut_size);
+    }
+    memcpy(cut_buffer+cut_len,buffer,buffer_len);
+    cut_len+=buffer_len;
+    cut_records+=pending_records;
+    buffer_len=0;
+  }else{
+    data=cut_buffer;
+    size=cut_size;
+    cut_buffer=buffer;
+    cut_size=buffer_size;
+    cut_len=buffer_len;
+    cut_records=pending_records;
+    buffer=data;
+    buffer_size=size;
+    buffer_len=0;
+    cut_pending=1;
+  }
+  pending_records=0;
+  pthread_mutex_unlock(&journal_mutex);
+
+  return 0;
+}
+
+//Move the records up to the cut aside and continue in a fresh journal.
+//Called after db_mutex is released, the journal thread may have done it
+//already when it flushed in between
+int journal_rotate() {
+  int status;
+
+  if(fd < 0) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&io_mutex);
+  status=journal_flush(0);
+  pthread_mutex_unlock(&io_mutex);
+
+  return status;
+}
+
+//The snapshot holding the rotated records is safely on disk
+void journal_drop_rotated() {
+  if(unlink(rotated_path) && errno != ENOENT) {
+    print_error("Could not remove %s: %s\n", rotated_path, strerror(errno));
+  }
+}
+
+//Apply every complete record in the journal file. A torn record at the
+//end, left by a power cut in the middle of a write, is cut off
+static int journal_replay_file(char *filename, journal_apply_t apply) {
+  char stream[65536];
+  journal_record_t record;
+  off_t valid=0;
+  int num_records=0;
+  FILE *f;
+
+  f=fopen(filename,"rb");
+  if(f == NULL) {
+    return 0;
+  }
+
+  while(fread(&record,sizeof(record),1,f) == 1) {
+    if(fread(stream,1,record.length,f) != record.length) {
+      break;
+    }
+    stream[record.length]=0;
+
+    if(record.crc != journal_crc(&record,stream)) {
+      print_warning("Journal checksum mismatch at offset %ld\n", (long)valid);
+      break;
+    }
+
+    if(apply(&record,stream)) {
+      print_error("Could not apply journal record %d of type %d\n", num_records, record.type);
+    }
+
+    valid+=sizeof(record)+record.length;
+    num_records++;
+  }
+  fclose(f);
+
+  if(truncate(filename,valid)) {
+    print_error("Could not cut journal at offset %ld: %s\n", (long)valid, strerror(errno));
+  }
+
+  print_info("Replayed %d records from %s\n", num_records, filename);
+  return num_records;
+}
+
+//Replay a rotated journal left by an unfinished snapshot, then the current one
+int journal_replay(char *path, journal_apply_t apply) {
+  char filename[PATH_MAX];
+  int num_records;
+
+  sprintf(filename,"%s/%s.old",path,JOURNAL_FILENAME);
+  num_records=journal_replay_file(filename,apply);
+
+  sprintf(filename,"%s/%s",path,JOURNAL_FILENAME);
+  return num_records + journal_replay_file(filename,apply);
+}
+
+void journal_commit_interval_set(int records, int interval_ms) {
+  pthread_mutex_lock(&journal_mutex);
+  commit_records = records > 0 ? records : 1;
+  commit_interval_ms = interval_ms > 0 ? interval_ms : 1;
+  pthread_cond_signal(&journal_cond);
+  pthread_mutex_unlock(&journal_mutex);
+}
+
+void journal_stats(journal_stats_t *journal_stats) {
+  pthread_mutex_lock(&journal_mutex);
+  *journal_stats=stats;
+  journal_stats->pending=pending_records;
+  pthread_mutex_unlock(&journal_mutex);
+}
@@ -0,0 +1,38 @@
+#include <stdint.h>
+#include <phoenix.h>
+
+#define JOURNAL_FILENAME "phoenix.journal"
+
+typedef enum {
+  JOURNAL_SAMPLE_INSERT=1,
+  JOURNAL_SAMPLE_SENT,
+  JOURNAL_SAMPLE_DELETE,
+  JOURNAL_SAMPLE_MESSAGE_ID,
+  JOURNAL_SAMPLE_SENT_BY_MESSAGE_ID,
+  JOURNAL_SAMPLES_DELETE_SENT,
+  JOURNAL_SAMPLES_CLEAR_MESSAGE_IDS,
+  JOURNAL_SAMPLES_SENT_RANGE,        //id..arg, deleted if value is set
+  JOURNAL_SAMPLES_SEQ_RANGE,         //id..arg delivered under sequence number value
+  JOURNAL_SESSION_SEQ,               //Sequence numbers below arg are taken
+} journal_type_t;
+
+//On disk record, followed by length bytes of stream code
+typedef struct {
+  uint32_t crc;
+  uint16_t length;
+  uint8_t type;
+  uint8_t reserved;
+  int64_t id;
+  int64_t arg;
+  double value;
+} journal_record_t;
+
+typedef int (*journal_apply_t)(journal_record_t *record, char *stream);
+
+int journal_open(char *path);
+void journal_close();
+int journal_append(journal_type_t type, int64_t id, int64_t arg, double value, char *stream);
+int journal_cut();
+int journal_rotate();
+void journal_drop_rotated();
+int journal_replay(char *path, journal_apply_t apply);
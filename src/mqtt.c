@@ -14,6 +14,24 @@
 
 #define INSECURE_TLS 0
 
+//Constant publish properties, built once
+static mosquitto_property *sample_alias_properties=NULL;
+static char frame_content_type[128];
+static char frame_zlib_content_type[128];
+
+//An external event loop drives everything from one thread, no locking
+static void phoenix_lock(phoenix_t *phoenix) {
+  if(!phoenix->external) {
+    pthread_mutex_lock(&(phoenix->connection_mutex));
+  }
+}
+
+static void phoenix_unlock(phoenix_t *phoenix) {
+  if(!phoenix->external) {
+    pthread_mutex_unlock(&(phoenix->connection_mutex));
+  }
+}
+
 void mosq_log_callback(struct mosquitto *mosq, void *userdata, int level, const char *str)
 {
     switch(level){
@@ -52,13 +70,50 @@ void phoenix_subscribe_topics(phoenix_t *phoenix) {
 void mosq_disconnect_callback(struct mosquitto *mosq, void *userdata, int reason) {
   phoenix_t *phoenix = (phoenix_t *)userdata;
   print_info("Mosquitto disconnected: %s\n", phoenix->status_topic);
+  phoenix_lock(phoenix);
   phoenix->connected=0;
+  phoenix->topic_alias_max=0;
+  phoenix->sample_alias_mapped=0;
+  phoenix_unlock(phoenix);
+  if(reason != 0) {
+    window_error(window_time_ms());
+  }
 } 
 
-void mosq_connect_callback(struct mosquitto *mosq, void *userdata, int reason) {
+//Topic aliases and announced streams only live as long as the connection
+void mosq_connect_callback(struct mosquitto *mosq, void *userdata, int reason, int flags, const mosquitto_property *properties) {
   phoenix_t *phoenix = (phoenix_t *)userdata;
+  uint16_t alias_max=0;
+
+  if(reason != 0) {
+    print_warning("Mosquitto connect refused: %d\n", reason);
+    return;
+  }
+
   print_info("Mosquitto connected: %s\n", phoenix->status_topic);
+  mosquitto_property_read_int16(properties,MQTT_PROP_TOPIC_ALIAS_MAXIMUM,&alias_max,false);
+  debug_printf("Broker allows %d topic aliases\n", alias_max);
+
+  phoenix_lock(phoenix);
   phoenix->connected=1;
+  phoenix->reconnects=0;
+  phoenix->topic_alias_max=alias_max;
+  phoenix->sample_alias_mapped=0;
+  if(phoenix->interned) {
+    memset(phoenix->interned,0,phoenix->interned_size);
+  }
+  if(!(flags & 1)) {
+    phoenix->messages_in_flight=0;
+  }
+  phoenix_unlock(phoenix);
+
+  //Session Present is not set, what was in flight is gone with the old session
+  if(!(flags & 1)) {
+    print_info("No session on the broker, resuming from the store\n");
+    session_lost();
+  }
+  //The uploader skips its rounds while disconnected
+  connection_wakeup();
 
   phoenix_subscribe_topics(phoenix);
 } 
@@ -67,11 +122,15 @@ void mosq_publish_callback(struct mosquitto *mosq, void *userdata, int mid) {
   phoenix_t *phoenix = (phoenix_t *)userdata;
   if(mid > 0){
     
-    pthread_mutex_lock(&(phoenix->connection_mutex));
+    phoenix_lock(phoenix);
     debug_printf("MID received by server: %d\n",mid);
-    db_sample_sent_by_message_id(mid,0);
-    phoenix->messages_in_flight--;
-    pthread_mutex_unlock(&(phoenix->connection_mutex));
+    inflight_ack(mid,0);
+    //QoS 0 messages are reported as soon as they are written
+    if(window_acked(mid,window_time_ms())) {
+      phoenix->messages_in_flight--;
+    }
+    phoenix_unlock(phoenix);
+    connection_acked();
   }
 }
 
@@ -93,16 +152,24 @@ char *database_type_to_string(database_type_t type) {
   }
 }
 
-void command_config_write(phoenix_t *phoenix, uint8_t *p, struct mosquitto_message **response) {
+//type, key length, value length, key, value
+void command_config_write(phoenix_t *phoenix, uint8_t *p, int payload_len, struct mosquitto_message **response) {
   uint8_t type = p[0];
   uint16_t conf_len= p[1] << 8 | p[2];
   uint16_t value_len = p[3] << 8 | p[4];
   void *value_position=p + 5 + conf_len;
+  double fvalue;
+
+  if(payload_len < 5 || 5 + conf_len + value_len > payload_len) {
+    print_error("Malformed config write of %d bytes\n", payload_len);
+    return;
+  }
+
   char conf[conf_len+1];
   char value[value_len+1];
-  double fvalue;
 
   snprintf(conf,conf_len+1,"%s",p+5);
+  value[0]=0;
 
   print_info("ConfigWrite(%d): %s(%d) -> %s(%d)\n", type,conf,conf_len,value,value_len);
   switch(type) {
@@ -124,9 +191,16 @@ void command_config_write(phoenix_t *phoenix, uint8_t *p, struct mosquitto_messa
   }
 }
 
-void command_config_read(phoenix_t *phoenix, uint8_t *p, struct mosquitto_message **response) {
+//type, key length, key
+void command_config_read(phoenix_t *phoenix, uint8_t *p, int payload_len, struct mosquitto_message **response) {
   command_type_t cmd_type = p[0];
   uint16_t conf_len= p[1] << 8 | p[2];
+
+  if(payload_len < 3 || 3 + conf_len > payload_len) {
+    print_error("Malformed config read of %d bytes\n", payload_len);
+    return;
+  }
+
   char conf[conf_len+1];
 
   printf("conf len: %d\n", conf_len);
@@ -146,63 +220,15 @@ void command_config_read(phoenix_t *phoenix, uint8_t *p, struct mosquitto_messag
 
 
 
-void parse_command(phoenix_t *phoenix, const struct mosquitto_message *msg) {
-  int i;
-  struct mosquitto_message *response=NULL;
-  uint8_t *p = (uint8_t *)msg->payload;
-  uint64_t id = (
-      (uint64_t)p[0] << 56 | 
-      (uint64_t)p[1] << 48 | 
-      (uint64_t)p[2] << 40 | 
-      (uint64_t)p[3] << 32 | 
-      (uint64_t)p[4] << 24 | 
-      (uint64_t)p[5] << 16 | 
-      (uint64_t)p[6] << 8 | 
-      (uint64_t)p[7] << 0);
-  command_type_t cmd = p[8] << 8 | p[9];
-  uint8_t payload_length = p[10] << 8 | p[11];
-  uint8_t payload[1024];
-  unsigned char response_topic[1024];
-
-  memset(payload,0,sizeof(payload));
-
-  memcpy(payload, p+12, payload_length);
-
-
-  print_info("Command received(%d): id: %lld, cmd: %d, length: %d: ", msg->payloadlen,id, cmd, payload_length);
-  for(i=0;i<msg->payloadlen;i++) {
-    printf("0x%02x ",p[i]);
-  }
-  printf("\n");
-
-  switch(cmd) {
-    case COMMAND_CONFIG_READ:
-      command_config_read(phoenix,payload, &response);
-      break;
-    case COMMAND_CONFIG_WRITE:
-      command_config_write(phoenix,payload, &response);
-      break;
-    case COMMAND_CONFIG_REBOOT:
-      system("reboot");
-      break;
-    default:
-      print_error("Unknown command id: %d\n", cmd);
-  }
-
-  if(response != NULL) {
-    sprintf(response_topic, "/device/%s/command/%llu", phoenix->device_id, id);
-    print_info("Sending response to %s, %d bytes\n", response_topic,response->payloadlen);
-    phoenix_mqtt_send(phoenix,NULL,response_topic, response->payload, response->payloadlen);
-    free(response);
-  }
-    
+void command_reboot(phoenix_t *phoenix, uint8_t *p, int payload_len, struct mosquitto_message **response) {
+  system("reboot");
 }
 
-
+//Runs on the network thread, the command is queued for a worker
 void mosq_message_callback(struct mosquitto *mosq, void *userdata, const struct mosquitto_message *msg) {
   phoenix_t *phoenix = (phoenix_t *)userdata;
   if(strcmp(phoenix->command_topic,msg->topic) == 0) {
-    parse_command(phoenix,msg);
+    command_submit(phoenix,msg->payload,msg->payloadlen);
   }else{
     print_info("Unknown message received(%d): %s\n", msg->payloadlen,(const char *)msg->payload);
   }
@@ -218,25 +244,30 @@ static void *connection_handler(void *input) {
   }
 
 
+  phoenix->backlog=1;
   while(phoenix->mosq) {
     phoenix_connection_handle(phoenix);
 
-    sleep(1);
+    connection_wait(phoenix,phoenix->backlog);
   }
 
   print_info("Connection thread ended\n");
 }
 
 
-phoenix_t *phoenix_init_with_server(char *host, int port, int use_tls, const char *device_id) {
+//Provision, set up the client and connect. The network loop is started by
+//the caller
+static phoenix_t *phoenix_mqtt_create(char *host, int port, int use_tls, const char *device_id, int external) {
   int ret;
   int keepalive = 60;
-  bool clean_session = true;
-  const char *online_status="online";
+  bool clean_session = false;
   const char *will="offline";
   int major,minor,revision; 
+  mosquitto_property *connect_properties=NULL;
   phoenix_t *phoenix = (phoenix_t *)calloc(1,sizeof(phoenix_t));
 
+  phoenix->external=external;
+
   print_info("Certificate addr: 0x%08x\n",phoenix->certificate);
 
   phoenix->server = (char *)calloc(sizeof(char),strlen(host)+1);
@@ -257,6 +288,19 @@ phoenix_t *phoenix_init_with_server(char *host, int port, int use_tls, const cha
   mosquitto_lib_init();
   mosquitto_lib_version(&major,&minor,&revision);
 
+  if(sample_alias_properties == NULL) {
+    mosquitto_property_add_int16(&sample_alias_properties,MQTT_PROP_TOPIC_ALIAS,MQTT_ALIAS_SAMPLE);
+    sprintf(frame_content_type,"%s; version=%d",MQTT_CONTENT_TYPE_FRAME,FRAME_VERSION);
+    sprintf(frame_zlib_content_type,"%s+zlib; version=%d",MQTT_CONTENT_TYPE_FRAME,FRAME_VERSION);
+  }
+  //Built in commands, the application may replace them after init
+  phoenix_command_register(COMMAND_CONFIG_READ,command_config_read);
+  phoenix_command_register(COMMAND_CONFIG_WRITE,command_config_write);
+  phoenix_command_register(COMMAND_CONFIG_REBOOT,command_reboot);
+
+  //The store decides what is resent, see session.c
+  session_resume_start();
+
   print_info("phoenix: %s\n",VERSION);
   print_info("Initializating mosquitto: %d.%d.%d\n",major,minor,revision);
   phoenix->mosq = mosquitto_new(device_id, clean_session, phoenix);
@@ -270,11 +314,13 @@ phoenix_t *phoenix_init_with_server(char *host, int port, int use_tls, const cha
   sprintf(phoenix->command_topic, "/device/%s/command", device_id);
 
   mosquitto_log_callback_set(phoenix->mosq, mosq_log_callback);
-  mosquitto_connect_callback_set(phoenix->mosq, mosq_connect_callback);
+  mosquitto_connect_v5_callback_set(phoenix->mosq, mosq_connect_callback);
   mosquitto_disconnect_callback_set(phoenix->mosq, mosq_disconnect_callback);
   mosquitto_publish_callback_set(phoenix->mosq,mosq_publish_callback);
   mosquitto_message_callback_set(phoenix->mosq, mosq_message_callback);
   mosquitto_int_option(phoenix->mosq,MOSQ_OPT_PROTOCOL_VERSION,MQTT_PROTOCOL_V5);
+  //The adaptive window decides how much is in flight, not the library queue
+  mosquitto_max_inflight_messages_set(phoenix->mosq,WINDOW_MAX);
 
   if(mosquitto_will_set(phoenix->mosq, phoenix->status_topic, strlen(will),will,1,1) != MOSQ_ERR_SUCCESS) {
     print_fatal("Could not set up will\n");
@@ -304,38 +350,221 @@ phoenix_t *phoenix_init_with_server(char *host, int port, int use_tls, const cha
 
 
   print_info("Connecting to server: %s:%d\n",host,port);
-  if( (ret=mosquitto_connect(phoenix->mosq, host, port, keepalive)) != MOSQ_ERR_SUCCESS){
+  //Without an expiry interval a v5 broker ends the session with the connection
+  mosquitto_property_add_int32(&connect_properties,MQTT_PROP_SESSION_EXPIRY_INTERVAL,SESSION_EXPIRY_S);
+  if( (ret=mosquitto_connect_bind_v5(phoenix->mosq, host, port, keepalive, NULL, connect_properties)) != MOSQ_ERR_SUCCESS){
     perror("Unable to connect");
     print_error("Unable to connect: %d\n",ret);
   }
+  mosquitto_property_free_all(&connect_properties);
   print_info("Connected\n");
-  int loop = mosquitto_loop_start(phoenix->mosq);
-  if(loop != MOSQ_ERR_SUCCESS){
-    fprintf(stderr, "Unable to start loop: %i\n", loop);
+
+  return phoenix;
+}
+
+//Network loop of the threaded mode, in place of mosquitto_loop_start() so
+//reconnects back off with jitter
+static void *phoenix_loop_handler(void *arg) {
+  phoenix_t *phoenix=(phoenix_t *)arg;
+  int status, delay;
+
+  while(phoenix->run) {
+    status=mosquitto_loop(phoenix->mosq,PHOENIX_MISC_INTERVAL_MS,1);
+    if(status == MOSQ_ERR_SUCCESS || !phoenix->run) {
+      continue;
+    }
+
+    delay=session_backoff_ms(phoenix->reconnects++);
+    print_warning("Connection lost: %s, reconnecting in %d ms\n", mosquitto_strerror(status), delay);
+    for(;delay > 0 && phoenix->run;delay-=100) {
+      usleep(100000);
+    }
+    if(phoenix->run) {
+      mosquitto_reconnect(phoenix->mosq);
+    }
+  }
+
+  return NULL;
+}
+
+phoenix_t *phoenix_init_with_server(char *host, int port, int use_tls, const char *device_id) {
+  const char *online_status="online";
+  phoenix_t *phoenix = phoenix_mqtt_create(host,port,use_tls,device_id,0);
+
+  pthread_mutex_init(&(phoenix->connection_mutex),NULL);
+  mosquitto_threaded_set(phoenix->mosq,true);
+  if(command_start()) {
+    print_fatal("Unable to start command workers\n");
+  }
+  phoenix->run=1;
+  if(pthread_create(&(phoenix->loop_thread), NULL, phoenix_loop_handler, phoenix)) {
+    fprintf(stderr, "Unable to start loop\n");
     exit(1);
   }
 
   phoenix_subscribe_topics(phoenix);
 
-  phoenix->device_id = (char *)calloc(sizeof(unsigned char),strlen((const char *)device_id)+1);
-  sprintf(phoenix->device_id,"%s",device_id);
-
   print_info("Sending online state\n");
   phoenix_mqtt_send(phoenix,NULL,phoenix->status_topic,online_status,strlen(online_status));
 
-
-  pthread_mutex_init(&(phoenix->connection_mutex),NULL);
   pthread_create(&(phoenix->connection_thread), NULL, connection_handler, phoenix);
 
   print_info("Connection ready\n");
   return phoenix;
 }
 
+//No threads are started. The host event loop watches phoenix_io_fd() for
+//phoenix_io_events(), calls phoenix_process_io() when it is ready and
+//phoenix_process_timers() when phoenix_next_timeout() has passed, all
+//from one thread. The database must be initialized already
+phoenix_t *phoenix_init_external(char *host, int port, int use_tls, const char *device_id) {
+  const char *online_status="online";
+  phoenix_t *phoenix = phoenix_mqtt_create(host,port,use_tls,device_id,1);
+
+  mosquitto_threaded_set(phoenix->mosq,false);
+  phoenix_subscribe_topics(phoenix);
+  phoenix_mqtt_send(phoenix,NULL,phoenix->status_topic,online_status,strlen(online_status));
+  phoenix->backlog=1;
+  phoenix->misc_at=phoenix_get_timestamp();
+
+  print_info("Connection ready for external loop\n");
+  return phoenix;
+}
+
+int phoenix_io_fd(phoenix_t *phoenix) {
+  return mosquitto_socket(phoenix->mosq);
+}
+
+int phoenix_io_events(phoenix_t *phoenix) {
+  int events=PHOENIX_IO_READ;
+
+  if(mosquitto_want_write(phoenix->mosq)) {
+    events|=PHOENIX_IO_WRITE;
+  }
+  return events;
+}
+
+//Milliseconds until phoenix_process_timers() has work
+int phoenix_next_timeout(phoenix_t *phoenix) {
+  long long now=phoenix_get_timestamp();
+  int timeout;
+
+  connection_poll(phoenix,phoenix->backlog,&timeout,0);
+  if(command_pending()) {
+    timeout=0;
+  }
+  if(phoenix->misc_at - now < timeout) {
+    timeout=phoenix->misc_at - now;
+  }
+  if(phoenix->reconnect_at > 0 && phoenix->reconnect_at - now < timeout) {
+    timeout=phoenix->reconnect_at - now;
+  }
+
+  return timeout > 0 ? timeout : 0;
+}
+
+int phoenix_process_io(phoenix_t *phoenix, int events) {
+  int status=MOSQ_ERR_SUCCESS;
+
+  if(events & PHOENIX_IO_READ) {
+    status=mosquitto_loop_read(phoenix->mosq,1);
+  }
+  if(status == MOSQ_ERR_SUCCESS && (events & PHOENIX_IO_WRITE)) {
+    status=mosquitto_loop_write(phoenix->mosq,1);
+  }
+
+  if(status != MOSQ_ERR_SUCCESS && phoenix->reconnect_at == 0) {
+    print_warning("Connection lost: %s\n", mosquitto_strerror(status));
+    window_error(window_time_ms());
+    phoenix->reconnect_at=phoenix_get_timestamp() + session_backoff_ms(phoenix->reconnects++);
+    return -1;
+  }
+
+  return 0;
+}
+
+int phoenix_process_timers(phoenix_t *phoenix) {
+  long long now=phoenix_get_timestamp();
+  int timeout;
+
+  if(phoenix->reconnect_at > 0 && now >= phoenix->reconnect_at) {
+    if(mosquitto_reconnect(phoenix->mosq) == MOSQ_ERR_SUCCESS) {
+      phoenix->reconnect_at=0;
+    }else{
+      phoenix->reconnect_at=now + session_backoff_ms(phoenix->reconnects++);
+    }
+  }
+
+  //One command per call, the socket is served in between
+  command_process(1);
+
+  if(now >= phoenix->misc_at) {
+    mosquitto_loop_misc(phoenix->mosq);
+    phoenix->misc_at=now + PHOENIX_MISC_INTERVAL_MS;
+  }
+
+  if(phoenix->reconnect_at == 0 && connection_poll(phoenix,phoenix->backlog,&timeout,1) >= 0) {
+    return phoenix_connection_handle(phoenix);
+  }
+
+  return 0;
+}
+
 void phoenix_close(phoenix_t *phoenix) {
-  mosquitto_destroy(phoenix->mosq);
+  if(phoenix->http) {
+    phoenix_http_close(phoenix);
+    return;
+  }
 
-  phoenix->mosq=NULL;
-  pthread_join(phoenix->connection_thread,NULL);
+  if(phoenix->external) {
+    mosquitto_disconnect(phoenix->mosq);
+    mosquitto_destroy(phoenix->mosq);
+    phoenix->mosq=NULL;
+  }else{
+    phoenix->run=0;
+    mosquitto_disconnect(phoenix->mosq);
+    pthread_join(phoenix->loop_thread,NULL);
+    command_stop();
+    mosquitto_destroy(phoenix->mosq);
+
+    phoenix->mosq=NULL;
+    connection_wakeup();
+    pthread_join(phoenix->connection_thread,NULL);
+  }
+
+  free(phoenix->interned);
+  phoenix->interned=NULL;
+  phoenix->interned_size=0;
+}
+
+//Caller must hold connection_mutex
+//QoS 0 messages take no window slot, nothing acks them
+static int phoenix_mqtt_publish(phoenix_t *phoenix, int *mid, const char *topic, const char *msg, int len, int qos, const mosquitto_property *properties) {
+  int status, local_mid;
+
+  if(mid == NULL) {
+    mid=&local_mid;
+  }
+
+  status=mosquitto_publish_v5(phoenix->mosq, mid,topic,len,msg,qos,false,properties);
+  //libmosquitto keeps a QoS 1 or 2 message it could not write and sends it
+  //on the next connection, it is in flight like any other
+  if(status == MOSQ_ERR_NO_CONN && qos > 0) {
+    status=0;
+  }
+  if(status != 0) {
+    print_info("Publish status: %d\n",status);
+    if(qos > 0) {
+      window_error(window_time_ms());
+    }
+    return status;
+  }
+  if(qos > 0) {
+    phoenix->messages_in_flight++;
+    window_sent(*mid,window_time_ms());
+  }
+
+  return status;
 }
 
 int phoenix_mqtt_send(phoenix_t *phoenix, int *mid, const char *topic, const char *msg, int len) {
@@ -345,36 +574,103 @@ int phoenix_mqtt_send(phoenix_t *phoenix, int *mid, const char *topic, const cha
     return phoenix_http_send(phoenix,msg,len);
   }
   
-  pthread_mutex_lock(&(phoenix->connection_mutex));
-  status=mosquitto_publish(phoenix->mosq, mid,topic,len,msg,1,2);
-  if(status != 0) {
-    print_info("Publish status: %d\n",status);
-  }
-  phoenix->messages_in_flight++;
-  pthread_mutex_unlock(&(phoenix->connection_mutex));
+  phoenix_lock(phoenix);
+  status=phoenix_mqtt_publish(phoenix,mid,topic,msg,len,1,NULL);
+  phoenix_unlock(phoenix);
 
   return status;
 }
 
 int phoenix_send_sample(phoenix_t *phoenix, long long timestamp, unsigned char *stream, double value) {
-  return db_sample_insert(stream,timestamp,value);
+  int stream_id=db_stream_id(stream);
+
+  if(stream_id < 0) {
+    return -1;
+  }
+
+  if(phoenix && !phoenix->http && phoenix_stream_qos(stream_id) == 0) {
+    return phoenix_mqtt_send_sample_qos0(phoenix,stream_id,timestamp,value);
+  }
+
+  if(ingest_enabled()) {
+    return ingest_push(stream_id,timestamp,value);
+  }
+  return db_sample_insert_stream(stream_id,timestamp,value);
+}
+
+//Store a batch of samples in one transaction. The assigned ids are written
+//to samples[i].id, and to samples[i].timestamp the one stored for samples
+//stamped with now. first_id and last_id, if not NULL, get the id range
+int phoenix_send_samples(phoenix_t *phoenix, phoenix_sample_t *samples, int num_samples, int64_t *first_id, int64_t *last_id) {
+  if(db_sample_insert_batch(samples,num_samples,first_id,last_id)) {
+    return -1;
+  }
+  return num_samples;
 }
 
-int phoenix_mqtt_send_sample(phoenix_t *phoenix, phoenix_sample_t *sample) {
+//The sequence number as user property "seq", and the content type if any
+static mosquitto_property *phoenix_mqtt_delivery_properties(int64_t seq, const char *content_type) {
+  mosquitto_property *properties=NULL;
+  char value[32];
+
+  sprintf(value,"%lld",(long long)seq);
+  mosquitto_property_add_string_pair(&properties,MQTT_PROP_USER_PROPERTY,"seq",value);
+  if(content_type) {
+    mosquitto_property_add_string(&properties,MQTT_PROP_CONTENT_TYPE,content_type);
+  }
+
+  return properties;
+}
+
+//Caller must hold connection_mutex. Tell the server the code behind a
+//stream id, once per connection. Ids never change for a database, so a
+//sample libmosquitto resends on a later connection still resolves
+static int phoenix_mqtt_intern(phoenix_t *phoenix, int stream_id) {
+  const char *stream=db_stream_code(stream_id);
   char topic[1024];
-  char msg[2048];
+  char msg[1024];
+  unsigned char *grown;
+  int size, len;
+
+  if(stream_id < phoenix->interned_size && phoenix->interned[stream_id]) {
+    return 0;
+  }
+  if(stream == NULL) {
+    return -1;
+  }
+
+  if(stream_id >= phoenix->interned_size) {
+    size = phoenix->interned_size ? phoenix->interned_size : 64;
+    while(size <= stream_id) {
+      size*=2;
+    }
+    grown=realloc(phoenix->interned,size);
+    if(grown == NULL) {
+      return -1;
+    }
+    memset(grown+phoenix->interned_size,0,size-phoenix->interned_size);
+    phoenix->interned=grown;
+    phoenix->interned_size=size;
+  }
+
+  sprintf(topic,"/device/%s/stream",phoenix->device_id);
+  len=snprintf(msg,sizeof(msg),"%d %s",stream_id,stream);
+  if(phoenix_mqtt_publish(phoenix,NULL,topic,msg,len,1,NULL)) {
+    return -1;
+  }
+  phoenix->interned[stream_id]=1;
+
+  return 0;
+}
+
+//Caller must hold connection_mutex. Sample message: timestamp, value and
+//the stream code, or # and the stream id once the stream is announced
+static int phoenix_mqtt_sample_message(phoenix_t *phoenix, char *msg, int stream_id, long long timestamp, double value) {
+  const char *stream=db_stream_code(stream_id);
   int index=0;
   int i;
-  int status=0;
-  int mid;
-  char *stream=sample->stream;
-  long long timestamp=sample->timestamp;
-  double value=sample->value;
 
-  memset(msg,0,sizeof(unsigned char) * 2048);
   debug_printf("Sending: %s -> %lld -> %f\n",stream,timestamp,value);
-  
-  sprintf(topic,"/device/%s/sample",phoenix->device_id);
 
   if(timestamp < 0) {
     timestamp = phoenix_get_timestamp();
@@ -386,7 +682,11 @@ int phoenix_mqtt_send_sample(phoenix_t *phoenix, phoenix_sample_t *sample) {
   memcpy(&(msg[index]),&value,sizeof(value));
   index+=sizeof(value);
 
-  index+=sprintf(&(msg[index]),"%s",stream);
+  if(phoenix->intern && phoenix_mqtt_intern(phoenix,stream_id) == 0) {
+    index+=sprintf(&(msg[index]),"#%d",stream_id);
+  }else{
+    index+=sprintf(&(msg[index]),"%s",stream);
+  }
 
   if(debug) {
     debug_printf("Sending sample message(%d): ",index);
@@ -396,15 +696,175 @@ int phoenix_mqtt_send_sample(phoenix_t *phoenix, phoenix_sample_t *sample) {
     printf("\n");
   }
 
-  //Save the message id for the sample
+  return index;
+}
 
-  if(phoenix_mqtt_send(phoenix,&mid,topic,msg,index)) {
+//Publish a stored sample under delivery sequence number seq, 0 takes and
+//records the next one
+int phoenix_mqtt_send_sample(phoenix_t *phoenix, phoenix_sample_t *sample, int64_t seq) {
+  mosquitto_property *properties;
+  char topic[1024];
+  char msg[2048];
+  int len;
+  int status=0;
+  int mid=0;
+  //A stored sample leaves the store on its ack, so it is at least QoS 1
+  int qos = phoenix_stream_qos(sample->stream_id) > 1 ? 2 : 1;
+  int numbered=0;
+
+  if(seq == 0) {
+    seq=session_next();
+    if(session_record(&sample->id,&seq,1)) {
+      return -1;
+    }
+    numbered=1;
+  }
+
+  sprintf(topic,"/device/%s/sample",phoenix->device_id);
+  properties=phoenix_mqtt_delivery_properties(seq,NULL);
+
+  //Register the sample under its message id before the ack can arrive.
+  //No topic alias, libmosquitto resends unacked messages as they were on
+  //the next connection, where the alias means nothing
+  phoenix_lock(phoenix);
+  len=phoenix_mqtt_sample_message(phoenix,msg,sample->stream_id,sample->timestamp,sample->value);
+  if((status=phoenix_mqtt_publish(phoenix,&mid,topic,msg,len,qos,properties)) != 0) {
     print_error("Could not publish sample\n");
+  }else{
+    inflight_add(mid,sample->id);
   }
-  
-  debug_printf("Sample %d has mid %d\n", sample->id, mid);
-  return db_sample_set_message_id(sample->id, mid);
-  
+  phoenix_unlock(phoenix);
+  mosquitto_property_free_all(&properties);
+
+  //Never published, it goes out under a new number
+  if(status && numbered) {
+    session_forget(&sample->id,1);
+  }
+
+  debug_printf("Sample %lld has mid %d, seq %lld\n", (long long)sample->id, mid, (long long)seq);
+  return status;
+}
+
+//Fire and forget, the sample is published right away and never stored.
+//Without a connection it is dropped
+int phoenix_mqtt_send_sample_qos0(phoenix_t *phoenix, int stream_id, long long timestamp, double value) {
+  char topic[1024];
+  char msg[2048];
+  int len, status;
+
+  sprintf(topic,"/device/%s/sample",phoenix->device_id);
+
+  phoenix_lock(phoenix);
+  if(!phoenix->connected) {
+    phoenix->qos0_dropped++;
+    phoenix_unlock(phoenix);
+    return 0;
+  }
+  len=phoenix_mqtt_sample_message(phoenix,msg,stream_id,timestamp,value);
+
+  //Unacked messages are never resent, so after the first one the topic
+  //goes as its alias only
+  if(phoenix->topic_alias_max >= MQTT_ALIAS_SAMPLE) {
+    status=phoenix_mqtt_publish(phoenix,NULL,phoenix->sample_alias_mapped ? NULL : topic,msg,len,0,sample_alias_properties);
+    if(status == MOSQ_ERR_INVAL && phoenix->sample_alias_mapped) {
+      print_warning("Topic aliases not supported by libmosquitto\n");
+      phoenix->topic_alias_max=0;
+      status=phoenix_mqtt_publish(phoenix,NULL,topic,msg,len,0,NULL);
+    }else if(status == 0) {
+      phoenix->sample_alias_mapped=1;
+    }
+  }else{
+    status=phoenix_mqtt_publish(phoenix,NULL,topic,msg,len,0,NULL);
+  }
+  if(status == 0) {
+    phoenix->qos0_published++;
+  }else{
+    phoenix->qos0_dropped++;
+  }
+  phoenix_unlock(phoenix);
+
+  return status;
+}
+
+//Publish all samples of the frame as one message under delivery sequence
+//number seq, 0 takes and records the next one
+int phoenix_mqtt_send_frame(phoenix_t *phoenix, frame_t *frame, int64_t seq) {
+  mosquitto_property *properties;
+  char topic[1024];
+  uint8_t *msg;
+  int64_t *seqs;
+  int i,len,mid=0,status,qos=1,numbered=0;
+
+  if(frame->num_samples == 0) {
+    return 0;
+  }
+
+  if(seq == 0) {
+    numbered=1;
+    seq=session_next();
+    seqs=malloc(sizeof(int64_t)*(frame->num_samples ? frame->num_samples : 1));
+    for(i=0;i<frame->num_samples;i++) {
+      seqs[i]=seq;
+    }
+    status=session_record(frame->ids,seqs,frame->num_samples);
+    free(seqs);
+    if(status) {
+      return -1;
+    }
+  }
+
+  sprintf(topic,"/device/%s/frame",phoenix->device_id);
+
+  len=frame_encode_compressed(frame,&msg);
+
+  //The frame gets the strongest delivery class of its streams, at least QoS 1
+  for(i=0;i<frame->num_streams;i++) {
+    if(phoenix_stream_qos(frame->streams[i]) > qos) {
+      qos=phoenix_stream_qos(frame->streams[i]);
+    }
+  }
+
+  //The content type tells the frame format version
+  properties=phoenix_mqtt_delivery_properties(seq,len > 1 && msg[1] == 'Z' ? frame_zlib_content_type : frame_content_type);
+
+  phoenix_lock(phoenix);
+  if((status=phoenix_mqtt_publish(phoenix,&mid,topic,(char *)msg,len,qos,properties)) != 0) {
+    print_error("Could not publish frame of %d samples\n", frame->num_samples);
+  }else{
+    for(i=0;i<frame->num_samples;i++) {
+      inflight_add(mid,frame->ids[i]);
+    }
+  }
+  phoenix_unlock(phoenix);
+  mosquitto_property_free_all(&properties);
+
+  //Never published, its samples go out in a new frame
+  if(status && numbered) {
+    session_forget(frame->ids,frame->num_samples);
+  }
+
+  debug_printf("Frame of %d samples, %d bytes has mid %d, seq %lld\n", frame->num_samples, len, mid, (long long)seq);
+  free(msg);
+  return status;
+}
+
+//Refer to streams by id in sample messages. Before its first use on a
+//connection each stream is announced on the stream topic as "<id> <code>"
+void phoenix_mqtt_intern_set(phoenix_t *phoenix, int enabled) {
+  phoenix_lock(phoenix);
+  phoenix->intern=enabled;
+  phoenix_unlock(phoenix);
+}
+
+//Send samples in frames of at most max_size bytes. A frame that is not
+//full waits up to flush_ms for more samples. max_size 0 sends one message
+//per sample
+void phoenix_mqtt_frame_set(phoenix_t *phoenix, size_t max_size, int flush_ms) {
+  phoenix_lock(phoenix);
+  phoenix->frame_max_size=max_size;
+  phoenix->frame_flush_ms=flush_ms;
+  phoenix->frame_pending_since=0;
+  phoenix_unlock(phoenix);
 }
 
 int phoenix_send_string(phoenix_t *phoenix, long long timestamp, unsigned char *stream, char *value) {
@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <phoenix.h>
+
+/*
+ * Streams notification for HTTP, written straight into a buffer:
+ *
+ *   {"notification":"streams","parameters":[
+ *     {"code":"<stream>","timestamp":"<RFC3339>","value":<double>},...]}
+ *
+ * Byte for byte what json-c writes for the same object tree, built with
+ * json_object_*() and getRFC3339() before, except for doubles: json-c
+ * prints 17 significant digits, here the shortest decimal that reads back
+ * as the same double is printed when it has at most
+ * NOTIFICATION_DOUBLE_DECIMALS decimals, 0.1 instead of
+ * 0.10000000000000001. Anything else is printed the way json-c does.
+ *
+ * The buffer grows as needed and is kept between notifications, as is the
+ * date and time of the last second seen, so a batch costs no allocations
+ * once the buffer has grown to the batch size.
+ */
+
+static const double powers_of_ten[]={1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,1e9,1e10,1e11,1e12,1e13,1e14,1e15};
+
+void notification_free(notification_t *notification) {
+  free(notification->data);
+  memset(notification,0,sizeof(notification_t));
+}
+
+//Room for len more bytes
+static int notification_reserve(notification_t *notification, size_t len) {
+  size_t size=notification->size ? notification->size : NOTIFICATION_SIZE;
+  char *data;
+
+  if(notification->len + len + 1 <= notification->size) {
+    return 0;
+  }
+  while(size < notification->len + len + 1) {
+    size*=2;
+  }
+  if((data=realloc(notification->data,size)) == NULL) {
+    print_error("Could not grow notification to %zu bytes\n", size);
+    return -1;
+  }
+  notification->data=data;
+  notification->size=size;
+
+  return 0;
+}
+
+static void notification_append(notification_t *notification, const char *s, size_t len) {
+  memcpy(notification->data+notification->len,s,len);
+  notification->len+=len;
+}
+
+//Digits of value, at least min_digits with leading zeros. Returns the length
+static int notification_digits(char *out, uint64_t value, int min_digits) {
+  char digits[24];
+  int len=0, i;
+
+  do {
+    digits[len++]='0' + value%10;
+    value/=10;
+  } while(value > 0 || len < min_digits);
+  for(i=0;i<len;i++) {
+    out[i]=digits[len-1-i];
+  }
+
+  return len;
+}
+
+//A JSON number for value, as json-c writes it or shorter. out must hold 32
+//bytes. Returns the length
+int notification_double(char *out, double value) {
+  double scaled, magnitude=fabs(value);
+  int64_t mantissa;
+  int len=0, decimals, digits, i;
+
+  if(isnan(value)) {
+    return sprintf(out,"NaN");
+  }
+  if(isinf(value)) {
+    return sprintf(out,value < 0 ? "-Infinity" : "Infinity");
+  }
+
+  //value is mantissa/10^decimals exactly when that division gives it back,
+  //both are exact doubles and the division is correctly rounded
+  for(decimals=0;decimals<=NOTIFICATION_DOUBLE_DECIMALS;decimals++) {
+    scaled=magnitude*powers_of_ten[decimals];
+    if(scaled >= 9007199254740992.0) {
+      break;
+    }
+    mantissa=(int64_t)scaled;
+    if((double)mantissa != scaled || mantissa/powers_of_ten[decimals] != magnitude) {
+      continue;
+    }
+
+    if(signbit(value)) {
+      out[len++]='-';
+    }
+    digits=notification_digits(out+len,mantissa,decimals+1);
+    if(decimals == 0) {
+      len+=digits;
+      out[len++]='.';
+      out[len++]='0';
+      return len;
+    }
+    //Move the decimals one up for the point, trailing zeros are not needed
+    for(i=digits;i>digits-decimals;i--) {
+      out[len+i]=out[len+i-1];
+    }
+    out[len+digits-decimals]='.';
+    len+=digits+1;
+    while(out[len-1] == '0' && out[len-2] != '.') {
+      len--;
+    }
+    return len;
+  }
+
+  //What json-c does: 17 significant digits, a decimal point if there is none
+  len=snprintf(out,32,"%.17g",value);
+  if(strpbrk(out,".eE") == NULL) {
+    len+=sprintf(out+len,".0");
+  }
+
+  return len;
+}
+
+//A JSON string, escaped as json-c does. Needs up to 6 bytes per character
+//and the quotes
+static void notification_string(notification_t *notification, const char *s) {
+  char *out=notification->data+notification->len;
+  const char *hex="0123456789abcdef";
+  unsigned char c;
+
+  *out++='"';
+  for(;(c=*s) != 0;s++) {
+    if(c >= 0x20 && c != '"' && c != '\\' && c != '/') {
+      *out++=c;
+      continue;
+    }
+    *out++='\\';
+    switch(c) {
+      case '"': *out++='"'; break;
+      case '\\': *out++='\\'; break;
+      case '/': *out++='/'; break;
+      case '\b': *out++='b'; break;
+      case '\n': *out++='n'; break;
+      case '\r': *out++='r'; break;
+      case '\t': *out++='t'; break;
+      case '\f': *out++='f'; break;
+      default:
+        *out++='u';
+        *out++='0';
+        *out++='0';
+        *out++=hex[c >> 4];
+        *out++=hex[c & 0xf];
+    }
+  }
+  *out++='"';
+
+  notification->len=out-notification->data;
+}
+
+//The timestamp as getRFC3339() writes it. Date and time are formatted once
+//per second
+static void notification_timestamp(notification_t *notification, long long timestamp) {
+  long long second=timestamp/1000;
+  struct tm tm;
+  time_t t;
+  char *out;
+
+  if(second != notification->second || notification->second_len == 0) {
+    t=second;
+    gmtime_r(&t,&tm);
+    notification->second_len=strftime(notification->second_str,sizeof(notification->second_str),"\"%Y-%m-%dT%H:%M:%S.",&tm);
+    notification->second=second;
+  }
+
+  notification_append(notification,notification->second_str,notification->second_len);
+  out=notification->data+notification->len;
+  notification->len+=notification_digits(out,(timestamp%1000)*1000,6);
+  notification_append(notification,"Z\"",2);
+}
+
+//Replace the buffer contents with the streams notification of the
+//samples. Returns its length, or -1 when a stream has no code
+int notification_streams(notification_t *notification, phoenix_sample_t *samples, int num_samples) {
+  const char *code;
+  char value[32];
+  int i;
+
+  notification->len=0;
+  if(notification_reserve(notification,64)) {
+    return -1;
+  }
+  notification_append(notification,"{\"notification\":\"streams\",\"parameters\":[",40);
+
+  for(i=0;i<num_samples;i++) {
+    if((code=db_stream_code(samples[i].stream_id)) == NULL) {
+      print_error("Unknown stream %d\n", samples[i].stream_id);
+      return -1;
+    }
+    if(notification_reserve(notification,strlen(code)*6+sizeof(notification->second_str)+sizeof(value)+64)) {
+      return -1;
+    }
+
+    notification_append(notification,i ? ",{\"code\":" : "{\"code\":",i ? 9 : 8);
+    notification_string(notification,code);
+    notification_append(notification,",\"timestamp\":",13);
+    notification_timestamp(notification,samples[i].timestamp);
+    notification_append(notification,",\"value\":",9);
+    notification_append(notification,value,notification_double(value,samples[i].value));
+    notification_append(notification,"}",1);
+  }
+
+  notification_append(notification,"]}",2);
+  notification->data[notification->len]=0;
+
+  return notification->len;
+}
@@ -10,14 +10,111 @@
 #endif
 
 #define HTTP_QUEUE_MAX 100
+#define HTTP_KEEPALIVE_IDLE_S 60
+#define HTTP_CONCURRENCY 4
+#define HTTP_CONCURRENCY_MAX 32
+#define HTTP_POLL_MS 100
+#define HTTP_FRAME_MAX_SIZE 65536
+#define HTTP_KEEPALIVE_INTERVAL_S 30
 #define MAX_SAMPLES_TO_SEND 100
-#define MIN_MESSAGES_IN_FLIGHT 20
+#define WINDOW_MIN 4
+#define WINDOW_INITIAL 20
+#define WINDOW_MAX 1000
+#define WINDOW_DECREASE 0.7
+#define WINDOW_RTT_TOLERANCE 2.0
+#define WINDOW_RTT_SLACK_MS 5
+#define WINDOW_MIN_RTT_MS 10000
+#define WINDOW_ACK_TIMEOUT_MS 30000
+#define INGEST_BATCH_SIZE 1000
+#define INGEST_DRAIN_INTERVAL_MS 10
+#define JOURNAL_COMMIT_RECORDS 1000
+#define JOURNAL_COMMIT_INTERVAL_MS 1000
+#define DB_SNAPSHOT_STALL_BUDGET_MS 5
+#define DB_SNAPSHOT_MIN_PAGES 16
+#define DB_SNAPSHOT_MAX_PAGES 4096
+#define DB_CONF_FLUSH_WRITES 100
+#define INFLIGHT_ACK_BATCH 100
+#define FRAME_VERSION 1
+#define FRAME_MAX_SIZE 4096
+#define FRAME_FLUSH_MS 100
+#define FRAME_MAX_SAMPLES 1000
+#define FRAME_FULL -1
+#define FRAME_UNKNOWN_STREAM -2
+#define NOTIFICATION_SIZE 4096
+#define NOTIFICATION_DOUBLE_DECIMALS 9
+#define COMPRESS_THRESHOLD 256
+#define CONNECTION_FLUSH_COUNT 100
+#define CONNECTION_FLUSH_BYTES 4096
+#define CONNECTION_FLUSH_MS 20
+#define CONNECTION_IDLE_MS 60000
+#define PHOENIX_MISC_INTERVAL_MS 1000
+#define PHOENIX_RECONNECT_MIN_MS 1000
+#define PHOENIX_RECONNECT_MAX_MS 60000
+#define SESSION_EXPIRY_S 86400
+#define SESSION_SEQ_BLOCK 1000
+#define MQTT_ALIAS_SAMPLE 1
+#define MQTT_CONTENT_TYPE_FRAME "application/vnd.phoenix.frame"
+#define COMMAND_QUEUE_SIZE 64
+#define COMMAND_WORKERS 2
+#define COMMAND_HANDLERS_MAX 32
+#define COMMAND_PAYLOAD_MAX 1024
+#define PHOENIX_IO_READ 1
+#define PHOENIX_IO_WRITE 2
+
+typedef struct {
+  uint64_t posts;
+  uint64_t failed;
+  uint64_t handles;         //Easy handles built, once unless the certificate changes
+  uint64_t connects;        //New connections, the rest reused one kept alive
+  uint64_t bytes_sent;      //Requests, without TLS
+  uint64_t bytes_received;
+  uint64_t batches;         //Batches acked
+  double batch_latency_ms;  //Average from encoded to acked
+  double batch_latency_max_ms;
+  int queued;               //Encoded batches waiting to be posted
+  int in_flight;
+  uint64_t frames;          //Batches posted as frames
+  uint64_t rejected;        //Frames the server did not take, 415
+} http_stats_t;
+
+//Body of the batches phoenix_http_upload() posts
+typedef enum {
+  HTTP_FORMAT_JSON,         //Streams notification, see notification.c
+  HTTP_FORMAT_FRAME,        //Batch frame, see frame.c, JSON again on a 415
+} http_format_t;
 
 typedef struct {
   char *scheme;
   char *server;
   char *token;
-  
+
+  //Kept from post to post, see phoenix_http_handle()
+  void *curl;
+  void *share;              //TLS sessions and DNS, outlive the easy handle
+  struct curl_slist *headers;
+  struct curl_slist *headers_gzip;
+  struct curl_slist *headers_frame;
+  char *headers_hash;       //certificate_hash the headers carry
+  char *ca_file;            //Trusted certificates, the system store when NULL
+
+  //Asynchronous uploads, see phoenix_http_upload()
+  void *multi;
+  void *batches;            //HTTP_QUEUE_MAX slots
+  int concurrency;          //Batches posted at once
+  http_format_t format;
+  void *frame;              //frame_t the batches are encoded in
+  int queued;               //Batches encoded, written under mutex
+  int in_flight;            //Batches posted, written under mutex
+  int posting;              //Synchronous posts running, under mutex
+  int next_batch;
+  int flush;                //Encode partial batches on the next round, uploader only
+  int run;                  //Upload thread of phoenix_init_http(), under mutex
+  int failures;             //Batches failed in a row
+  long long retry_at;       //Nothing is posted before, 0 when not backing off
+
+  pthread_mutex_t mutex;    //stats, headers, curl, format, run, queued, in_flight, posting
+  http_stats_t stats;
+  double latency_sum_ms;
 } phoenix_http_t;
 
 
@@ -37,34 +134,181 @@ typedef struct {
   phoenix_http_t *http;
 
   int messages_in_flight;
+  unsigned long long qos0_published;
+  unsigned long long qos0_dropped;   //QoS 0 samples sent while disconnected
+  int backlog;        //The last round left samples in the store
+
+  //MQTT v5 session state, reset on every connect
+  int topic_alias_max;       //Granted by the broker, 0 when aliases are not allowed
+  int sample_alias_mapped;   //The sample topic was sent with its alias on this connection
+  int intern;                //Sample messages refer to streams by id, see phoenix_mqtt_intern_set()
+  unsigned char *interned;   //Streams announced on this connection, by id
+  int interned_size;
+
+  //Batch frames, disabled while frame_max_size is 0
+  size_t frame_max_size;
+  int frame_flush_ms;
+  long long frame_pending_since;
 
   pthread_mutex_t connection_mutex;
   pthread_t connection_thread;
+  pthread_t loop_thread;
+  volatile int run;
+  int reconnects;     //Failed attempts since the last connect, for the backoff
+
+  //Driven by the host event loop, see phoenix_init_external()
+  int external;
+  long long misc_at;
+  long long reconnect_at;
 
 } phoenix_t; 
 
 typedef struct {
   int64_t id; 
-  char stream[256];
   long long timestamp;
   double value;
+  int stream_id;
 } phoenix_sample_t;
 
 phoenix_t *phoenix_init(char *host, const char *device_id);
 phoenix_t *phoenix_init_with_server(char *host, int port, int use_tls, const char *device_id);
 phoenix_t *phoenix_init_http(unsigned char *host, const char *device_id);
+phoenix_t *phoenix_init_external(char *host, int port, int use_tls, const char *device_id);
 void phoenix_close(phoenix_t *phoenix);
+int phoenix_io_fd(phoenix_t *phoenix);
+int phoenix_io_events(phoenix_t *phoenix);
+int phoenix_next_timeout(phoenix_t *phoenix);
+int phoenix_process_io(phoenix_t *phoenix, int events);
+int phoenix_process_timers(phoenix_t *phoenix);
 int phoenix_connection_handle(phoenix_t *phoenix);
+void phoenix_flush_set(int count, size_t bytes, int age_ms);
 int phoenix_send_sample(phoenix_t *phoenix, long long timestamp, unsigned char *stream, double value);
+int phoenix_send_samples(phoenix_t *phoenix, phoenix_sample_t *samples, int num_samples, int64_t *first_id, int64_t *last_id);
 int phoenix_send_string(phoenix_t *phoenix, long long timestamp, unsigned char *stream, char *value);
 
+//Registered streams, resolved once so sending needs no string work
+typedef struct {
+  int qos;            //Delivery class of the stream from registration on, 0 is fire and forget
+  double deadband;    //Samples closer than this to the last one sent are skipped
+} phoenix_stream_options_t;
+
+typedef struct phoenix_stream phoenix_stream_t;
+
+phoenix_stream_t *phoenix_stream_register(phoenix_t *phoenix, const char *code, phoenix_stream_options_t *options);
+void phoenix_stream_free(phoenix_stream_t *stream);
+int phoenix_stream_id(phoenix_stream_t *stream);
+int phoenix_stream_qos(int stream_id);
+int phoenix_stream_qos_set(int stream_id, int qos);
+int phoenix_send_sample_h(phoenix_stream_t *stream, long long timestamp, double value);
+
+//Batch frame of samples, see frame.c for the format
+typedef struct {
+  uint8_t *body;
+  size_t body_len;
+  size_t body_size;
+  int *streams;
+  double *last_values;
+  int num_streams;
+  int streams_size;
+  size_t streams_len;
+  int64_t *ids;
+  int num_samples;
+  int ids_size;
+  long long last_timestamp;
+  size_t max_size;
+} frame_t;
+
+typedef void (*frame_callback_t)(const char *stream, long long timestamp, double value, void *arg);
+
+void frame_init(frame_t *frame, size_t max_size);
+void frame_reset(frame_t *frame);
+void frame_free(frame_t *frame);
+size_t frame_size(frame_t *frame);
+int frame_add(frame_t *frame, phoenix_sample_t *sample);
+int frame_encode(frame_t *frame, uint8_t *out, size_t size);
+int frame_decode(const uint8_t *data, size_t len, frame_callback_t callback, void *arg);
+int frame_encode_compressed(frame_t *frame, uint8_t **out);
+
+//Streams notification for HTTP, see notification.c
+typedef struct {
+  char *data;
+  size_t len;
+  size_t size;
+  long long second;         //Of the cached date and time
+  char second_str[32];
+  size_t second_len;
+} notification_t;
+
+void notification_free(notification_t *notification);
+int notification_double(char *out, double value);
+int notification_streams(notification_t *notification, phoenix_sample_t *samples, int num_samples);
+
+//Compression of batched payloads, off until a level is set
+typedef enum {
+  COMPRESS_ZLIB,      //MQTT frames, with the pre-shared dictionary
+  COMPRESS_GZIP,      //HTTP bodies, Content-Encoding: gzip
+} compress_format_t;
+
+typedef struct {
+  uint64_t buffers;
+  uint64_t compressed;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  double cpu_ms;
+} compress_stats_t;
+
+void compress_set(int level, size_t min_size);
+int compress_enabled();
+int compress_dictionary_set(const uint8_t *data, size_t len);
+size_t compress_bound(size_t len);
+int compress_buffer(compress_format_t format, const uint8_t *in, size_t len, uint8_t *out, size_t size);
+int compress_inflate(const uint8_t *in, size_t len, uint8_t **out, size_t *out_len);
+void compress_stats(compress_stats_t *stats);
+
 //MQTT Interface
 int phoenix_mqtt_send(phoenix_t *phoenix, int *mid, const char *topic, const char *msg, int len);
-int phoenix_mqtt_send_sample(phoenix_t *phoenix, phoenix_sample_t *sample);
+int phoenix_mqtt_send_sample(phoenix_t *phoenix, phoenix_sample_t *sample, int64_t seq);
+int phoenix_mqtt_send_sample_qos0(phoenix_t *phoenix, int stream_id, long long timestamp, double value);
+int phoenix_mqtt_send_frame(phoenix_t *phoenix, frame_t *frame, int64_t seq);
+void phoenix_mqtt_frame_set(phoenix_t *phoenix, size_t max_size, int flush_ms);
+void phoenix_mqtt_intern_set(phoenix_t *phoenix, int enabled);
+
+//Uploader wakeups, see connection.c
+typedef enum {
+  CONNECTION_WAKE_BACKLOG,    //Samples left from the last round, not slept
+  CONNECTION_WAKE_SAMPLES,    //Count or byte threshold reached
+  CONNECTION_WAKE_ACK,        //Window space freed for a backlog
+  CONNECTION_WAKE_TIMER,      //Oldest queued sample or ack reached its age
+  CONNECTION_WAKE_IDLE,       //Housekeeping with nothing queued
+  CONNECTION_WAKE_SIGNAL,     //connection_wakeup()
+  CONNECTION_WAKE_TYPES,
+} connection_wake_t;
+
+typedef struct {
+  uint64_t wakeups[CONNECTION_WAKE_TYPES];
+} connection_stats_t;
+
+void connection_samples_queued(int num_samples, size_t bytes);
+void connection_acked();
+void connection_wakeup();
+connection_wake_t connection_wait(phoenix_t *phoenix, int backlog);
+int connection_handle(phoenix_t *phoenix);
+int connection_poll(phoenix_t *phoenix, int backlog, int *timeout_ms, int consume);
+void connection_stats(connection_stats_t *stats);
 
 //HTTP interface
 int phoenix_http_send(phoenix_t *phoenix, const char *msg, int len);
 int phoenix_http_send_samples(phoenix_t *phoenix, phoenix_sample_t *samples, int num_samples);
+int phoenix_http_post(phoenix_t *phoenix, const char *msg, int len);
+void phoenix_http_reset(phoenix_t *phoenix);
+void phoenix_http_close(phoenix_t *phoenix);
+void phoenix_http_stats(phoenix_t *phoenix, http_stats_t *stats);
+void phoenix_http_concurrency_set(phoenix_t *phoenix, int concurrency);
+int phoenix_http_upload(phoenix_t *phoenix, int timeout_ms);
+int phoenix_http_in_flight(phoenix_t *phoenix);
+int phoenix_http_running(phoenix_t *phoenix);
+int phoenix_http_start(phoenix_t *phoenix);
+void phoenix_http_format_set(phoenix_t *phoenix, http_format_t format);
 
 
 long long phoenix_get_timestamp();
@@ -99,10 +343,30 @@ typedef struct {
   void *value;
 } database_column_t;
 
+typedef enum {
+  DB_STARTUP_RESTORE,   //Copy phoenix.db into memory, snapshot and journal it
+  DB_STARTUP_LAZY,      //Open phoenix.db directly, startup independent of backlog size
+} db_startup_mode_t;
+
+void db_startup_mode_set(db_startup_mode_t mode);
 int db_init(char *path);
 int db_ready();
 int db_close();
 int db_copy(sqlite3 *dst, sqlite3 *src);
+
+typedef struct {
+  uint64_t snapshots;
+  uint64_t failures;
+  int pages;
+  double duration_ms;
+  double max_stall_ms;
+  double total_stall_ms;
+} db_snapshot_stats_t;
+
+int db_snapshot();
+int db_snapshot_start(int interval_ms, int stall_budget_ms);
+void db_snapshot_stop();
+void db_snapshot_stats(db_snapshot_stats_t *stats);
 int db_exec(char *sql);
 char *db_string_get(char *table, char *key);
 int db_string_upsert(char *table, char *key, char *value);
@@ -111,17 +375,162 @@ int db_double_set(char *table, char *key, double value);
 double db_double_get(char *table, char *key);
 int db_int64_set(char *table, char *key, int64_t value);
 int64_t db_int64_get(char *table, char *key);
+int db_conf_flush();
+void db_conf_write_behind_set(int enabled);
+
+//Prepared statements of the generic accessors are cached
+typedef struct {
+  uint64_t compiles;
+  uint64_t hits;
+  double compile_ms;
+  int cached;
+} db_stmt_stats_t;
+
+void db_stmt_cache_enable(int enabled);
+void db_stmt_stats(db_stmt_stats_t *stats);
 
 int db_row_ids(char *table, int **ids);
 int db_row_write(char *table, database_column_t *column, int num_columns);
 int db_row_read(char *table, int id, database_column_t *columns, int num_columns);
 
+int db_stream_id(char *code);
+const char *db_stream_code(int stream_id);
+
 int db_sample_insert(char *stream, long long timestamp, double value);
+int db_sample_insert_stream(int stream_id, long long timestamp, double value);
+int db_sample_insert_batch(phoenix_sample_t *samples, int num_samples, int64_t *first_id, int64_t *last_id);
 int db_sample_insert_json(struct json_object *sample);
 int db_sample_set_message_id(int64_t id, int mid);
 int db_sample_sent(int64_t id, int remove);
 int db_sample_sent_by_message_id(int mid, int remove);
+int db_samples_sent(int64_t *ids, int num_ids, int remove);
 int db_samples_read(phoenix_sample_t *samples, int limit);
+int db_samples_seq_set(const int64_t *ids, const int64_t *seqs, int num_ids);
+int db_samples_read_delivered(phoenix_sample_t *samples, int64_t *seqs, int limit, int64_t after_seq);
+int64_t db_session_seq_get();
+int db_session_seq_set(int64_t seq);
 int db_samples_delete_sent();
 
+//Sample journal, fsync once per records or interval_ms, whichever comes first
+typedef struct {
+  uint64_t records;
+  uint64_t commits;
+  uint64_t bytes;
+  uint64_t pending;
+} journal_stats_t;
+
+void journal_commit_interval_set(int records, int interval_ms);
+int journal_sync();
+void journal_stats(journal_stats_t *stats);
+
+//Ingest ring in front of the sample store
+typedef enum {
+  INGEST_OVERFLOW_BLOCK,
+  INGEST_OVERFLOW_DROP_OLDEST,
+  INGEST_OVERFLOW_SPILL,
+} ingest_overflow_t;
+
+typedef struct {
+  uint64_t pushed;
+  uint64_t drained;
+  uint64_t dropped;
+  uint64_t store_errors;    //Drained batches the store refused, their samples are in dropped
+  uint64_t spilled;
+  uint64_t blocked;
+  uint64_t high_water;
+  uint64_t depth;
+} ingest_stats_t;
+
+int ingest_init(int capacity, ingest_overflow_t overflow);
+int ingest_enabled();
+int ingest_push(int stream_id, long long timestamp, double value);
+int ingest_flush();
+void ingest_close();
+void ingest_stats(ingest_stats_t *stats);
+
+//Published samples waiting for an ack, keyed by message id
+typedef struct {
+  uint64_t published;
+  uint64_t acked;
+  uint64_t applied;
+  uint64_t transactions;
+  uint64_t statements;
+  uint64_t messages;
+  uint64_t in_flight;
+} inflight_stats_t;
+
+int inflight_add(int mid, int64_t id);
+int inflight_ack(int mid, int remove);
+int inflight_pending(int64_t id);
+int inflight_count();
+int inflight_flush();
+void inflight_forget(int mid);
+void inflight_clear();
+void inflight_stats(inflight_stats_t *stats);
+
+//Adaptive window of unacknowledged publishes, see window.c
+typedef struct {
+  uint64_t sent;
+  uint64_t acked;
+  uint64_t increases;
+  uint64_t decreases;
+  uint64_t errors;
+  uint64_t expired;
+  uint64_t probes;
+  int window;
+  int in_flight;
+  double srtt_ms;
+  double min_rtt_ms;
+} window_stats_t;
+
+double window_time_ms();
+void window_set(int min, int max);
+void window_reset();
+void window_sent(int mid, double now);
+int window_acked(int mid, double now);
+void window_error(double now);
+void window_expire(double now);
+int window_room();
+void window_stats(window_stats_t *stats);
+
+//Delivery sequence numbers and resume, see session.c
+typedef struct {
+  uint64_t assigned;
+  uint64_t reserved;
+  uint64_t resumed;       //Batches published again under their number
+  uint64_t session_lost;  //Connects where the broker had no session
+  int64_t next_seq;
+} session_stats_t;
+
+int64_t session_next();
+int session_record(const int64_t *ids, const int64_t *seqs, int num_ids);
+int session_forget(const int64_t *ids, int num_ids);
+void session_resume_start();
+int session_resuming();
+int session_resume_read(phoenix_sample_t *samples, int64_t *seqs, int limit);
+void session_resumed(int64_t last_seq, int batches);
+void session_lost();
+int session_backoff_ms(int attempt);
+void session_stats(session_stats_t *stats);
+
+//Commands from the server, run by workers off the network thread, see command.c
+struct mosquitto_message;
+typedef void (*phoenix_command_handler_t)(phoenix_t *phoenix, uint8_t *payload, int payload_len, struct mosquitto_message **response);
+
+typedef struct {
+  uint64_t received;
+  uint64_t executed;
+  uint64_t dropped;     //Queue full or malformed
+  uint64_t unknown;     //No handler registered
+  int queued;               //Batches encoded, written under mutex
+} command_stats_t;
+
+int phoenix_command_register(command_type_t cmd_id, phoenix_command_handler_t handler);
+int command_submit(phoenix_t *phoenix, const uint8_t *message, int len);
+int command_start();
+void command_stop();
+int command_pending();
+int command_process(int max);
+void command_stats(command_stats_t *stats);
+
 #endif // __PHOENIX_H__
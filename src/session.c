@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <phoenix.h>
+
+/*
+ * Delivery session.
+ *
+ * Every store and forward batch, a frame or a single sample message, is
+ * published under the next delivery sequence number, sent as the MQTT user
+ * property "seq" and recorded with its samples in the store. Numbers only
+ * grow, across reconnects and restarts: they are taken SESSION_SEQ_BLOCK at
+ * a time from the config and the journal. The server drops a number it has
+ * already seen.
+ *
+ * The MQTT session is persistent, after a reconnect the broker and
+ * libmosquitto finish what was in flight. After a restart, or when the
+ * broker lost the session, the batches still unacknowledged in the store
+ * are published again under their own numbers before anything new, and
+ * nothing else is resent. Messages libmosquitto still holds from the old
+ * connection are sent again by libmosquitto itself, their batches stay in
+ * flight and are skipped by the resume.
+ */
+
+static int64_t next_seq=0, reserved_seq=0;
+static int resuming=0;
+static int64_t resume_after=0;
+static unsigned int jitter_seed=0;
+
+static session_stats_t stats;
+static pthread_mutex_t session_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+int64_t session_next() {
+  int64_t seq;
+
+  pthread_mutex_lock(&session_mutex);
+  if(next_seq == 0) {
+    next_seq=db_session_seq_get();
+    reserved_seq=next_seq;
+  }
+  if(next_seq >= reserved_seq) {
+    if(db_session_seq_set(next_seq+SESSION_SEQ_BLOCK)) {
+      print_error("Could not reserve sequence numbers\n");
+    }
+    reserved_seq=next_seq+SESSION_SEQ_BLOCK;
+    stats.reserved+=SESSION_SEQ_BLOCK;
+  }
+  seq=next_seq++;
+  stats.assigned++;
+  pthread_mutex_unlock(&session_mutex);
+
+  return seq;
+}
+
+//Store the numbers before publishing, a batch published but not recorded
+//would be read and sent again under a new number after a crash
+int session_record(const int64_t *ids, const int64_t *seqs, int num_ids) {
+  return db_samples_seq_set(ids,seqs,num_ids);
+}
+
+//The batch could not be published, its samples are read as new ones again
+int session_forget(const int64_t *ids, int num_ids) {
+  int64_t *seqs=calloc(sizeof(int64_t),num_ids > 0 ? num_ids : 1);
+  int status;
+
+  status=db_samples_seq_set(ids,seqs,num_ids);
+  free(seqs);
+
+  return status;
+}
+
+//Publish what the store holds under a sequence number again, before new samples
+void session_resume_start() {
+  pthread_mutex_lock(&session_mutex);
+  resuming=1;
+  resume_after=0;
+  pthread_mutex_unlock(&session_mutex);
+}
+
+int session_resuming() {
+  int result;
+
+  pthread_mutex_lock(&session_mutex);
+  result=resuming;
+  pthread_mutex_unlock(&session_mutex);
+
+  return result;
+}
+
+//Read whole batches in sequence order after the last one resumed, at most
+//limit samples. limit must hold the largest batch, FRAME_MAX_SAMPLES. The
+//resume ends when nothing is left
+int session_resume_read(phoenix_sample_t *samples, int64_t *seqs, int limit) {
+  int num_samples, last;
+
+  pthread_mutex_lock(&session_mutex);
+  num_samples=db_samples_read_delivered(samples,seqs,limit,resume_after);
+
+  //The last batch may go on past limit, it is read again next time
+  if(num_samples == limit) {
+    for(last=num_samples-1;last > 0 && seqs[last] == seqs[num_samples-1];last--) {}
+    if(last > 0 || seqs[0] != seqs[num_samples-1]) {
+      num_samples=last+1;
+    }
+  }
+
+  if(num_samples == 0) {
+    resuming=0;
+  }
+  pthread_mutex_unlock(&session_mutex);
+
+  return num_samples;
+}
+
+//Batches up to last_seq went out again
+void session_resumed(int64_t last_seq, int batches) {
+  pthread_mutex_lock(&session_mutex);
+  if(last_seq > resume_after) {
+    resume_after=last_seq;
+  }
+  stats.resumed+=batches;
+  pthread_mutex_unlock(&session_mutex);
+}
+
+//The broker had no session for us. What libmosquitto still holds is
+//published again and acked on the new session, the rest is resumed
+void session_lost() {
+  pthread_mutex_lock(&session_mutex);
+  stats.session_lost++;
+  pthread_mutex_unlock(&session_mutex);
+
+  inflight_flush();
+  window_reset();
+  session_resume_start();
+}
+
+//Exponential backoff from PHOENIX_RECONNECT_MIN_MS to PHOENIX_RECONNECT_MAX_MS
+//with a random half, so a fleet that lost the broker together does not come
+//back together
+int session_backoff_ms(int attempt) {
+  int delay=PHOENIX_RECONNECT_MIN_MS;
+
+  while(attempt-- > 0 && delay < PHOENIX_RECONNECT_MAX_MS) {
+    delay*=2;
+  }
+  if(delay > PHOENIX_RECONNECT_MAX_MS) {
+    delay=PHOENIX_RECONNECT_MAX_MS;
+  }
+
+  pthread_mutex_lock(&session_mutex);
+  if(jitter_seed == 0) {
+    jitter_seed=time(NULL) ^ (getpid() << 16);
+  }
+  delay = delay/2 + rand_r(&jitter_seed) % (delay/2+1);
+  pthread_mutex_unlock(&session_mutex);
+
+  return delay;
+}
+
+void session_stats(session_stats_t *session_stats) {
+  pthread_mutex_lock(&session_mutex);
+  *session_stats=stats;
+  session_stats->next_seq=next_seq;
+  pthread_mutex_unlock(&session_mutex);
+}
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <phoenix.h>
+
+/*
+ * Registered stream handles.
+ *
+ * phoenix_stream_register() resolves the stream code once, after that
+ * phoenix_send_sample_h() only compares against the deadband and pushes the
+ * stream id, so the send path does no allocation, hashing or string work.
+ * A handle keeps deadband state and must only be used by one thread at a time.
+ *
+ * The delivery class of a stream is its MQTT QoS. QoS 0 samples are
+ * published at once and never stored, nothing is kept for them in flight
+ * and nothing acks them. QoS 1 and 2 are store and forward. Streams that
+ * were never registered are QoS 1.
+ *
+ * The class belongs to the stream, not the handle: options.qos sets it when
+ * the handle is registered, after that phoenix_stream_qos_set() and later
+ * registrations of the same code change it for every handle.
+ */
+
+struct phoenix_stream {
+  phoenix_t *phoenix;
+  int stream_id;
+  phoenix_stream_options_t options;
+  int has_last;
+  double last_value;
+};
+
+//Delivery class by stream id
+static unsigned char *stream_qos=NULL;
+static int stream_qos_size=0;
+static pthread_rwlock_t stream_qos_lock=PTHREAD_RWLOCK_INITIALIZER;
+
+static const phoenix_stream_options_t default_options={
+  .qos=1,
+  .deadband=0,
+};
+
+int phoenix_stream_qos(int stream_id) {
+  int qos=1;
+
+  pthread_rwlock_rdlock(&stream_qos_lock);
+  if(stream_id >= 0 && stream_id < stream_qos_size) {
+    qos=stream_qos[stream_id];
+  }
+  pthread_rwlock_unlock(&stream_qos_lock);
+
+  return qos;
+}
+
+int phoenix_stream_qos_set(int stream_id, int qos) {
+  unsigned char *grown;
+  int size, i;
+
+  if(stream_id < 0 || qos < 0 || qos > 2) {
+    print_error("Invalid QoS %d for stream %d\n", qos, stream_id);
+    return -1;
+  }
+
+  pthread_rwlock_wrlock(&stream_qos_lock);
+  if(stream_id >= stream_qos_size) {
+    size = stream_qos_size ? stream_qos_size : 64;
+    while(size <= stream_id) {
+      size*=2;
+    }
+    grown=realloc(stream_qos,size);
+    if(grown == NULL) {
+      pthread_rwlock_unlock(&stream_qos_lock);
+      print_error("Could not allocate QoS for stream %d\n", stream_id);
+      return -1;
+    }
+    for(i=stream_qos_size;i<size;i++) {
+      grown[i]=1;
+    }
+    stream_qos=grown;
+    stream_qos_size=size;
+  }
+  stream_qos[stream_id]=qos;
+  pthread_rwlock_unlock(&stream_qos_lock);
+
+  return 0;
+}
+
+phoenix_stream_t *phoenix_stream_register(phoenix_t *phoenix, const char *code, phoenix_stream_options_t *options) {
+  phoenix_stream_t *stream;
+  int stream_id;
+
+  stream_id=db_stream_id((char *)code);
+  if(stream_id < 0) {
+    print_error("Could not register stream %s\n", code);
+    return NULL;
+  }
+
+  stream=calloc(1,sizeof(phoenix_stream_t));
+  if(stream == NULL) {
+    print_error("Could not allocate stream %s\n", code);
+    return NULL;
+  }
+
+  stream->phoenix=phoenix;
+  stream->stream_id=stream_id;
+  stream->options = options ? *options : default_options;
+
+  if(phoenix_stream_qos_set(stream_id,stream->options.qos)) {
+    free(stream);
+    return NULL;
+  }
+
+  return stream;
+}
+
+void phoenix_stream_free(phoenix_stream_t *stream) {
+  free(stream);
+}
+
+int phoenix_stream_id(phoenix_stream_t *stream) {
+  return stream->stream_id;
+}
+
+int phoenix_send_sample_h(phoenix_stream_t *stream, long long timestamp, double value) {
+  //Suppress samples within the deadband of the last one sent
+  if(stream->options.deadband > 0 && stream->has_last && fabs(value - stream->last_value) < stream->options.deadband) {
+    return 0;
+  }
+  stream->has_last=1;
+  stream->last_value=value;
+
+  if(phoenix_stream_qos(stream->stream_id) == 0 && stream->phoenix && !stream->phoenix->http) {
+    return phoenix_mqtt_send_sample_qos0(stream->phoenix,stream->stream_id,timestamp,value);
+  }
+
+  if(ingest_enabled()) {
+    return ingest_push(stream->stream_id,timestamp,value);
+  }
+  return db_sample_insert_stream(stream->stream_id,timestamp,value);
+}
@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <phoenix.h>
+
+/*
+ * Adaptive publish window.
+ *
+ * Every QoS 1 publish takes a slot until its PUBACK arrives. The window
+ * grows by one per ack while the round trip stays near the smallest one
+ * seen (slow start), then by one per window. When the smoothed round trip
+ * rises above WINDOW_RTT_TOLERANCE times the minimum the broker or link is
+ * queueing, and the window shrinks to WINDOW_DECREASE of itself. Publish
+ * errors and acks that never come halve it. Both happen at most once per
+ * round trip.
+ *
+ * A minimum round trip that has not been seen again for WINDOW_MIN_RTT_MS
+ * is measured anew: the window drops to the minimum until the first ack of
+ * a message sent after that, which went through a drained queue, then it
+ * is restored. A queue that built up slowly or a route that got slower is
+ * learned this way.
+ */
+
+typedef struct {
+  int mid;
+  int acked;
+  double sent;
+} window_entry_t;
+
+//Publishes in send order, acks normally arrive in the same order
+static window_entry_t *entries=NULL;
+static int entries_size=0, head=0, count=0;
+static int in_flight=0;
+
+static double window=WINDOW_INITIAL;
+static int window_min=WINDOW_MIN, window_max=WINDOW_MAX;
+static int slow_start=1;
+static double srtt=0, min_rtt=0, min_rtt_time=0, last_decrease=0;
+static int probing=0;
+static double probe_start=0, probe_window=0;
+
+static window_stats_t stats;
+static pthread_mutex_t window_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+double window_time_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1e3 + ts.tv_nsec/1e6;
+}
+
+//Caller must hold window_mutex
+static void window_clamp() {
+  if(window < window_min) {
+    window=window_min;
+  }
+  if(window > window_max) {
+    window=window_max;
+  }
+}
+
+//Caller must hold window_mutex
+static void window_decrease(double factor, double now) {
+  if(now - last_decrease < srtt) {
+    return;
+  }
+  if(probing) {
+    probe_window*=factor;
+  }else{
+    window*=factor;
+    window_clamp();
+  }
+  slow_start=0;
+  last_decrease=now;
+  stats.decreases++;
+}
+
+//Caller must hold window_mutex. Drop acked entries from the front
+static void window_pop() {
+  while(count > 0 && entries[head].acked) {
+    head=(head+1) % entries_size;
+    count--;
+  }
+}
+
+//Limit the window to [min,max] messages
+void window_set(int min, int max) {
+  pthread_mutex_lock(&window_mutex);
+  window_min = min > 0 ? min : 1;
+  window_max = max >= window_min ? max : window_min;
+  window_clamp();
+  pthread_mutex_unlock(&window_mutex);
+}
+
+//Start over, after a new connection
+void window_reset() {
+  pthread_mutex_lock(&window_mutex);
+  head=0;
+  count=0;
+  in_flight=0;
+  window=WINDOW_INITIAL;
+  window_clamp();
+  slow_start=1;
+  srtt=0;
+  min_rtt=0;
+  last_decrease=0;
+  probing=0;
+  pthread_mutex_unlock(&window_mutex);
+}
+
+void window_sent(int mid, double now) {
+  window_entry_t *old;
+  int i;
+
+  pthread_mutex_lock(&window_mutex);
+  if(count == entries_size) {
+    old=entries;
+    entries=malloc(sizeof(window_entry_t) * (entries_size ? entries_size*2 : 64));
+    for(i=0;i<count;i++) {
+      entries[i]=old[(head+i) % entries_size];
+    }
+    free(old);
+    head=0;
+    entries_size = entries_size ? entries_size*2 : 64;
+  }
+
+  i=(head+count) % entries_size;
+  entries[i].mid=mid;
+  entries[i].acked=0;
+  entries[i].sent=now;
+  count++;
+  in_flight++;
+  stats.sent++;
+  pthread_mutex_unlock(&window_mutex);
+}
+
+//Returns 1 when mid was a publish in the window
+int window_acked(int mid, double now) {
+  double rtt, sent;
+  int i, e;
+
+  pthread_mutex_lock(&window_mutex);
+  for(i=0;i<count;i++) {
+    e=(head+i) % entries_size;
+    if(entries[e].mid == mid && !entries[e].acked) {
+      break;
+    }
+  }
+  if(i == count) {
+    //Not ours, or already expired
+    pthread_mutex_unlock(&window_mutex);
+    return 0;
+  }
+
+  entries[e].acked=1;
+  in_flight--;
+  stats.acked++;
+  sent=entries[e].sent;
+  rtt=now-sent;
+  window_pop();
+
+  srtt = srtt > 0 ? 0.875*srtt + 0.125*rtt : rtt;
+  if(probing) {
+    if(sent >= probe_start) {
+      min_rtt=rtt;
+      min_rtt_time=now;
+      window=probe_window;
+      window_clamp();
+      probing=0;
+    }
+    pthread_mutex_unlock(&window_mutex);
+    return 1;
+  }
+
+  if(min_rtt == 0 || rtt <= min_rtt) {
+    min_rtt=rtt;
+    min_rtt_time=now;
+  }else if(now - min_rtt_time > WINDOW_MIN_RTT_MS) {
+    probing=1;
+    probe_start=now;
+    probe_window=window;
+    window=window_min;
+    stats.probes++;
+    pthread_mutex_unlock(&window_mutex);
+    return 1;
+  }
+
+  if(srtt > min_rtt*WINDOW_RTT_TOLERANCE + WINDOW_RTT_SLACK_MS) {
+    window_decrease(WINDOW_DECREASE,now);
+  }else if(window < window_max) {
+    window += slow_start ? 1.0 : 1.0/window;
+    window_clamp();
+    stats.increases++;
+  }
+  pthread_mutex_unlock(&window_mutex);
+  return 1;
+}
+
+//A publish failed or the connection dropped
+void window_error(double now) {
+  pthread_mutex_lock(&window_mutex);
+  stats.errors++;
+  window_decrease(0.5,now);
+  pthread_mutex_unlock(&window_mutex);
+}
+
+//Give up on acks older than WINDOW_ACK_TIMEOUT_MS, their slots are freed.
+//The samples stay in flight until inflight.c sees the ack or a reconnect
+void window_expire(double now) {
+  int expired=0;
+
+  pthread_mutex_lock(&window_mutex);
+  while(count > 0 && (entries[head].acked || now - entries[head].sent > WINDOW_ACK_TIMEOUT_MS)) {
+    if(!entries[head].acked) {
+      entries[head].acked=1;
+      in_flight--;
+      expired++;
+    }
+    window_pop();
+  }
+  stats.expired+=expired;
+  if(expired) {
+    stats.errors++;
+    window_decrease(0.5,now);
+  }
+  pthread_mutex_unlock(&window_mutex);
+}
+
+//Messages that may be published now
+int window_room() {
+  int room;
+
+  pthread_mutex_lock(&window_mutex);
+  room=(int)window - in_flight;
+  pthread_mutex_unlock(&window_mutex);
+
+  return room > 0 ? room : 0;
+}
+
+void window_stats(window_stats_t *window_stats) {
+  pthread_mutex_lock(&window_mutex);
+  *window_stats=stats;
+  window_stats->window=(int)window;
+  window_stats->in_flight=in_flight;
+  window_stats->srtt_ms=srtt;
+  window_stats->min_rtt_ms=min_rtt;
+  pthread_mutex_unlock(&window_mutex);
+}
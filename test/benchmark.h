@@ -0,0 +1,54 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <math.h>
+#include <time.h>
+#include "../src/phoenix.h"
+
+//Helpers shared by the benchmarks, each includes this once
+
+//Wall clock time
+static inline double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1e3 + ts.tv_nsec/1e6;
+}
+
+//CPU time of the process, all threads
+static inline double cpu_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID,&ts);
+  return ts.tv_sec*1e3 + ts.tv_nsec/1e6;
+}
+
+//The signals of reference_device, one sample per stream per second: a
+//counter, with three streams a temperature with two decimals, and a signal
+//that needs all digits. num_streams is 2 or 3
+static inline int trace_generate(phoenix_sample_t *samples, int num_samples, int num_streams) {
+  int i, inc=db_stream_id("test.inc"), ref=db_stream_id("test.ref_value");
+  int temperature = num_streams > 2 ? db_stream_id("plant.line1.temperature") : -1;
+  long long timestamp=phoenix_get_timestamp(), second;
+  double x;
+
+  timestamp-=timestamp%1000;
+  for(i=0;i<num_samples;i++) {
+    second=i/num_streams;
+    x=(timestamp + second*1000)/1000.0;
+    samples[i].id=i+1;
+    samples[i].timestamp=timestamp + second*1000 + i%num_streams;
+    if(i%num_streams == 0) {
+      samples[i].stream_id=inc;
+      samples[i].value=second;
+    }else if(i%num_streams < num_streams-1) {
+      samples[i].stream_id=temperature;
+      samples[i].value=round(2000+100*sin(x/300.0))/100.0;
+    }else{
+      samples[i].stream_id=ref;
+      samples[i].value=cos(x/200.0) * sin(x/300);
+    }
+  }
+
+  return num_samples;
+}
+
+#endif
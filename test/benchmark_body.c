@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "benchmark.h"
+
+int debug=0;
+
+#define BODY_SAMPLES 100000
+#define BODY_ROUNDS 5
+
+typedef struct {
+  phoenix_sample_t *samples;
+  int num_samples;
+  int errors;
+} decoded_t;
+
+//The server side of a frame, every sample must come back as it was sent
+static void frame_sample(const char *stream, long long timestamp, double value, void *arg) {
+  decoded_t *decoded=arg;
+  phoenix_sample_t *sample=&decoded->samples[decoded->num_samples++];
+
+  if(strcmp(stream,db_stream_code(sample->stream_id)) || timestamp != sample->timestamp || value != sample->value) {
+    decoded->errors++;
+  }
+}
+
+//The server side of a notification: parse and read every sample
+static int json_decode(const char *body) {
+  struct json_object *notification=json_tokener_parse(body), *parameters, *sample, *value;
+  int i, num_samples;
+
+  if(!json_object_object_get_ex(notification,"parameters",&parameters)) {
+    json_object_put(notification);
+    return -1;
+  }
+  num_samples=json_object_array_length(parameters);
+  for(i=0;i<num_samples;i++) {
+    sample=json_object_array_get_idx(parameters,i);
+    json_object_object_get_ex(sample,"code",&value);
+    json_object_get_string(value);
+    json_object_object_get_ex(sample,"timestamp",&value);
+    json_object_get_string(value);
+    json_object_object_get_ex(sample,"value",&value);
+    json_object_get_double(value);
+  }
+  json_object_put(notification);
+
+  return num_samples;
+}
+
+#define BODY_JSON 0
+#define BODY_JSON_GZIP 1
+#define BODY_FRAME 2
+#define BODY_FRAME_ZLIB 3
+
+static const char *body_names[]={"json","json gzip","frame","frame zlib"};
+
+//Bytes per sample and CPU per sample to encode and to decode batches of
+//batch samples, the way phoenix_http_upload() posts them
+static int run(phoenix_sample_t *samples, int batch, int body) {
+  notification_t notification;
+  frame_t frame;
+  decoded_t decoded;
+  uint8_t *out=malloc(compress_bound(NOTIFICATION_SIZE*batch)), *encoded=NULL, *plain;
+  size_t plain_len, bytes=0;
+  double encode_ms=0, decode_ms=0, start;
+  int i, j, round, len=0, errors=0;
+
+  memset(&notification,0,sizeof(notification));
+  frame_init(&frame,HTTP_FRAME_MAX_SIZE);
+  compress_set(body == BODY_JSON_GZIP || body == BODY_FRAME_ZLIB ? 6 : 0,0);
+
+  for(round=0;round<BODY_ROUNDS;round++) {
+    for(i=0;i+batch<=BODY_SAMPLES;i+=batch) {
+      start=cpu_ms();
+      if(body == BODY_JSON || body == BODY_JSON_GZIP) {
+        len=notification_streams(&notification,samples+i,batch);
+        if(body == BODY_JSON_GZIP) {
+          len=compress_buffer(COMPRESS_GZIP,(const uint8_t *)notification.data,notification.len,out,compress_bound(notification.len));
+        }
+      }else{
+        frame_reset(&frame);
+        for(j=i;j<i+batch && frame_add(&frame,&samples[j]) == 0;j++) {}
+        if(j < i+batch) {
+          print_error("%d of %d samples fit in a frame\n", j-i, batch);
+          errors++;
+        }
+        len=frame_encode_compressed(&frame,&encoded);
+      }
+      encode_ms+=cpu_ms()-start;
+      bytes+=len;
+
+      start=cpu_ms();
+      if(body == BODY_JSON) {
+        errors+=json_decode(notification.data) != batch;
+      }else if(body == BODY_JSON_GZIP) {
+        if(compress_inflate(out,len,&plain,&plain_len) == 0) {
+          plain=realloc(plain,plain_len+1);
+          plain[plain_len]=0;
+          errors+=json_decode((const char *)plain) != batch;
+          free(plain);
+        }else{
+          errors++;
+        }
+      }else{
+        decoded.samples=samples+i;
+        decoded.num_samples=0;
+        decoded.errors=0;
+        errors+=frame_decode(encoded,len,frame_sample,&decoded) != batch || decoded.errors;
+        free(encoded);
+      }
+      decode_ms+=cpu_ms()-start;
+    }
+  }
+
+  printf("%8d %12s %10.1f %12.0f %12.0f\n", batch, body_names[body], (double)bytes/(BODY_ROUNDS*BODY_SAMPLES),
+      encode_ms*1000000.0/(BODY_ROUNDS*BODY_SAMPLES), decode_ms*1000000.0/(BODY_ROUNDS*BODY_SAMPLES));
+
+  notification_free(&notification);
+  frame_free(&frame);
+  free(out);
+  compress_set(0,0);
+
+  return errors;
+}
+
+//Size and CPU per sample of the HTTP notification bodies: JSON, plain
+//and gzip, against frames, plain and zlib, encoded and decoded again as
+//the server would
+int main(int argc, char *argv[]) {
+  char workdir[64];
+  phoenix_sample_t *samples=calloc(sizeof(phoenix_sample_t),BODY_SAMPLES);
+  int body, errors=0;
+
+  sprintf(workdir,"/tmp/phoenix_bench_XXXXXX");
+  if(mkdtemp(workdir)==NULL || db_init(workdir)) {
+    print_fatal("Could not init database\n");
+  }
+  trace_generate(samples,BODY_SAMPLES,3);
+
+  printf("%d samples, %d rounds\n", BODY_SAMPLES, BODY_ROUNDS);
+  printf("%8s %12s %10s %12s %12s\n", "batch", "body", "B/sample", "encode ns", "decode ns");
+  for(body=BODY_JSON;body<=BODY_FRAME_ZLIB;body++) {
+    errors+=run(samples,MAX_SAMPLES_TO_SEND,body);
+  }
+  for(body=BODY_JSON;body<=BODY_FRAME_ZLIB;body++) {
+    errors+=run(samples,1000,body);
+  }
+
+  free(samples);
+  db_close();
+
+  if(errors) {
+    print_error("%d body errors\n", errors);
+    return -1;
+  }
+
+  return 0;
+}
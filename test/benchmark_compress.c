@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "benchmark.h"
+
+int debug=0;
+
+#define TRACE_SAMPLES 100000
+
+typedef struct {
+  int len;
+  uint8_t *data;
+} payload_t;
+
+static int frames_encode(phoenix_sample_t *samples, int num_samples, payload_t *payloads) {
+  frame_t frame;
+  int i=0, num_payloads=0;
+
+  frame_init(&frame,FRAME_MAX_SIZE);
+  while(i < num_samples) {
+    frame_reset(&frame);
+    for(;i<num_samples && frame_add(&frame,&samples[i])==0;i++) {}
+
+    payloads[num_payloads].len=frame_size(&frame);
+    payloads[num_payloads].data=malloc(frame_size(&frame));
+    frame_encode(&frame,payloads[num_payloads].data,frame_size(&frame));
+    num_payloads++;
+  }
+  frame_free(&frame);
+
+  return num_payloads;
+}
+
+//Same body as phoenix_http_send_samples
+static int json_encode(phoenix_sample_t *samples, int num_samples, payload_t *payloads) {
+  struct json_object *notification, *parameters, *sample;
+  const char *json_str;
+  char ts[100];
+  int i, j, num_payloads=0;
+
+  for(i=0;i<num_samples;i+=MAX_SAMPLES_TO_SEND) {
+    notification=json_object_new_object();
+    parameters=json_object_new_array();
+    json_object_object_add(notification,"notification",json_object_new_string("streams"));
+    json_object_object_add(notification,"parameters",parameters);
+
+    for(j=i;j<num_samples && j<i+MAX_SAMPLES_TO_SEND;j++) {
+      sample=json_object_new_object();
+      getRFC3339(samples[j].timestamp,ts);
+      json_object_object_add(sample,"code",json_object_new_string(db_stream_code(samples[j].stream_id)));
+      json_object_object_add(sample,"timestamp",json_object_new_string(ts));
+      json_object_object_add(sample,"value",json_object_new_double(samples[j].value));
+      json_object_array_add(parameters,sample);
+    }
+
+    json_str=json_object_to_json_string_ext(notification,JSON_C_TO_STRING_PLAIN);
+    payloads[num_payloads].len=strlen(json_str);
+    payloads[num_payloads].data=(uint8_t *)strdup(json_str);
+    num_payloads++;
+    json_object_put(notification);
+  }
+
+  return num_payloads;
+}
+
+static void run(const char *name, compress_format_t format, int level, payload_t *payloads, int num_payloads) {
+  uint8_t *out=malloc(compress_bound(FRAME_MAX_SIZE*64));
+  compress_stats_t before, after;
+  int i;
+
+  compress_set(level,0);
+  compress_stats(&before);
+  for(i=0;i<num_payloads;i++) {
+    compress_buffer(format,payloads[i].data,payloads[i].len,out,compress_bound(payloads[i].len));
+  }
+  compress_stats(&after);
+
+  printf("%16s %6d %10.1f %10.1f %8.2f %10.1f\n", name, level,
+      (double)(after.bytes_in-before.bytes_in)/num_payloads,
+      (double)(after.bytes_out-before.bytes_out)/num_payloads,
+      (double)(after.bytes_in-before.bytes_in)/(after.bytes_out-before.bytes_out),
+      (after.cpu_ms-before.cpu_ms)*1000.0/num_payloads);
+  free(out);
+}
+
+//Compression ratio against CPU time per payload for frames and HTTP
+//bodies. The samples come from a reference_device database directory when
+//one is given, otherwise the reference_device signals are generated
+int main(int argc, char *argv[]) {
+  char workdir[64];
+  const char *codes="test.inctest.ref_value";
+  phoenix_sample_t *samples=calloc(sizeof(phoenix_sample_t),TRACE_SAMPLES);
+  payload_t *frames=calloc(sizeof(payload_t),TRACE_SAMPLES);
+  payload_t *bodies=calloc(sizeof(payload_t),TRACE_SAMPLES);
+  int i, level, num_samples, num_frames, num_bodies;
+  int levels[]={1,6,9};
+
+  if(argc > 1) {
+    if(db_init(argv[1])) {
+      print_fatal("Could not open %s\n", argv[1]);
+    }
+    num_samples=db_samples_read(samples,TRACE_SAMPLES);
+  }else{
+    sprintf(workdir,"/tmp/phoenix_bench_XXXXXX");
+    if(mkdtemp(workdir)==NULL || db_init(workdir)) {
+      print_fatal("Could not init database\n");
+    }
+    num_samples=trace_generate(samples,TRACE_SAMPLES,2);
+  }
+
+  num_frames=frames_encode(samples,num_samples,frames);
+  num_bodies=json_encode(samples,num_samples,bodies);
+
+  printf("%d samples, %d frames, %d http bodies\n", num_samples, num_frames, num_bodies);
+  printf("%16s %6s %10s %10s %8s %10s\n", "payload", "level", "bytes in", "bytes out", "ratio", "us/payload");
+  for(i=0;i<sizeof(levels)/sizeof(levels[0]);i++) {
+    level=levels[i];
+    compress_dictionary_set(NULL,0);
+    run("frame",COMPRESS_ZLIB,level,frames,num_frames);
+    compress_dictionary_set((const uint8_t *)codes,strlen(codes));
+    run("frame+dict",COMPRESS_ZLIB,level,frames,num_frames);
+    run("http gzip",COMPRESS_GZIP,level,bodies,num_bodies);
+  }
+
+  for(i=0;i<num_frames;i++) {
+    free(frames[i].data);
+  }
+  for(i=0;i<num_bodies;i++) {
+    free(bodies[i].data);
+  }
+  free(frames);
+  free(bodies);
+  free(samples);
+  db_close();
+
+  return 0;
+}
@@ -0,0 +1,548 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include "benchmark.h"
+
+int debug=0;
+
+//Every benchmark runs against a fresh database in its own directory
+static char *bench_workdir(void) {
+  static char workdir[64];
+  sprintf(workdir,"/tmp/phoenix_bench_XXXXXX");
+  if(mkdtemp(workdir)==NULL) {
+    print_fatal("Could not create work directory\n");
+  }
+  return workdir;
+}
+
+static void bench_insert(void) {
+  int sizes[]={1000,10000,100000};
+  int batch_size=1000;
+  int i,j,n,num;
+  int64_t first_id,last_id;
+  double start,single_ms,batch_ms;
+  long long timestamp=phoenix_get_timestamp();
+  char stream[64];
+  phoenix_sample_t *samples=calloc(sizeof(phoenix_sample_t),batch_size);
+
+  for(i=0;i<batch_size;i++) {
+    sprintf(stream,"modbus.%d",i%50);
+    samples[i].stream_id=db_stream_id(stream);
+  }
+
+  printf("%10s %14s %14s %10s\n","samples","single ms","batch ms","speedup");
+  for(n=0;n<sizeof(sizes)/sizeof(int);n++) {
+    start=now_ms();
+    for(i=0;i<sizes[n];i++) {
+      db_sample_insert_stream(samples[i%batch_size].stream_id,timestamp+i,i*1.0);
+    }
+    single_ms=now_ms()-start;
+
+    start=now_ms();
+    for(i=0;i<sizes[n];i+=num) {
+      num = sizes[n]-i < batch_size ? sizes[n]-i : batch_size;
+      for(j=0;j<num;j++) {
+        samples[j].timestamp=timestamp+i+j;
+        samples[j].value=(i+j)*1.0;
+      }
+      if(db_sample_insert_batch(samples,num,&first_id,&last_id)) {
+        print_fatal("Batch insert failed\n");
+      }
+      if(last_id-first_id+1 != num) {
+        print_fatal("Unexpected id range: %lld..%lld for %d samples\n",(long long)first_id,(long long)last_id,num);
+      }
+    }
+    batch_ms=now_ms()-start;
+
+    printf("%10d %14.2f %14.2f %9.1fx\n",sizes[n],single_ms,batch_ms,single_ms/batch_ms);
+    db_exec("DELETE FROM samples");
+  }
+
+  free(samples);
+}
+
+#define INGEST_PRODUCERS 4
+#define INGEST_SAMPLES_PER_PRODUCER 250000
+
+static void *ingest_producer(void *input) {
+  int i,stream_id;
+  char stream[64];
+  long long timestamp=phoenix_get_timestamp();
+
+  sprintf(stream,"producer.%ld",(long)input);
+  stream_id=db_stream_id(stream);
+  for(i=0;i<INGEST_SAMPLES_PER_PRODUCER;i++) {
+    ingest_push(stream_id,timestamp+i,i*1.0);
+  }
+  return NULL;
+}
+
+static void bench_ingest(void) {
+  ingest_overflow_t policies[]={INGEST_OVERFLOW_BLOCK,INGEST_OVERFLOW_DROP_OLDEST,INGEST_OVERFLOW_SPILL};
+  const char *names[]={"block","drop-oldest","spill"};
+  pthread_t producers[INGEST_PRODUCERS];
+  ingest_stats_t stats;
+  long i,p;
+  double start,push_ms,total_ms;
+
+  printf("%12s %12s %12s %10s %10s %10s %10s\n","policy","push ms","stored ms","Msamples/s","dropped","spilled","high water");
+  for(p=0;p<sizeof(policies)/sizeof(policies[0]);p++) {
+    db_exec("DELETE FROM samples");
+    ingest_init(1<<16,policies[p]);
+
+    start=now_ms();
+    for(i=0;i<INGEST_PRODUCERS;i++) {
+      pthread_create(&producers[i],NULL,ingest_producer,(void *)i);
+    }
+    for(i=0;i<INGEST_PRODUCERS;i++) {
+      pthread_join(producers[i],NULL);
+    }
+    push_ms=now_ms()-start;
+    ingest_stats(&stats);
+    ingest_close();
+    total_ms=now_ms()-start;
+
+    printf("%12s %12.2f %12.2f %10.2f %10llu %10llu %10llu\n",names[p],push_ms,total_ms,
+        INGEST_PRODUCERS*INGEST_SAMPLES_PER_PRODUCER/push_ms/1e3,
+        (unsigned long long)stats.dropped,(unsigned long long)stats.spilled,(unsigned long long)stats.high_water);
+  }
+}
+
+static void bench_journal(void) {
+  int intervals[]={1,10,100,1000,10000};
+  int num_samples=20000;
+  int i,n;
+  double start,elapsed_ms;
+  journal_stats_t before,after;
+  long long timestamp=phoenix_get_timestamp();
+
+  printf("%10s %12s %12s %10s %14s\n","records","samples","ms","fsyncs","samples/s");
+  for(n=0;n<sizeof(intervals)/sizeof(int);n++) {
+    journal_commit_interval_set(intervals[n],JOURNAL_COMMIT_INTERVAL_MS);
+    journal_stats(&before);
+
+    start=now_ms();
+    for(i=0;i<num_samples;i++) {
+      db_sample_insert("bench.journal",timestamp+i,i*1.0);
+      //Commits happen in the background, give the journal thread a chance
+      //to keep up like a real poller would between readings
+      if(intervals[n] < 100 && i%intervals[n]==0) {
+        sched_yield();
+      }
+    }
+    journal_sync();
+    elapsed_ms=now_ms()-start;
+    journal_stats(&after);
+
+    printf("%10d %12d %12.2f %10llu %14.0f\n",intervals[n],num_samples,elapsed_ms,
+        (unsigned long long)(after.commits-before.commits),num_samples/elapsed_ms*1e3);
+  }
+}
+
+static void bench_snapshot(void) {
+  int budgets[]={1,5,20};
+  int i,n,num_samples=500000,batch_size=1000;
+  double start,latency,max_latency;
+  db_snapshot_stats_t stats;
+  char stream[64];
+  phoenix_sample_t *samples=calloc(sizeof(phoenix_sample_t),batch_size);
+  long long timestamp=phoenix_get_timestamp();
+
+  for(i=0;i<batch_size;i++) {
+    sprintf(stream,"snapshot.%d",i%20);
+    samples[i].stream_id=db_stream_id(stream);
+    samples[i].timestamp=timestamp+i;
+  }
+  for(i=0;i<num_samples;i+=batch_size) {
+    db_sample_insert_batch(samples,batch_size,NULL,NULL);
+  }
+
+  printf("%10s %10s %12s %14s %14s %16s\n","budget ms","pages","snapshot ms","max stall ms","total stall ms","max insert ms");
+  for(n=0;n<sizeof(budgets)/sizeof(int);n++) {
+    db_snapshot_stats(&stats);
+    db_snapshot_start(1,budgets[n]);
+
+    //Keep inserting while the snapshot runs and record the worst insert latency
+    max_latency=0;
+    i=0;
+    do {
+      start=now_ms();
+      db_sample_insert("snapshot.live",timestamp+i,i*1.0);
+      latency=now_ms()-start;
+      if(latency > max_latency) {
+        max_latency=latency;
+      }
+      i++;
+      db_snapshot_stats(&stats);
+    } while(stats.snapshots < n+1);
+    db_snapshot_stop();
+
+    printf("%10d %10d %12.2f %14.2f %14.2f %16.2f\n",budgets[n],stats.pages,stats.duration_ms,stats.max_stall_ms,stats.total_stall_ms,max_latency);
+  }
+
+  free(samples);
+}
+
+//Size of phoenix.db after a fresh snapshot of the in-memory database
+static double db_file_bytes(char *workdir) {
+  char filename[256];
+  struct stat st;
+
+  db_exec("VACUUM");
+  db_snapshot();
+  sprintf(filename,"%s/phoenix.db",workdir);
+  if(stat(filename,&st)) {
+    print_fatal("Could not stat %s\n", filename);
+  }
+  return st.st_size;
+}
+
+//Bytes per stored sample with the stream code in every row versus interned
+static void bench_streams(char *workdir) {
+  int i,num_samples=200000;
+  char stream[64];
+  double before,after,empty;
+  long long timestamp=phoenix_get_timestamp();
+
+  empty=db_file_bytes(workdir);
+
+  db_exec("CREATE TABLE samples_codes(id INTEGER PRIMARY KEY AUTOINCREMENT, code STRING NOT NULL, timestamp INTEGER NOT NULL, value DOUBLE, is_sent INT DEFAULT 0, message_id INTEGER NULL);");
+  db_exec("BEGIN");
+  for(i=0;i<num_samples;i++) {
+    char sql[256];
+    sprintf(sql,"INSERT INTO samples_codes(code,timestamp,value) VALUES('plant.line%d.modbus.holding_register.%d',%lld,%d);",i%8,i%50,timestamp+i,i);
+    db_exec(sql);
+  }
+  db_exec("COMMIT");
+  before=(db_file_bytes(workdir)-empty)/num_samples;
+  db_exec("DROP TABLE samples_codes");
+  empty=db_file_bytes(workdir);
+
+  for(i=0;i<num_samples;i++) {
+    sprintf(stream,"plant.line%d.modbus.holding_register.%d",i%8,i%50);
+    db_sample_insert(stream,timestamp+i,i*1.0);
+  }
+  after=(db_file_bytes(workdir)-empty)/num_samples;
+
+  printf("%14s %14s %14s\n","bytes/sample","code in row","interned");
+  printf("%14s %14.1f %14.1f\n","database",before,after);
+  printf("%14s %14d %14zu\n","ring/batch",(int)(sizeof(int64_t)+256+sizeof(long long)+sizeof(double)),sizeof(phoenix_sample_t));
+}
+
+//Config get/set through the cache versus the SQL path, conf_bench has the
+//same schema as conf_double but is not cached
+static void bench_conf(void) {
+  const char *tables[]={"conf_bench","conf_double","conf_double"};
+  const char *names[]={"sql","write-through","write-behind"};
+  int i,t,num_ops=100000,num_keys=32;
+  char key[64];
+  double start,get_ms,set_ms;
+  int64_t sum=0;
+
+  db_exec("CREATE TABLE conf_bench(id INTEGER PRIMARY KEY AUTOINCREMENT, key STRING NOT NULL UNIQUE, value DOUBLE);");
+
+  printf("%14s %14s %14s\n","path","get ops/s","set ops/s");
+  for(t=0;t<sizeof(tables)/sizeof(tables[0]);t++) {
+    db_conf_write_behind_set(t==2);
+
+    start=now_ms();
+    for(i=0;i<num_ops;i++) {
+      sprintf(key,"bench.%d",i%num_keys);
+      db_int64_set((char *)tables[t],key,i);
+    }
+    db_conf_flush();
+    set_ms=now_ms()-start;
+
+    start=now_ms();
+    for(i=0;i<num_ops;i++) {
+      sprintf(key,"bench.%d",i%num_keys);
+      sum+=db_int64_get((char *)tables[t],key);
+    }
+    get_ms=now_ms()-start;
+
+    printf("%14s %14.0f %14.0f\n",names[t],num_ops/get_ms*1e3,num_ops/set_ms*1e3);
+  }
+
+  if(sum == 0) {
+    print_error("Unexpected config values\n");
+  }
+}
+
+//Generic accessors the way test_database.c uses them, with and without the
+//statement cache
+static void bench_rows(void) {
+  int rounds=2000,i,r,row,num_ids,ops;
+  int slave_addr=87,data_addr,data_len=2;
+  double gain=1.0,start,elapsed_ms;
+  int *ids;
+  char key[64],*value;
+  db_stmt_stats_t before,after;
+  database_column_t columns[]={
+    {"slave_addr",  DBTYPE_INT,   &slave_addr},
+    {"data_addr",   DBTYPE_INT,   &data_addr},
+    {"data_len",    DBTYPE_INT,   &data_len},
+    {"data_type",   DBTYPE_STRING,"float"},
+    {"gain",        DBTYPE_DOUBLE, &gain},
+    {"offset",      DBTYPE_DOUBLE, NULL}
+  };
+  int num_columns=sizeof(columns)/sizeof(database_column_t);
+
+  db_exec("CREATE TABLE modbus_mapping(id INTEGER PRIMARY KEY AUTOINCREMENT, slave_addr INT, data_addr INT, data_len INT, data_type STRING, gain DOUBLE, offset DOUBLE);");
+  db_exec("CREATE TABLE kv_bench(id INTEGER PRIMARY KEY AUTOINCREMENT, key STRING NOT NULL UNIQUE, value STRING);");
+
+  printf("%8s %10s %14s %14s %12s\n","cache","ops","compiles/op","compile ms","us/op");
+  for(i=0;i<2;i++) {
+    db_stmt_cache_enable(i);
+    db_stmt_stats(&before);
+    ops=0;
+
+    start=now_ms();
+    for(r=0;r<rounds;r++) {
+      for(data_addr=4;data_addr<32;data_addr+=4,ops++) {
+        db_row_write("modbus_mapping",columns,num_columns);
+      }
+
+      num_ids=db_row_ids("modbus_mapping",&ids);
+      ops++;
+      for(row=num_ids-7;row<num_ids;row++,ops++) {
+        database_column_t read[]={{"slave_addr",DBTYPE_INT,NULL},{"data_type",DBTYPE_STRING,NULL},{"gain",DBTYPE_DOUBLE,NULL}};
+        db_row_read("modbus_mapping",ids[row],read,3);
+        free(read[0].value);
+        free(read[1].value);
+        free(read[2].value);
+      }
+      free(ids);
+
+      sprintf(key,"test_string_%d",r%10);
+      db_string_upsert("kv_bench",key,key);
+      value=db_string_get("kv_bench",key);
+      free(value);
+      ops+=2;
+
+      //Keep the id scan short, like a real mapping table
+      if(r%10 == 9) {
+        db_exec("DELETE FROM modbus_mapping");
+      }
+    }
+    elapsed_ms=now_ms()-start;
+    db_stmt_stats(&after);
+
+    printf("%8s %10d %14.2f %14.2f %12.2f\n",i ? "on" : "off",ops,
+        (double)(after.compiles-before.compiles)/ops,after.compile_ms-before.compile_ms,elapsed_ms*1e3/ops);
+  }
+}
+
+static double queue_read_ms(int reads) {
+  phoenix_sample_t samples[MAX_SAMPLES_TO_SEND];
+  double start=now_ms();
+  int i;
+
+  for(i=0;i<reads;i++) {
+    if(db_samples_read(samples,MAX_SAMPLES_TO_SEND) != MAX_SAMPLES_TO_SEND) {
+      print_fatal("Short read from send queue\n");
+    }
+  }
+
+  return (now_ms()-start)/reads;
+}
+
+//Latency of fetching the next batch to send as the backlog grows, with the
+//samples_pending index and without it
+static void bench_queue(void) {
+  int sizes[]={10000,1000000,10000000};
+  int i,j,n,queued=0,batch_size=1000;
+  double indexed_ms,scan_ms;
+  char stream[64];
+  long long timestamp=phoenix_get_timestamp();
+  phoenix_sample_t *samples=calloc(sizeof(phoenix_sample_t),batch_size);
+
+  for(i=0;i<batch_size;i++) {
+    sprintf(stream,"queue.%d",i%50);
+    samples[i].stream_id=db_stream_id(stream);
+  }
+
+  printf("%10s %14s %14s\n","queued","indexed ms","scan ms");
+  for(n=0;n<sizeof(sizes)/sizeof(int);n++) {
+    for(;queued<sizes[n];queued+=batch_size) {
+      for(j=0;j<batch_size;j++) {
+        samples[j].timestamp=timestamp+queued+j;
+        samples[j].value=queued+j;
+      }
+      db_sample_insert_batch(samples,batch_size,NULL,NULL);
+    }
+
+    indexed_ms=queue_read_ms(1000);
+
+    db_exec("DROP INDEX samples_pending");
+    scan_ms=queue_read_ms(sizes[n] > 1000000 ? 3 : 20);
+    db_exec("CREATE INDEX samples_pending ON samples(timestamp, stream_id, value) WHERE is_sent=0 AND message_id IS NULL;");
+
+    printf("%10d %14.3f %14.3f\n",sizes[n],indexed_ms,scan_ms);
+  }
+
+  free(samples);
+}
+
+//Publish/ack cycle without a broker: every read batch is "published" one
+//sample per message and acked right away. The message id path runs one
+//UPDATE per publish and one per ack, the in-flight table applies acks in
+//range transactions
+static void bench_inflight(void) {
+  phoenix_sample_t samples[MAX_SAMPLES_TO_SEND];
+  int i,n,p,num_samples=100000,mid,delivered,statements;
+  double start,elapsed_ms;
+  char stream[64];
+  inflight_stats_t before,after;
+  long long timestamp=phoenix_get_timestamp();
+
+  printf("%14s %12s %14s %14s\n","path","samples","samples/s","writes/sample");
+  for(p=0;p<2;p++) {
+    db_exec("DELETE FROM samples");
+    for(i=0;i<num_samples;i++) {
+      samples[i%MAX_SAMPLES_TO_SEND].stream_id=db_stream_id("inflight.bench");
+      samples[i%MAX_SAMPLES_TO_SEND].timestamp=timestamp+i;
+      samples[i%MAX_SAMPLES_TO_SEND].value=i;
+      if(i%MAX_SAMPLES_TO_SEND == MAX_SAMPLES_TO_SEND-1) {
+        db_sample_insert_batch(samples,MAX_SAMPLES_TO_SEND,NULL,NULL);
+      }
+    }
+
+    inflight_stats(&before);
+    delivered=0;
+    statements=0;
+    mid=0;
+    start=now_ms();
+    while((n=db_samples_read(samples,MAX_SAMPLES_TO_SEND)) > 0) {
+      for(i=0;i<n;i++) {
+        mid = mid%65535 + 1;
+        if(p == 0) {
+          db_sample_set_message_id(samples[i].id,mid);
+          db_sample_sent_by_message_id(mid,0);
+          statements+=2;
+        }else{
+          inflight_add(mid,samples[i].id);
+          inflight_ack(mid,0);
+        }
+      }
+      delivered+=n;
+    }
+    inflight_flush();
+    elapsed_ms=now_ms()-start;
+    inflight_stats(&after);
+
+    if(p == 1) {
+      statements=after.statements-before.statements;
+    }
+    printf("%14s %12d %14.0f %14.3f\n",p ? "in-flight" : "message id",delivered,delivered/elapsed_ms*1e3,(double)statements/delivered);
+  }
+}
+
+//Time db_init in a child process, so every run starts from a cold library
+static double startup_time(char *workdir, db_startup_mode_t mode) {
+  int fds[2];
+  double elapsed_ms=-1;
+  double start;
+
+  pipe(fds);
+  if(fork()==0) {
+    start=now_ms();
+    db_startup_mode_set(mode);
+    if(db_init(workdir)) {
+      print_fatal("Could not init database\n");
+    }
+    elapsed_ms=now_ms()-start;
+    write(fds[1],&elapsed_ms,sizeof(elapsed_ms));
+    _exit(0);
+  }
+  read(fds[0],&elapsed_ms,sizeof(elapsed_ms));
+  wait(NULL);
+  close(fds[0]);
+  close(fds[1]);
+
+  return elapsed_ms;
+}
+
+static void bench_startup(void) {
+  int sizes[]={10000,100000,1000000};
+  int i,n,batch_size=1000;
+  char *workdir;
+  double restore_ms,lazy_ms;
+  long long timestamp=phoenix_get_timestamp();
+  phoenix_sample_t *samples=calloc(sizeof(phoenix_sample_t),batch_size);
+
+  printf("%10s %14s %14s\n","backlog","restore ms","lazy ms");
+  for(n=0;n<sizeof(sizes)/sizeof(int);n++) {
+    workdir=bench_workdir();
+
+    //Build a phoenix.db holding the unsent backlog
+    if(fork()==0) {
+      db_init(workdir);
+      for(i=0;i<batch_size;i++) {
+        char stream[64];
+        sprintf(stream,"backlog.%d",i%100);
+        samples[i].stream_id=db_stream_id(stream);
+      }
+      for(i=0;i<sizes[n];i+=batch_size) {
+        samples[0].timestamp=timestamp+i;
+        db_sample_insert_batch(samples,batch_size,NULL,NULL);
+      }
+      db_close();
+      _exit(0);
+    }
+    wait(NULL);
+
+    restore_ms=startup_time(workdir,DB_STARTUP_RESTORE);
+    lazy_ms=startup_time(workdir,DB_STARTUP_LAZY);
+    printf("%10d %14.2f %14.2f\n",sizes[n],restore_ms,lazy_ms);
+  }
+
+  free(samples);
+}
+
+int main(int argc, char *argv[]) {
+  char *benchmark = argc > 1 ? argv[1] : "insert";
+  char *workdir;
+
+  //Startup measures db_init itself
+  if(strcmp(benchmark,"startup")==0) {
+    bench_startup();
+    return 0;
+  }
+
+  workdir=bench_workdir();
+  if(db_init(workdir)) {
+    print_fatal("Could not init database\n");
+  }
+
+  if(strcmp(benchmark,"insert")==0) {
+    bench_insert();
+  }else if(strcmp(benchmark,"ingest")==0) {
+    bench_ingest();
+  }else if(strcmp(benchmark,"journal")==0) {
+    bench_journal();
+  }else if(strcmp(benchmark,"snapshot")==0) {
+    bench_snapshot();
+  }else if(strcmp(benchmark,"inflight")==0) {
+    bench_inflight();
+  }else if(strcmp(benchmark,"queue")==0) {
+    bench_queue();
+  }else if(strcmp(benchmark,"rows")==0) {
+    bench_rows();
+  }else if(strcmp(benchmark,"conf")==0) {
+    bench_conf();
+  }else if(strcmp(benchmark,"streams")==0) {
+    bench_streams(workdir);
+  }else{
+    print_error("Unknown benchmark: %s\n", benchmark);
+    return -1;
+  }
+
+  return 0;
+}
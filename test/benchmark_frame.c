@@ -0,0 +1,257 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include <mosquitto.h>
+#include "benchmark.h"
+
+int debug=0;
+
+#define BENCH_SAMPLES 100000
+#define BENCH_STREAMS 16
+#define BENCH_TOPIC "/device/benchmark/sample"
+
+typedef struct {
+  int len;
+  uint8_t *payload;
+} bench_message_t;
+
+//How the messages of an encoding are published
+typedef struct {
+  const char *name;
+  int qos;
+  int alias;              //Topic sent once, then only its alias
+  const char *content_type;
+} bench_publish_t;
+
+static volatile int acked=0;
+
+static void bench_publish_callback(struct mosquitto *mosq, void *userdata, int mid) {
+  acked++;
+}
+
+//Bytes of an MQTT v5 PUBLISH carrying len bytes plus its PUBACK. first is
+//the first message of the connection, which carries the aliased topic
+static size_t wire_size(bench_publish_t *publish, size_t len, int first) {
+  size_t topic = publish->alias && !first ? 0 : strlen(BENCH_TOPIC);
+  size_t properties=0, remaining, header=2, limit=128;
+
+  if(publish->alias) {
+    properties+=3;
+  }
+  if(publish->content_type) {
+    properties+=3+strlen(publish->content_type);
+  }
+  remaining=2+topic+(publish->qos > 0 ? 2 : 0)+1+properties+len;
+
+  //Fixed header is the type byte plus the remaining length as a varint
+  while(remaining >= limit && header < 5) {
+    header++;
+    limit*=128;
+  }
+
+  return header + remaining + (publish->qos > 0 ? 4 : 0);
+}
+
+//Legacy encoding, one message per sample as phoenix_mqtt_send_sample builds
+//it. Interned streams are sent as # and their id
+static int encode_legacy(phoenix_sample_t *samples, int num_samples, bench_message_t *messages, int intern) {
+  char code[64];
+  int i;
+
+  for(i=0;i<num_samples;i++) {
+    if(intern) {
+      sprintf(code,"#%d",samples[i].stream_id);
+    }else{
+      sprintf(code,"%s",db_stream_code(samples[i].stream_id));
+    }
+    messages[i].len=sizeof(long long)+sizeof(double)+strlen(code);
+    messages[i].payload=malloc(messages[i].len);
+    memcpy(messages[i].payload,&samples[i].timestamp,sizeof(long long));
+    memcpy(messages[i].payload+sizeof(long long),&samples[i].value,sizeof(double));
+    memcpy(messages[i].payload+sizeof(long long)+sizeof(double),code,strlen(code));
+  }
+
+  return num_samples;
+}
+
+//The announcements of the interned encoding, once per stream and connection
+static int encode_announcements(bench_message_t *messages, int *stream_ids, int num_streams) {
+  char msg[128];
+  int i;
+
+  for(i=0;i<num_streams;i++) {
+    messages[i].len=sprintf(msg,"%d %s",stream_ids[i],db_stream_code(stream_ids[i]));
+    messages[i].payload=(uint8_t *)strdup(msg);
+  }
+
+  return num_streams;
+}
+
+static int encode_frames(phoenix_sample_t *samples, int num_samples, bench_message_t *messages) {
+  frame_t frame;
+  int i=0, num_messages=0;
+
+  frame_init(&frame,FRAME_MAX_SIZE);
+  while(i < num_samples) {
+    frame_reset(&frame);
+    for(;i<num_samples && frame_add(&frame,&samples[i])==0;i++) {}
+
+    messages[num_messages].len=frame_size(&frame);
+    messages[num_messages].payload=malloc(frame_size(&frame));
+    frame_encode(&frame,messages[num_messages].payload,frame_size(&frame));
+    num_messages++;
+  }
+  frame_free(&frame);
+
+  return num_messages;
+}
+
+//Publish every message and wait until the last one is acked, or written
+//for QoS 0
+static double publish_all(struct mosquitto *mosq, bench_publish_t *publish, bench_message_t *messages, int num_messages) {
+  mosquitto_property *properties=NULL;
+  double start=now_ms();
+  int i;
+
+  if(publish->alias) {
+    mosquitto_property_add_int16(&properties,MQTT_PROP_TOPIC_ALIAS,MQTT_ALIAS_SAMPLE);
+  }
+  if(publish->content_type) {
+    mosquitto_property_add_string(&properties,MQTT_PROP_CONTENT_TYPE,publish->content_type);
+  }
+
+  acked=0;
+  for(i=0;i<num_messages;i++) {
+    mosquitto_publish_v5(mosq,NULL,publish->alias && i > 0 ? NULL : BENCH_TOPIC,messages[i].len,messages[i].payload,
+        publish->qos,false,properties);
+  }
+  while(acked < num_messages) {
+    usleep(100);
+  }
+  mosquitto_property_free_all(&properties);
+
+  return now_ms()-start;
+}
+
+//extra are messages sent once per connection, they count towards the bytes
+static void report(bench_publish_t *publish, bench_message_t *messages, int num_messages, bench_message_t *extra, int num_extra,
+    int num_samples, double ms) {
+  bench_publish_t once={.qos=1};
+  size_t payload=0, wire=0;
+  int i;
+
+  for(i=0;i<num_messages;i++) {
+    payload+=messages[i].len;
+    wire+=wire_size(publish,messages[i].len,i == 0);
+  }
+  for(i=0;i<num_extra;i++) {
+    payload+=extra[i].len;
+    wire+=wire_size(&once,extra[i].len,1);
+  }
+
+  printf("%10s %10d %14.2f %14.2f", publish->name, num_messages, (double)payload/num_samples, (double)wire/num_samples);
+  if(ms > 0) {
+    printf(" %12.0f %12.0f", num_messages/(ms/1000.0), num_samples/(ms/1000.0));
+  }
+  printf("\n");
+}
+
+//Compare bytes per sample of the per sample messages, with interned
+//streams and topic aliases, and of frames. With a broker host as argument
+//all are also published to measure throughput
+int main(int argc, char *argv[]) {
+  char workdir[64], code[64], content_type[128];
+  phoenix_sample_t *samples=calloc(sizeof(phoenix_sample_t),BENCH_SAMPLES);
+  bench_message_t *legacy=calloc(sizeof(bench_message_t),BENCH_SAMPLES);
+  bench_message_t *interned=calloc(sizeof(bench_message_t),BENCH_SAMPLES);
+  bench_message_t *frames=calloc(sizeof(bench_message_t),BENCH_SAMPLES);
+  bench_message_t announcements[BENCH_STREAMS];
+  bench_publish_t publish[]={
+    {.name="sample", .qos=1},
+    {.name="interned", .qos=1},
+    {.name="aliased", .qos=0, .alias=1},
+    {.name="frame", .qos=1, .content_type=content_type},
+  };
+  struct mosquitto *mosq=NULL;
+  long long timestamp=phoenix_get_timestamp();
+  double ms[4]={0};
+  int stream_ids[BENCH_STREAMS];
+  int i, num_legacy, num_interned, num_announcements, num_frames;
+
+  sprintf(workdir,"/tmp/phoenix_bench_XXXXXX");
+  if(mkdtemp(workdir)==NULL || db_init(workdir)) {
+    print_fatal("Could not init database\n");
+  }
+  sprintf(content_type,"%s; version=%d",MQTT_CONTENT_TYPE_FRAME,FRAME_VERSION);
+
+  //Registers polled every 100 ms, slowly changing analog values
+  for(i=0;i<BENCH_STREAMS;i++) {
+    sprintf(code,"plant.line1.modbus.holding_register.%d",i);
+    stream_ids[i]=db_stream_id(code);
+  }
+  for(i=0;i<BENCH_SAMPLES;i++) {
+    samples[i].id=i+1;
+    samples[i].stream_id=stream_ids[i%BENCH_STREAMS];
+    samples[i].timestamp=timestamp + (i/BENCH_STREAMS)*100;
+    samples[i].value=round(200.0+10.0*sin(i/(BENCH_STREAMS*50.0)))/10.0;
+  }
+
+  num_legacy=encode_legacy(samples,BENCH_SAMPLES,legacy,0);
+  num_interned=encode_legacy(samples,BENCH_SAMPLES,interned,1);
+  num_announcements=encode_announcements(announcements,stream_ids,BENCH_STREAMS);
+  num_frames=encode_frames(samples,BENCH_SAMPLES,frames);
+
+  if(argc > 1) {
+    mosquitto_lib_init();
+    mosq=mosquitto_new(NULL,true,NULL);
+    mosquitto_publish_callback_set(mosq,bench_publish_callback);
+    mosquitto_int_option(mosq,MOSQ_OPT_PROTOCOL_VERSION,MQTT_PROTOCOL_V5);
+    mosquitto_max_inflight_messages_set(mosq,WINDOW_INITIAL);
+    if(mosquitto_connect(mosq,argv[1],argc > 2 ? atoi(argv[2]) : 1883,60) != MOSQ_ERR_SUCCESS) {
+      print_fatal("Could not connect to %s\n", argv[1]);
+    }
+    mosquitto_loop_start(mosq);
+
+    ms[0]=publish_all(mosq,&publish[0],legacy,num_legacy);
+    ms[1]=publish_all(mosq,&publish[1],interned,num_interned);
+    ms[2]=publish_all(mosq,&publish[2],interned,num_interned);
+    ms[3]=publish_all(mosq,&publish[3],frames,num_frames);
+
+    mosquitto_disconnect(mosq);
+    mosquitto_loop_stop(mosq,false);
+    mosquitto_destroy(mosq);
+    mosquitto_lib_cleanup();
+  }
+
+  printf("%d samples, %d streams, frames of at most %d bytes\n", BENCH_SAMPLES, BENCH_STREAMS, FRAME_MAX_SIZE);
+  printf("%10s %10s %14s %14s", "encoding", "messages", "payload/sample", "wire/sample");
+  if(argc > 1) {
+    printf(" %12s %12s", "msgs/s", "samples/s");
+  }
+  printf("\n");
+  report(&publish[0],legacy,num_legacy,NULL,0,BENCH_SAMPLES,ms[0]);
+  report(&publish[1],interned,num_interned,announcements,num_announcements,BENCH_SAMPLES,ms[1]);
+  report(&publish[2],interned,num_interned,announcements,num_announcements,BENCH_SAMPLES,ms[2]);
+  report(&publish[3],frames,num_frames,NULL,0,BENCH_SAMPLES,ms[3]);
+
+  for(i=0;i<num_legacy;i++) {
+    free(legacy[i].payload);
+    free(interned[i].payload);
+  }
+  for(i=0;i<num_announcements;i++) {
+    free(announcements[i].payload);
+  }
+  for(i=0;i<num_frames;i++) {
+    free(frames[i].payload);
+  }
+  free(legacy);
+  free(interned);
+  free(frames);
+  free(samples);
+  db_close();
+
+  return 0;
+}
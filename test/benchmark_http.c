@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#include "../src/phoenix.h"
+
+int debug=0;
+
+#define HTTP_POSTS 300
+#define HTTP_SAMPLES_PER_POST 100
+
+/*
+ * HTTPS stand-in for the server: answers every POST with 200 and counts the
+ * bytes on the wire, TLS included
+ */
+typedef struct {
+  int listen_fd;
+  int port;
+  SSL_CTX *ctx;
+  volatile int run;
+  pthread_mutex_t mutex;
+  unsigned long long wire_bytes;
+  int connections;
+  int resumed;
+} server_t;
+
+//Self signed certificate for localhost, also the CA the client trusts
+static int server_certificate(SSL_CTX *ctx, const char *ca_file) {
+  EVP_PKEY *pkey=EVP_RSA_gen(2048);
+  X509 *x509=X509_new();
+  X509_EXTENSION *ext;
+  X509V3_CTX v3;
+  FILE *f;
+
+  ASN1_INTEGER_set(X509_get_serialNumber(x509),1);
+  X509_gmtime_adj(X509_getm_notBefore(x509),0);
+  X509_gmtime_adj(X509_getm_notAfter(x509),3600);
+  X509_set_pubkey(x509,pkey);
+  X509_NAME_add_entry_by_txt(X509_get_subject_name(x509),"CN",MBSTRING_ASC,(unsigned char *)"localhost",-1,-1,0);
+  X509_set_issuer_name(x509,X509_get_subject_name(x509));
+  X509V3_set_ctx(&v3,x509,x509,NULL,NULL,0);
+  ext=X509V3_EXT_conf_nid(NULL,&v3,NID_subject_alt_name,"DNS:localhost");
+  X509_add_ext(x509,ext,-1);
+  X509_EXTENSION_free(ext);
+  ext=X509V3_EXT_conf_nid(NULL,&v3,NID_basic_constraints,"critical,CA:TRUE");
+  X509_add_ext(x509,ext,-1);
+  X509_EXTENSION_free(ext);
+  X509_sign(x509,pkey,EVP_sha256());
+
+  if((f=fopen(ca_file,"w")) == NULL) {
+    return -1;
+  }
+  PEM_write_X509(f,x509);
+  fclose(f);
+
+  if(SSL_CTX_use_certificate(ctx,x509) != 1 || SSL_CTX_use_PrivateKey(ctx,pkey) != 1) {
+    return -1;
+  }
+  X509_free(x509);
+  EVP_PKEY_free(pkey);
+
+  return 0;
+}
+
+//Read one request, headers and Content-Length bytes of body. 0 on EOF
+static int server_request(SSL *ssl) {
+  char buffer[65536];
+  char *end, *length;
+  int len=0, n, content_length=0;
+
+  for(;;) {
+    if((n=SSL_read(ssl,buffer+len,sizeof(buffer)-1-len)) <= 0) {
+      return 0;
+    }
+    len+=n;
+    buffer[len]=0;
+    if((end=strstr(buffer,"\r\n\r\n")) != NULL) {
+      break;
+    }
+  }
+  if((length=strstr(buffer,"Content-Length:")) != NULL) {
+    content_length=atoi(length+15);
+  }
+  len-=(end+4-buffer);
+  while(len < content_length) {
+    if((n=SSL_read(ssl,buffer,sizeof(buffer))) <= 0) {
+      return 0;
+    }
+    len+=n;
+  }
+
+  return 1;
+}
+
+static void *server_thread(void *arg) {
+  const char *response="HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: 2\r\n\r\n{}";
+  server_t *server=arg;
+  struct pollfd pfd;
+  SSL *ssl;
+  BIO *bio;
+  int fd;
+
+  while(server->run) {
+    pfd.fd=server->listen_fd;
+    pfd.events=POLLIN;
+    if(poll(&pfd,1,100) != 1 || (fd=accept(server->listen_fd,NULL,NULL)) < 0) {
+      continue;
+    }
+
+    ssl=SSL_new(server->ctx);
+    SSL_set_fd(ssl,fd);
+    if(SSL_accept(ssl) == 1) {
+      pthread_mutex_lock(&server->mutex);
+      server->connections++;
+      server->resumed+=SSL_session_reused(ssl);
+      pthread_mutex_unlock(&server->mutex);
+
+      while(server_request(ssl)) {
+        SSL_write(ssl,response,strlen(response));
+      }
+    }
+
+    bio=SSL_get_rbio(ssl);
+    pthread_mutex_lock(&server->mutex);
+    server->wire_bytes+=BIO_number_read(bio)+BIO_number_written(bio);
+    pthread_mutex_unlock(&server->mutex);
+    SSL_free(ssl);
+    close(fd);
+  }
+
+  return NULL;
+}
+
+static int server_start(server_t *server, const char *ca_file) {
+  struct sockaddr_in addr;
+  socklen_t addr_len=sizeof(addr);
+
+  memset(server,0,sizeof(server_t));
+  pthread_mutex_init(&server->mutex,NULL);
+  server->ctx=SSL_CTX_new(TLS_server_method());
+  SSL_CTX_set_session_id_context(server->ctx,(const unsigned char *)"bench",5);
+  if(server_certificate(server->ctx,ca_file)) {
+    print_error("Could not create the server certificate\n");
+    return -1;
+  }
+
+  server->listen_fd=socket(AF_INET,SOCK_STREAM,0);
+  memset(&addr,0,sizeof(addr));
+  addr.sin_family=AF_INET;
+  addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+  if(bind(server->listen_fd,(struct sockaddr *)&addr,sizeof(addr)) || listen(server->listen_fd,16)) {
+    print_error("Could not listen\n");
+    return -1;
+  }
+  getsockname(server->listen_fd,(struct sockaddr *)&addr,&addr_len);
+  server->port=ntohs(addr.sin_port);
+  server->run=1;
+
+  return 0;
+}
+
+//A streams notification of HTTP_SAMPLES_PER_POST samples, as phoenix_http_send_samples() builds it
+static char *notification() {
+  char *msg=malloc(HTTP_SAMPLES_PER_POST*128+64);
+  int i, len;
+
+  len=sprintf(msg,"{\"notification\":\"streams\",\"parameters\":[");
+  for(i=0;i<HTTP_SAMPLES_PER_POST;i++) {
+    len+=sprintf(msg+len,"%s{\"code\":\"plant.line1.temperature.%d\",\"timestamp\":\"2024-01-01T00:00:%02d.%03dZ\",\"value\":%f}",
+        i ? "," : "", i%8, i%60, i, i*1.5);
+  }
+  sprintf(msg+len,"]}");
+
+  return msg;
+}
+
+#define RUN_PER_POST 0     //Everything new for every post, as before
+#define RUN_RECONNECT 1    //New connection every post, the TLS session resumed
+#define RUN_KEPT 2
+
+static const char *run_names[]={"per post","reconnect","kept handle"};
+
+//Posts per second and bytes on the wire per post
+static int run(phoenix_t *phoenix, server_t *server, int mode) {
+  http_stats_t stats;
+  pthread_t thread;
+  char *msg=notification();
+  double start, elapsed;
+  int i, failed=0;
+
+  server->wire_bytes=0;
+  server->connections=0;
+  server->resumed=0;
+  server->run=1;
+  pthread_create(&thread,NULL,server_thread,server);
+
+  memset(&phoenix->http->stats,0,sizeof(http_stats_t));
+  start=window_time_ms();
+  for(i=0;i<HTTP_POSTS;i++) {
+    if(mode == RUN_PER_POST) {
+      phoenix_http_close(phoenix);
+    }else if(mode == RUN_RECONNECT) {
+      phoenix_http_reset(phoenix);
+    }
+    failed+=phoenix_http_post(phoenix,msg,strlen(msg)) != 0;
+  }
+  elapsed=window_time_ms()-start;
+  phoenix_http_close(phoenix);
+  phoenix_http_stats(phoenix,&stats);
+
+  server->run=0;
+  pthread_join(thread,NULL);
+
+  printf("%14s %10.0f %12.0f %12.0f %12d %12d %8d\n", run_names[mode], HTTP_POSTS/(elapsed/1000.0),
+      (double)server->wire_bytes/HTTP_POSTS, (double)stats.bytes_sent/HTTP_POSTS, server->connections, server->resumed, failed);
+  free(msg);
+
+  return failed;
+}
+
+//Cost of the handle, connection and TLS handshake per HTTP post against a
+//local HTTPS server
+int main(int argc, char *argv[]) {
+  char workdir[64];
+  char ca_file[128];
+  server_t server;
+  phoenix_t *phoenix=calloc(sizeof(phoenix_t),1);
+  int failed=0;
+
+  sprintf(workdir,"/tmp/phoenix_bench_XXXXXX");
+  if(mkdtemp(workdir)==NULL || db_init(workdir)) {
+    print_fatal("Could not init database\n");
+  }
+  sprintf(ca_file,"%s/server.crt",workdir);
+  if(server_start(&server,ca_file)) {
+    return -1;
+  }
+
+  phoenix->device_id="benchmark_http";
+  phoenix->certificate_hash="0123456789abcdef";
+  phoenix->server=malloc(64);
+  sprintf(phoenix->server,"localhost:%d",server.port);
+  phoenix->http=calloc(sizeof(phoenix_http_t),1);
+  phoenix->http->scheme="https";
+  phoenix->http->ca_file=ca_file;
+
+  printf("%d posts of %d samples\n", HTTP_POSTS, HTTP_SAMPLES_PER_POST);
+  printf("%14s %10s %12s %12s %12s %12s %8s\n", "curl", "posts/s", "wire B/post", "http B/post", "connections", "tls resumed", "failed");
+  failed+=run(phoenix,&server,RUN_PER_POST);
+  failed+=run(phoenix,&server,RUN_RECONNECT);
+  failed+=run(phoenix,&server,RUN_KEPT);
+
+  close(server.listen_fd);
+  SSL_CTX_free(server.ctx);
+  db_close();
+
+  return failed ? -1 : 0;
+}
@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "benchmark.h"
+
+int debug=0;
+
+#define JSON_SAMPLES 100000
+#define JSON_ROUNDS 5
+#define JSON_DOUBLES 1000000
+
+//As phoenix_http_send_samples() built the body before notification.c
+static char *json_c_encode(phoenix_sample_t *samples, int num_samples) {
+  struct json_object *notification, *parameters, *sample;
+  char *json_str;
+  char ts[100];
+  int i;
+
+  notification=json_object_new_object();
+  parameters=json_object_new_array();
+  json_object_object_add(notification,"notification",json_object_new_string("streams"));
+  json_object_object_add(notification,"parameters",parameters);
+
+  for(i=0;i<num_samples;i++) {
+    sample=json_object_new_object();
+    getRFC3339(samples[i].timestamp,ts);
+    json_object_object_add(sample,"code",json_object_new_string(db_stream_code(samples[i].stream_id)));
+    json_object_object_add(sample,"timestamp",json_object_new_string(ts));
+    json_object_object_add(sample,"value",json_object_new_double(samples[i].value));
+    json_object_array_add(parameters,sample);
+  }
+
+  json_str=strdup(json_object_to_json_string_ext(notification,JSON_C_TO_STRING_PLAIN));
+  json_object_put(notification);
+
+  return json_str;
+}
+
+//Both bodies parse to the same codes, timestamps and values
+static int compare(const char *expected, const char *body, int num_samples) {
+  struct json_object *a=json_tokener_parse(expected), *b=json_tokener_parse(body);
+  struct json_object *pa, *pb, *sa, *sb, *va, *vb;
+  const char *keys[]={"code","timestamp"};
+  int i, k, errors=0;
+
+  if(b == NULL || !json_object_object_get_ex(a,"parameters",&pa) || !json_object_object_get_ex(b,"parameters",&pb) ||
+      json_object_array_length(pb) != num_samples) {
+    print_error("Body does not parse to %d samples\n", num_samples);
+    errors++;
+    goto cleanup;
+  }
+
+  for(i=0;i<num_samples && errors<10;i++) {
+    sa=json_object_array_get_idx(pa,i);
+    sb=json_object_array_get_idx(pb,i);
+    for(k=0;k<2;k++) {
+      json_object_object_get_ex(sa,keys[k],&va);
+      json_object_object_get_ex(sb,keys[k],&vb);
+      if(vb == NULL || strcmp(json_object_get_string(va),json_object_get_string(vb))) {
+        print_error("Sample %d %s: %s, json-c %s\n", i, keys[k], vb ? json_object_get_string(vb) : "missing", json_object_get_string(va));
+        errors++;
+      }
+    }
+    json_object_object_get_ex(sa,"value",&va);
+    json_object_object_get_ex(sb,"value",&vb);
+    if(vb == NULL || json_object_get_double(va) != json_object_get_double(vb)) {
+      print_error("Sample %d value: %s, json-c %s\n", i, vb ? json_object_to_json_string(vb) : "missing", json_object_to_json_string(va));
+      errors++;
+    }
+  }
+
+cleanup:
+  json_object_put(a);
+  json_object_put(b);
+
+  return errors;
+}
+
+//Every double printed reads back as itself
+static int test_doubles() {
+  char out[32];
+  double value;
+  uint64_t bits;
+  int i, errors=0;
+
+  srand(1);
+  for(i=0;i<JSON_DOUBLES && errors<10;i++) {
+    switch(i%3) {
+      case 0:
+        bits=(uint64_t)rand() << 62 ^ (uint64_t)rand() << 31 ^ rand();
+        memcpy(&value,&bits,sizeof(value));
+        break;
+      case 1:
+        value=(rand()%2000000-1000000)/1000.0;
+        break;
+      default:
+        value=(double)rand()/RAND_MAX;
+    }
+    if(isnan(value) || isinf(value)) {
+      continue;
+    }
+    out[notification_double(out,value)]=0;
+    if(strtod(out,NULL) != value || strpbrk(out,".eE") == NULL) {
+      print_error("%.17g printed as %s\n", value, out);
+      errors++;
+    }
+  }
+
+  return errors;
+}
+
+//CPU time per batch and sample for the json-c tree and notification.c
+static int run(phoenix_sample_t *samples, int batch) {
+  notification_t notification;
+  double start, json_c_ms, stream_ms;
+  size_t json_c_bytes=0;
+  char *body;
+  int i, round, errors=0;
+
+  memset(&notification,0,sizeof(notification));
+
+  //Same content first
+  for(i=0;i+batch<=JSON_SAMPLES;i+=batch) {
+    body=json_c_encode(samples+i,batch);
+    notification_streams(&notification,samples+i,batch);
+    json_c_bytes+=strlen(body);
+    errors+=compare(body,notification.data,batch);
+    free(body);
+  }
+
+  start=cpu_ms();
+  for(round=0;round<JSON_ROUNDS;round++) {
+    for(i=0;i+batch<=JSON_SAMPLES;i+=batch) {
+      free(json_c_encode(samples+i,batch));
+    }
+  }
+  json_c_ms=cpu_ms()-start;
+
+  start=cpu_ms();
+  for(round=0;round<JSON_ROUNDS;round++) {
+    for(i=0;i+batch<=JSON_SAMPLES;i+=batch) {
+      notification_streams(&notification,samples+i,batch);
+    }
+  }
+  stream_ms=cpu_ms()-start;
+
+  printf("%8d %12s %12.1f %10.0f %10.1f\n", batch, "json-c", json_c_ms*1000.0/(JSON_ROUNDS*(JSON_SAMPLES/batch)),
+      json_c_ms*1000000.0/(JSON_ROUNDS*JSON_SAMPLES), (double)json_c_bytes/JSON_SAMPLES);
+  printf("%8d %12s %12.1f %10.0f %10.1f %7.1fx\n", batch, "notification", stream_ms*1000.0/(JSON_ROUNDS*(JSON_SAMPLES/batch)),
+      stream_ms*1000000.0/(JSON_ROUNDS*JSON_SAMPLES), (double)notification.len/batch, json_c_ms/stream_ms);
+  notification_free(&notification);
+
+  return errors;
+}
+
+//The streams notification built as a json-c tree against written straight
+//into a buffer, at the HTTP batch size and at 10k samples per batch
+int main(int argc, char *argv[]) {
+  char workdir[64];
+  phoenix_sample_t *samples=calloc(sizeof(phoenix_sample_t),JSON_SAMPLES);
+  int errors=0;
+
+  sprintf(workdir,"/tmp/phoenix_bench_XXXXXX");
+  if(mkdtemp(workdir)==NULL || db_init(workdir)) {
+    print_fatal("Could not init database\n");
+  }
+  trace_generate(samples,JSON_SAMPLES,3);
+
+  errors+=test_doubles();
+
+  printf("%d samples, %d rounds\n", JSON_SAMPLES, JSON_ROUNDS);
+  printf("%8s %12s %12s %10s %10s %8s\n", "batch", "encoder", "us/batch", "ns/sample", "B/sample", "speedup");
+  errors+=run(samples,MAX_SAMPLES_TO_SEND);
+  errors+=run(samples,10000);
+
+  free(samples);
+  db_close();
+
+  if(errors) {
+    print_error("%d encoding errors\n", errors);
+    return -1;
+  }
+
+  return 0;
+}
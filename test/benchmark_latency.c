@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../src/phoenix.h"
+
+int debug=0;
+
+#define LATENCY_MAX_SAMPLES 100000
+#define LATENCY_STREAMS 8
+
+typedef struct {
+  int event_driven;
+  volatile int run;
+  int num_latencies;
+  long long latencies[LATENCY_MAX_SAMPLES];
+  int wakeups;
+  int idle_wakeups;
+} uploader_t;
+
+static int compare_latency(const void *a, const void *b) {
+  long long x=*(const long long *)a, y=*(const long long *)b;
+  return x < y ? -1 : x > y;
+}
+
+//The uploader loop of connection_handler without the network: every
+//sample read is marked sent and its queue time recorded
+static void *uploader_thread(void *arg) {
+  uploader_t *uploader=arg;
+  phoenix_sample_t samples[MAX_SAMPLES_TO_SEND];
+  int64_t ids[MAX_SAMPLES_TO_SEND];
+  long long now;
+  int i, num_samples, backlog=1;
+
+  while(uploader->run) {
+    num_samples=db_samples_read(samples,MAX_SAMPLES_TO_SEND);
+    now=phoenix_get_timestamp();
+    for(i=0;i<num_samples;i++) {
+      if(uploader->num_latencies < LATENCY_MAX_SAMPLES) {
+        uploader->latencies[uploader->num_latencies++]=now-samples[i].timestamp;
+      }
+      ids[i]=samples[i].id;
+    }
+    db_samples_sent(ids,num_samples,1);
+    backlog = num_samples == MAX_SAMPLES_TO_SEND;
+
+    if(uploader->event_driven) {
+      connection_wait(NULL,backlog);
+    }else{
+      sleep(1);
+    }
+    uploader->wakeups++;
+    if(num_samples == 0) {
+      uploader->idle_wakeups++;
+    }
+  }
+
+  return NULL;
+}
+
+//Samples arrive at random, rate per second on average, for seconds.
+//Then nothing for idle_seconds
+static void run(uploader_t *uploader, int rate, int seconds, int idle_seconds) {
+  char code[64];
+  pthread_t thread;
+  long long end=phoenix_get_timestamp()+seconds*1000LL;
+  int idle_wakeups, wakeups;
+
+  uploader->run=1;
+  pthread_create(&thread,NULL,uploader_thread,uploader);
+
+  while(phoenix_get_timestamp() < end) {
+    sprintf(code,"bench.latency.%d",rand()%LATENCY_STREAMS);
+    phoenix_send_sample(NULL,phoenix_get_timestamp(),(unsigned char *)code,rand()*1.0);
+    usleep(rand() % (2000000/rate));
+  }
+
+  //Let the last samples go out before counting idle wakeups
+  sleep(2);
+  wakeups=uploader->wakeups;
+  idle_wakeups=uploader->idle_wakeups;
+  sleep(idle_seconds);
+  idle_wakeups=uploader->idle_wakeups-idle_wakeups;
+  wakeups=uploader->wakeups-wakeups;
+
+  uploader->run=0;
+  connection_wakeup();
+  pthread_join(thread,NULL);
+
+  qsort(uploader->latencies,uploader->num_latencies,sizeof(long long),compare_latency);
+  printf("%14s %8d %8lld %8lld %16.1f\n", uploader->event_driven ? "event driven" : "sleep(1)", uploader->num_latencies,
+      uploader->num_latencies ? uploader->latencies[uploader->num_latencies/2] : 0,
+      uploader->num_latencies ? uploader->latencies[uploader->num_latencies*99/100] : 0,
+      idle_wakeups*60.0/idle_seconds);
+  (void)wakeups;
+}
+
+//Sample to publish latency and idle wakeups of the sleep(1) loop against
+//the event driven one. Arguments: samples per second, busy and idle seconds
+int main(int argc, char *argv[]) {
+  char workdir[64];
+  uploader_t *uploader=calloc(sizeof(uploader_t),1);
+  int rate = argc > 1 ? atoi(argv[1]) : 50;
+  int seconds = argc > 2 ? atoi(argv[2]) : 10;
+  int idle_seconds = argc > 3 ? atoi(argv[3]) : 10;
+
+  sprintf(workdir,"/tmp/phoenix_bench_XXXXXX");
+  if(mkdtemp(workdir)==NULL || db_init(workdir)) {
+    print_fatal("Could not init database\n");
+  }
+
+  printf("%d samples/s for %d s, then idle for %d s\n", rate, seconds, idle_seconds);
+  printf("%14s %8s %8s %8s %16s\n", "uploader", "samples", "p50 ms", "p99 ms", "idle wakeups/min");
+
+  run(uploader,rate,seconds,idle_seconds);
+
+  memset(uploader,0,sizeof(uploader_t));
+  uploader->event_driven=1;
+  run(uploader,rate,seconds,idle_seconds);
+
+  free(uploader);
+  db_close();
+
+  return 0;
+}
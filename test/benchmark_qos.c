@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <mosquitto.h>
+#include "../src/phoenix.h"
+
+int debug=0;
+
+#define QOS_SAMPLES 100000
+#define QOS_STREAMS 16
+
+static int stream_ids[QOS_STREAMS];
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+//Bookkeeping a QoS 1 or 2 sample costs on the device besides the publish:
+//stored, read back, kept in flight under its message id and removed on the
+//ack. QoS 0 samples skip all of it
+static double store_and_forward_ns() {
+  phoenix_sample_t samples[MAX_SAMPLES_TO_SEND];
+  long long timestamp=phoenix_get_timestamp();
+  double start;
+  int i, n, mid=0, num_samples;
+
+  start=now_ns();
+  for(n=0;n<QOS_SAMPLES;n+=MAX_SAMPLES_TO_SEND) {
+    for(i=0;i<MAX_SAMPLES_TO_SEND;i++) {
+      db_sample_insert_stream(stream_ids[i%QOS_STREAMS],timestamp+n+i,i*1.0);
+    }
+    num_samples=db_samples_read(samples,MAX_SAMPLES_TO_SEND);
+    for(i=0;i<num_samples;i++) {
+      inflight_add(++mid,samples[i].id);
+    }
+    for(i=0;i<num_samples;i++) {
+      inflight_ack(mid-i,0);
+    }
+    inflight_flush();
+  }
+
+  return (now_ns()-start)/n;
+}
+
+static void broker_publish_callback(struct mosquitto *mosq, void *userdata, int mid) {
+  window_acked(mid,window_time_ms());
+  (*(volatile int *)userdata)++;
+}
+
+//Messages per second at one QoS. QoS 0 is done when libmosquitto has
+//written the message, 1 and 2 when the broker acked it
+static double broker_rate(struct mosquitto *mosq, volatile int *done, int qos) {
+  char payload[64];
+  double start;
+  int sent=0, mid;
+
+  memset(payload,0,sizeof(payload));
+  sprintf(payload+16,"plant.line1.qos%d",qos);
+
+  *done=0;
+  window_reset();
+  start=now_ns();
+  while(*done < QOS_SAMPLES) {
+    if(sent < QOS_SAMPLES && (qos == 0 || window_room() > 0)) {
+      if(mosquitto_publish(mosq,&mid,"/device/bench_qos/sample",sizeof(payload),payload,qos,false) == MOSQ_ERR_SUCCESS) {
+        if(qos > 0) {
+          window_sent(mid,window_time_ms());
+        }
+        sent++;
+      }
+    }else{
+      usleep(100);
+    }
+  }
+
+  return QOS_SAMPLES/((now_ns()-start)/1e9);
+}
+
+static int broker_rates(const char *host, int port) {
+  struct mosquitto *mosq;
+  volatile int done=0;
+  int qos;
+
+  mosquitto_lib_init();
+  mosq=mosquitto_new(NULL,true,(void *)&done);
+  mosquitto_publish_callback_set(mosq,broker_publish_callback);
+  mosquitto_max_inflight_messages_set(mosq,WINDOW_MAX);
+  if(mosquitto_connect(mosq,host,port,60) != MOSQ_ERR_SUCCESS) {
+    print_error("Could not connect to %s:%d\n", host, port);
+    return -1;
+  }
+  mosquitto_loop_start(mosq);
+
+  printf("%8s %12s\n","qos","msgs/s");
+  for(qos=0;qos<=2;qos++) {
+    printf("%8d %12.0f\n",qos,broker_rate(mosq,&done,qos));
+  }
+
+  mosquitto_disconnect(mosq);
+  mosquitto_loop_stop(mosq,false);
+  mosquitto_destroy(mosq);
+  mosquitto_lib_cleanup();
+
+  return 0;
+}
+
+//Device side cost of the store and forward classes. With a broker host as
+//argument also the publish rate per QoS over a real connection
+int main(int argc, char *argv[]) {
+  char workdir[64];
+  char code[64];
+  int i;
+
+  sprintf(workdir,"/tmp/phoenix_bench_XXXXXX");
+  if(mkdtemp(workdir)==NULL || db_init(workdir)) {
+    print_fatal("Could not init database\n");
+  }
+  for(i=0;i<QOS_STREAMS;i++) {
+    sprintf(code,"plant.line1.qos.%d",i);
+    stream_ids[i]=db_stream_id(code);
+  }
+
+  printf("%24s %12s\n","class","ns/sample");
+  printf("%24s %12.1f\n","store and forward",store_and_forward_ns());
+  printf("%24s %12s\n","fire and forget","0");
+
+  if(argc > 1 && broker_rates(argv[1],argc > 2 ? atoi(argv[2]) : 1883)) {
+    db_close();
+    return -1;
+  }
+
+  db_close();
+  return 0;
+}
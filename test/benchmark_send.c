@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../src/phoenix.h"
+
+int debug=0;
+
+#define SEND_SAMPLES 1000000
+#define SEND_STREAMS 16
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+//Time the send path only, the ring is sized to hold every sample so the
+//drainer never blocks the producer
+int main(int argc, char *argv[]) {
+  char workdir[64];
+  char codes[SEND_STREAMS][64];
+  phoenix_stream_t *streams[SEND_STREAMS];
+  long long timestamp=phoenix_get_timestamp();
+  double start,string_ns,handle_ns;
+  int i;
+
+  sprintf(workdir,"/tmp/phoenix_bench_XXXXXX");
+  if(mkdtemp(workdir)==NULL || db_init(workdir)) {
+    print_fatal("Could not init database\n");
+  }
+
+  for(i=0;i<SEND_STREAMS;i++) {
+    sprintf(codes[i],"plant.line1.modbus.holding_register.%d",i);
+    streams[i]=phoenix_stream_register(NULL,codes[i],NULL);
+  }
+
+  ingest_init(SEND_SAMPLES,INGEST_OVERFLOW_SPILL);
+  start=now_ns();
+  for(i=0;i<SEND_SAMPLES;i++) {
+    phoenix_send_sample(NULL,timestamp+i,(unsigned char *)codes[i%SEND_STREAMS],i*1.0);
+  }
+  string_ns=(now_ns()-start)/SEND_SAMPLES;
+  ingest_close();
+
+  ingest_init(SEND_SAMPLES,INGEST_OVERFLOW_SPILL);
+  start=now_ns();
+  for(i=0;i<SEND_SAMPLES;i++) {
+    phoenix_send_sample_h(streams[i%SEND_STREAMS],timestamp+i,i*1.0);
+  }
+  handle_ns=(now_ns()-start)/SEND_SAMPLES;
+  ingest_close();
+
+  printf("%24s %12s\n","api","ns/sample");
+  printf("%24s %12.1f\n","phoenix_send_sample",string_ns);
+  printf("%24s %12.1f\n","phoenix_send_sample_h",handle_ns);
+
+  for(i=0;i<SEND_STREAMS;i++) {
+    phoenix_stream_free(streams[i]);
+  }
+  db_close();
+
+  return 0;
+}
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <math.h>
+#include <sys/epoll.h>
+
+#include "../src/phoenix.h"
+
+int do_run=1;
+int debug=0;
+
+void signal_handler(int signo) {
+  do_run=0;
+}
+
+//Keep the registration in step with the socket and the events the library wants
+static int watch(int epoll_fd, phoenix_t *phoenix, int *fd, int *events) {
+  struct epoll_event event;
+  int new_fd=phoenix_io_fd(phoenix);
+  int new_events=phoenix_io_events(phoenix);
+
+  if(new_fd == *fd && new_events == *events) {
+    return 0;
+  }
+
+  if(*fd >= 0 && new_fd != *fd) {
+    epoll_ctl(epoll_fd,EPOLL_CTL_DEL,*fd,NULL);
+    *fd=-1;
+  }
+
+  memset(&event,0,sizeof(event));
+  event.events = (new_events & PHOENIX_IO_READ ? EPOLLIN : 0) | (new_events & PHOENIX_IO_WRITE ? EPOLLOUT : 0);
+  if(new_fd >= 0 && epoll_ctl(epoll_fd, *fd < 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, new_fd, &event)) {
+    print_error("Could not watch socket %d\n", new_fd);
+    return -1;
+  }
+
+  *fd=new_fd;
+  *events=new_events;
+  return 0;
+}
+
+//Reference device on a single threaded epoll loop, the library starts no
+//threads of its own for the connection
+int main(int argc, char *argv[]) {
+  char *host = argc > 1 ? argv[1] : "127.0.0.1";
+  int port = argc > 2 ? atoi(argv[2]) : 1883;
+  int use_tls = argc > 3 ? atoi(argv[3]) : 0;
+  struct epoll_event ready;
+  long long now, next_sample;
+  int i=0, epoll_fd, fd=-1, events=0, timeout;
+  phoenix_t *phoenix;
+
+  db_init("./test");
+  phoenix = phoenix_init_external(host,port,use_tls,"reference_device");
+
+  epoll_fd=epoll_create1(0);
+  signal(SIGINT, signal_handler);
+
+  now=phoenix_get_timestamp();
+  next_sample=now - now%1000 + 1000;
+
+  while(do_run) {
+    if(watch(epoll_fd,phoenix,&fd,&events)) {
+      break;
+    }
+
+    now=phoenix_get_timestamp();
+    timeout=phoenix_next_timeout(phoenix);
+    if(next_sample - now < timeout) {
+      timeout = next_sample > now ? next_sample - now : 0;
+    }
+
+    if(epoll_wait(epoll_fd,&ready,1,timeout) == 1) {
+      phoenix_process_io(phoenix,
+          (ready.events & (EPOLLIN|EPOLLHUP|EPOLLERR) ? PHOENIX_IO_READ : 0) |
+          (ready.events & EPOLLOUT ? PHOENIX_IO_WRITE : 0));
+    }
+
+    now=phoenix_get_timestamp();
+    if(now >= next_sample) {
+      phoenix_send_sample(phoenix,next_sample,"test.inc",i*1.0);
+      phoenix_send_sample(phoenix,next_sample,"test.ref_value",cos(next_sample/200000.0) * sin(next_sample/300000.0));
+      next_sample+=1000;
+      i++;
+    }
+
+    phoenix_process_timers(phoenix);
+  }
+
+  print_info("Sent %d samples per stream\n", i);
+
+  phoenix_close(phoenix);
+  db_close();
+
+  return 0;
+}
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <mosquitto.h>
+#include "../src/phoenix.h"
+
+int debug=0;
+
+#define COMMAND_TEST_SECONDS 3
+#define COMMAND_TEST_RATE 1000
+#define COMMAND_TEST_INTERVAL_MS 500
+#define COMMAND_TEST_DURATION_MS 200
+#define COMMAND_TEST_SLOW 0x7001
+#define COMMAND_TEST_MAX_LATENCIES (COMMAND_TEST_SECONDS*COMMAND_TEST_RATE*2)
+
+typedef struct {
+  int queued;
+  volatile int run;
+  int num_latencies;
+  long long latencies[COMMAND_TEST_MAX_LATENCIES];
+  int commands;
+} network_t;
+
+static volatile int slow_executed=0;
+
+static int compare_latency(const void *a, const void *b) {
+  long long x=*(const long long *)a, y=*(const long long *)b;
+  return x < y ? -1 : x > y;
+}
+
+//A command that takes its time, as a firmware download or a reboot would
+static void command_slow(phoenix_t *phoenix, uint8_t *payload, int payload_len, struct mosquitto_message **response) {
+  db_double_get("conf_double","database_version");
+  usleep(COMMAND_TEST_DURATION_MS*1000);
+  __sync_fetch_and_add(&slow_executed,1);
+}
+
+static int command_message(uint8_t *message, uint64_t id, command_type_t cmd) {
+  int i;
+
+  for(i=0;i<8;i++) {
+    message[i]=id >> (56-i*8);
+  }
+  message[8]=cmd >> 8;
+  message[9]=cmd & 0xff;
+  message[10]=0;
+  message[11]=4;
+  memcpy(message+12,"test",4);
+
+  return 16;
+}
+
+//Stands in for the mosquitto network thread: samples are delivered from the
+//store as their acks would be, and a command arrives every
+//COMMAND_TEST_INTERVAL_MS. Either run right there, as before, or queued
+static void *network_thread(void *arg) {
+  network_t *network=arg;
+  phoenix_sample_t samples[MAX_SAMPLES_TO_SEND];
+  int64_t ids[MAX_SAMPLES_TO_SEND];
+  uint8_t message[64];
+  long long now, next_command=phoenix_get_timestamp();
+  int i, len, num_samples=0;
+
+  //Runs until the last sample is delivered
+  while(network->run || num_samples > 0) {
+    num_samples=db_samples_read(samples,MAX_SAMPLES_TO_SEND);
+    now=phoenix_get_timestamp();
+    for(i=0;i<num_samples;i++) {
+      if(network->num_latencies < COMMAND_TEST_MAX_LATENCIES) {
+        network->latencies[network->num_latencies++]=now-samples[i].timestamp;
+      }
+      ids[i]=samples[i].id;
+    }
+    db_samples_sent(ids,num_samples,1);
+
+    if(network->run && now >= next_command) {
+      len=command_message(message,++network->commands,COMMAND_TEST_SLOW);
+      if(network->queued) {
+        command_submit(NULL,message,len);
+      }else{
+        command_slow(NULL,message+12,len-12,NULL);
+      }
+      next_command+=COMMAND_TEST_INTERVAL_MS;
+    }
+    usleep(1000);
+  }
+
+  return NULL;
+}
+
+static long long run(network_t *network) {
+  pthread_t thread;
+  long long end=phoenix_get_timestamp()+COMMAND_TEST_SECONDS*1000LL;
+  long long p99;
+
+  network->run=1;
+  pthread_create(&thread,NULL,network_thread,network);
+
+  while(phoenix_get_timestamp() < end) {
+    phoenix_send_sample(NULL,phoenix_get_timestamp(),(unsigned char *)"test.command",1.0);
+    usleep(1000000/COMMAND_TEST_RATE);
+  }
+
+  network->run=0;
+  pthread_join(thread,NULL);
+
+  qsort(network->latencies,network->num_latencies,sizeof(long long),compare_latency);
+  p99 = network->num_latencies ? network->latencies[network->num_latencies*99/100] : 0;
+  printf("%10s %8d %8d %8lld %8lld %8lld\n", network->queued ? "queued" : "inline", network->num_latencies, network->commands,
+      network->num_latencies ? network->latencies[network->num_latencies/2] : 0, p99,
+      network->num_latencies ? network->latencies[network->num_latencies-1] : 0);
+
+  return p99;
+}
+
+static int test_registry() {
+  uint8_t message[64];
+  command_stats_t stats;
+  int errors=0, len;
+
+  //Unknown commands are counted, removed handlers are unknown
+  len=command_message(message,1,COMMAND_TEST_SLOW+1);
+  command_submit(NULL,message,len);
+  phoenix_command_register(COMMAND_TEST_SLOW,command_slow);
+  phoenix_command_register(COMMAND_TEST_SLOW,NULL);
+  len=command_message(message,2,COMMAND_TEST_SLOW);
+  command_submit(NULL,message,len);
+  command_process(10);
+
+  //Truncated messages never reach the queue
+  command_submit(NULL,message,len-1);
+
+  command_stats(&stats);
+  if(stats.unknown != 2 || stats.dropped != 1 || stats.queued != 0) {
+    print_error("%llu unknown, %llu dropped, %d queued\n", (unsigned long long)stats.unknown, (unsigned long long)stats.dropped, stats.queued);
+    errors++;
+  }
+
+  return errors;
+}
+
+//Sample delivery latency with slow commands run on the network thread and
+//with them queued for the workers
+int main(int argc, char *argv[]) {
+  char workdir[64];
+  network_t *network=calloc(sizeof(network_t),1);
+  long long inline_p99, queued_p99;
+  int errors=0;
+
+  sprintf(workdir,"/tmp/phoenix_command_XXXXXX");
+  if(mkdtemp(workdir)==NULL || db_init(workdir)) {
+    print_fatal("Could not init database\n");
+  }
+
+  errors+=test_registry();
+
+  phoenix_command_register(COMMAND_TEST_SLOW,command_slow);
+  printf("%d ms commands every %d ms\n", COMMAND_TEST_DURATION_MS, COMMAND_TEST_INTERVAL_MS);
+  printf("%10s %8s %8s %8s %8s %8s\n", "commands", "samples", "commands", "p50 ms", "p99 ms", "max ms");
+
+  inline_p99=run(network);
+
+  memset(network,0,sizeof(network_t));
+  network->queued=1;
+  slow_executed=0;
+  command_start();
+  queued_p99=run(network);
+  command_stop();
+
+  if(queued_p99 > 50 || queued_p99*4 > inline_p99) {
+    print_error("p99 %lld ms with queued commands, %lld ms inline\n", queued_p99, inline_p99);
+    errors++;
+  }
+  if(slow_executed < network->commands-COMMAND_WORKERS) {
+    print_error("%d of %d commands executed\n", slow_executed, network->commands);
+    errors++;
+  }
+
+  free(network);
+  db_close();
+
+  if(errors) {
+    print_error("%d command errors\n", errors);
+    return -1;
+  }
+
+  print_info("Command tests passed\n");
+  return 0;
+}
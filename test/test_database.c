@@ -118,7 +118,7 @@ int main(int argc, char *argv[]){
   print_info("Reading samples from database\n");
   num_samples=db_samples_read(samples, 10);
   for(i=0;i<num_samples;i++){
-    print_info("Sample: %s -> %lld -> %f\n", samples[i].stream,samples[i].timestamp, samples[i].value);
+    print_info("Sample: %s -> %lld -> %f\n", db_stream_code(samples[i].stream_id),samples[i].timestamp, samples[i].value);
   }
 
   free(samples);
@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "../src/phoenix.h"
+
+int debug=0;
+
+#define TEST_SAMPLES 5000
+
+typedef struct {
+  phoenix_sample_t *samples;
+  int index;
+  int errors;
+} decode_check_t;
+
+static void check_sample(const char *stream, long long timestamp, double value, void *arg) {
+  decode_check_t *check=arg;
+  phoenix_sample_t *expected=&check->samples[check->index++];
+
+  if(strcmp(stream,db_stream_code(expected->stream_id)) != 0 || timestamp != expected->timestamp ||
+      memcmp(&value,&expected->value,sizeof(value)) != 0) {
+    print_error("Sample %d: got %s %lld %f, expected %s %lld %f\n", check->index-1, stream, timestamp, value,
+        db_stream_code(expected->stream_id), expected->timestamp, expected->value);
+    check->errors++;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  char workdir[64], stream[64];
+  phoenix_sample_t *samples=calloc(sizeof(phoenix_sample_t),TEST_SAMPLES);
+  decode_check_t check={0};
+  uint8_t buffer[FRAME_MAX_SIZE], *compressed;
+  frame_t frame;
+  long long timestamp=phoenix_get_timestamp();
+  int i,first,len,compressed_len,num_frames=0,errors=0;
+
+  sprintf(workdir,"/tmp/phoenix_test_XXXXXX");
+  if(mkdtemp(workdir)==NULL || db_init(workdir)) {
+    print_fatal("Could not init database\n");
+  }
+
+  //Repeated, slowly changing, integer, negative and special values, and
+  //timestamps that go backwards
+  for(i=0;i<TEST_SAMPLES;i++) {
+    sprintf(stream,"test.frame.%d",i%7);
+    samples[i].id=i+1;
+    samples[i].stream_id=db_stream_id(stream);
+    samples[i].timestamp = timestamp - (i%3==2 ? 5000 : 0) + i*100;
+    switch(i%5) {
+      case 0: samples[i].value=20.0; break;
+      case 1: samples[i].value=20.0+sin(i/100.0); break;
+      case 2: samples[i].value=i; break;
+      case 3: samples[i].value=-i*1e-9; break;
+      case 4: samples[i].value = i%2 ? NAN : INFINITY; break;
+    }
+  }
+
+  frame_init(&frame,sizeof(buffer));
+  for(first=0;first<TEST_SAMPLES;first=i) {
+    frame_reset(&frame);
+    for(i=first;i<TEST_SAMPLES && frame_add(&frame,&samples[i])==0;i++) {}
+
+    len=frame_encode(&frame,buffer,sizeof(buffer));
+    if(len < 0 || len != frame_size(&frame)) {
+      print_error("Frame size %d, expected %zu\n", len, frame_size(&frame));
+      errors++;
+    }
+
+    check.samples=&samples[first];
+    check.index=0;
+    if(frame_decode(buffer,len,check_sample,&check) != i-first) {
+      print_error("Frame %d did not decode %d samples\n", num_frames, i-first);
+      errors++;
+    }
+    num_frames++;
+  }
+  errors+=check.errors;
+
+  //Compressed with a dictionary, the receiver needs the same dictionary
+  compress_set(6,0);
+  compress_dictionary_set((const uint8_t *)"test.frame.",strlen("test.frame."));
+  compressed_len=frame_encode_compressed(&frame,&compressed);
+  check.samples=&samples[first-frame.num_samples];
+  check.index=0;
+  check.errors=0;
+  if(compressed_len >= len || compressed[1] != 'Z' ||
+      frame_decode(compressed,compressed_len,check_sample,&check) != frame.num_samples || check.errors) {
+    print_error("Compressed frame of %d bytes did not decode\n", compressed_len);
+    errors++;
+  }
+  compress_dictionary_set((const uint8_t *)"other",strlen("other"));
+  if(frame_decode(compressed,compressed_len,check_sample,&check) >= 0) {
+    print_error("Compressed frame decoded with the wrong dictionary\n");
+    errors++;
+  }
+  compress_set(0,COMPRESS_THRESHOLD);
+  free(compressed);
+
+  //Unknown versions and truncated frames are rejected
+  buffer[2]=FRAME_VERSION+1;
+  if(frame_decode(buffer,len,check_sample,&check) >= 0) {
+    print_error("Frame with unknown version decoded\n");
+    errors++;
+  }
+  buffer[2]=FRAME_VERSION;
+  check.index=0;
+  if(frame_decode(buffer,len/2,check_sample,&check) >= 0) {
+    print_error("Truncated frame decoded\n");
+    errors++;
+  }
+
+  frame_free(&frame);
+  free(samples);
+  db_close();
+
+  if(errors) {
+    print_error("%d frame errors\n", errors);
+    return -1;
+  }
+
+  print_info("%d samples in %d frames decoded\n", TEST_SAMPLES, num_frames);
+  return 0;
+}
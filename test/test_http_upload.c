@@ -0,0 +1,420 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <openssl/asn1.h>
+#include "../src/phoenix.h"
+
+int debug=0;
+
+#define UPLOAD_SAMPLES 3000
+#define UPLOAD_TIMEOUT_MS 60000
+#define UPLOAD_RATE 2000
+#define UPLOAD_FLUSH_MS 100
+
+/*
+ * HTTP stand-in for the server that answers every request latency_ms late,
+ * on as many connections as the client opens. Every fail_every-th request
+ * gets a 500. Frames are decoded with frame_decode(), or answered with 415
+ * unless frames is set
+ */
+typedef struct {
+  int listen_fd;
+  int port;
+  int latency_ms;
+  int fail_every;
+  int frames;
+  volatile int run;
+  pthread_mutex_t mutex;
+  int requests;
+  int connections;
+  int samples;
+  int duplicates;
+  int frames_received;
+  unsigned char received[UPLOAD_SAMPLES];
+} server_t;
+
+typedef struct {
+  server_t *server;
+  int fd;
+} server_connection_t;
+
+//Read one request into buffer, headers and Content-Length bytes of body.
+//Returns the length of the request, 0 on EOF
+static int server_request(int fd, char *buffer, int size, char **body) {
+  char *end, *length;
+  int len=0, n, content_length=0;
+
+  for(;;) {
+    if((n=read(fd,buffer+len,size-1-len)) <= 0) {
+      return 0;
+    }
+    len+=n;
+    buffer[len]=0;
+    if((end=strstr(buffer,"\r\n\r\n")) != NULL) {
+      break;
+    }
+  }
+  if((length=strstr(buffer,"Content-Length:")) != NULL) {
+    content_length=atoi(length+15);
+  }
+  *body=end+4;
+  while(len-(*body-buffer) < content_length) {
+    if((n=read(fd,buffer+len,size-1-len)) <= 0) {
+      return 0;
+    }
+    len+=n;
+  }
+  buffer[len]=0;
+
+  return len;
+}
+
+//Count a sample by its value, the value is the number of the sample
+static void server_sample(server_t *server, int i) {
+  if(i < 0 || i >= UPLOAD_SAMPLES) {
+    return;
+  }
+  if(server->received[i]++) {
+    server->duplicates++;
+  }else{
+    server->samples++;
+  }
+}
+
+static void server_frame_sample(const char *stream, long long timestamp, double value, void *arg) {
+  server_sample(arg,value);
+}
+
+//Count the samples of a streams notification or a frame
+static void server_samples(server_t *server, const char *body, int body_len, int frame) {
+  const char *value;
+
+  if(frame) {
+    server->frames_received++;
+    if(frame_decode((const uint8_t *)body,body_len,server_frame_sample,server) < 0) {
+      print_error("Malformed frame of %d bytes\n", body_len);
+    }
+    return;
+  }
+
+  for(value=strstr(body,"\"value\":");value;value=strstr(value+8,"\"value\":")) {
+    server_sample(server,atoi(value+8));
+  }
+}
+
+static void *server_connection(void *arg) {
+  const char *ok="HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: 2\r\n\r\n{}";
+  const char *failed="HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n";
+  const char *unsupported="HTTP/1.1 415 Unsupported Media Type\r\nContent-Length: 0\r\n\r\n";
+  server_connection_t *connection=arg;
+  server_t *server=connection->server;
+  char *buffer=malloc(1<<20);
+  char *body, *content_type;
+  int len, fail, frame;
+
+  while((len=server_request(connection->fd,buffer,1<<20,&body)) > 0) {
+    usleep(server->latency_ms*1000);
+    content_type=strstr(buffer,"Content-Type: " MQTT_CONTENT_TYPE_FRAME);
+    frame = content_type != NULL && content_type < body;
+
+    pthread_mutex_lock(&server->mutex);
+    fail = server->fail_every > 0 && ++server->requests % server->fail_every == 0;
+    if(!fail && (!frame || server->frames)) {
+      server_samples(server,body,len-(body-buffer),frame);
+    }
+    pthread_mutex_unlock(&server->mutex);
+
+    if(frame && !server->frames) {
+      write(connection->fd,unsupported,strlen(unsupported));
+    }else if(fail) {
+      write(connection->fd,failed,strlen(failed));
+    }else{
+      write(connection->fd,ok,strlen(ok));
+    }
+  }
+
+  close(connection->fd);
+  free(buffer);
+  free(connection);
+
+  return NULL;
+}
+
+static void *server_thread(void *arg) {
+  server_t *server=arg;
+  server_connection_t *connection;
+  struct pollfd pfd;
+  pthread_t thread;
+  int fd;
+
+  while(server->run) {
+    pfd.fd=server->listen_fd;
+    pfd.events=POLLIN;
+    if(poll(&pfd,1,100) != 1 || (fd=accept(server->listen_fd,NULL,NULL)) < 0) {
+      continue;
+    }
+    pthread_mutex_lock(&server->mutex);
+    server->connections++;
+    pthread_mutex_unlock(&server->mutex);
+
+    connection=malloc(sizeof(server_connection_t));
+    connection->server=server;
+    connection->fd=fd;
+    pthread_create(&thread,NULL,server_connection,connection);
+    pthread_detach(thread);
+  }
+
+  return NULL;
+}
+
+static int server_start(server_t *server) {
+  struct sockaddr_in addr;
+  socklen_t addr_len=sizeof(addr);
+
+  pthread_mutex_init(&server->mutex,NULL);
+  server->listen_fd=socket(AF_INET,SOCK_STREAM,0);
+  memset(&addr,0,sizeof(addr));
+  addr.sin_family=AF_INET;
+  addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+  if(bind(server->listen_fd,(struct sockaddr *)&addr,sizeof(addr)) || listen(server->listen_fd,64)) {
+    print_error("Could not listen\n");
+    return -1;
+  }
+  getsockname(server->listen_fd,(struct sockaddr *)&addr,&addr_len);
+  server->port=ntohs(addr.sin_port);
+  server->run=1;
+
+  return 0;
+}
+
+//Rows left in the samples table, delivered samples are deleted
+static int stored_samples() {
+  int *ids, num_ids;
+
+  num_ids=db_row_ids("samples",&ids);
+  free(ids);
+
+  return num_ids;
+}
+
+//Upload UPLOAD_SAMPLES samples with concurrency batches at once, as
+//frames when format says so and the server takes them. Returns the
+//seconds it took, or -1 when samples were lost or sent twice
+static double upload(int concurrency, int latency_ms, int fail_every, http_format_t format, int server_frames) {
+  char workdir[64];
+  server_t *server=calloc(sizeof(server_t),1);
+  phoenix_t *phoenix=calloc(sizeof(phoenix_t),1);
+  http_stats_t stats;
+  pthread_t thread;
+  double start, elapsed;
+  int i, stream_id, unsent, stored;
+  phoenix_sample_t sample;
+
+  sprintf(workdir,"/tmp/phoenix_upload_XXXXXX");
+  if(mkdtemp(workdir)==NULL || db_init(workdir)) {
+    print_fatal("Could not init database\n");
+  }
+  stream_id=db_stream_id("test.upload");
+  for(i=0;i<UPLOAD_SAMPLES;i++) {
+    db_sample_insert_stream(stream_id,1000+i,i);
+  }
+
+  server->latency_ms=latency_ms;
+  server->fail_every=fail_every;
+  server->frames=server_frames;
+  if(server_start(server)) {
+    return -1;
+  }
+  pthread_create(&thread,NULL,server_thread,server);
+
+  phoenix->device_id="test_upload";
+  phoenix->certificate_hash="0123456789abcdef";
+  phoenix->server=malloc(64);
+  sprintf(phoenix->server,"127.0.0.1:%d",server->port);
+  phoenix->http=calloc(sizeof(phoenix_http_t),1);
+  phoenix->http->scheme="http";
+  phoenix_http_concurrency_set(phoenix,concurrency);
+  phoenix_http_format_set(phoenix,format);
+
+  //The uploader round of phoenix_connection_handle()
+  start=window_time_ms();
+  while(window_time_ms()-start < UPLOAD_TIMEOUT_MS) {
+    if(!phoenix_http_upload(phoenix,HTTP_POLL_MS) && db_samples_read(&sample,1) == 0) {
+      break;
+    }
+  }
+  elapsed=window_time_ms()-start;
+  inflight_flush();
+  unsent=db_samples_read(&sample,1);
+  stored=stored_samples();
+  phoenix_http_stats(phoenix,&stats);
+  phoenix_http_close(phoenix);
+
+  server->run=0;
+  pthread_join(thread,NULL);
+  close(server->listen_fd);
+
+  printf("%8s %12d %10d %10.2f %10.0f %10d %10llu %10d %10.1f\n", format == HTTP_FORMAT_FRAME ? (server_frames ? "frame" : "frame415") : "json",
+      concurrency, latency_ms, elapsed/1000.0, UPLOAD_SAMPLES/(elapsed/1000.0),
+      server->connections, (unsigned long long)stats.failed, server->duplicates, (double)stats.bytes_sent/UPLOAD_SAMPLES);
+
+  if(server->samples != UPLOAD_SAMPLES || server->duplicates || unsent || stored) {
+    print_error("%d of %d samples received, %d twice, %d unsent and %d rows left in the store\n", server->samples, UPLOAD_SAMPLES, server->duplicates, unsent, stored);
+    elapsed=-1000;
+  }
+  //Frames when the server takes them, JSON after the first 415 otherwise
+  if(format == HTTP_FORMAT_FRAME && (server_frames ? server->frames_received == 0 || stats.rejected : stats.rejected != 1)) {
+    print_error("%d frames received, %llu rejected\n", server->frames_received, (unsigned long long)stats.rejected);
+    elapsed=-1000;
+  }
+
+  //Connection threads still reading see EOF once the client is gone
+  db_close();
+  free(phoenix->server);
+  free(phoenix->http);
+  free(phoenix);
+
+  return elapsed/1000.0;
+}
+
+//The upload thread of phoenix_init_http(): samples are only stored by the
+//caller, at UPLOAD_RATE, while the thread posts them. Returns the longest
+//phoenix_send_sample() call in ms, or -1 when samples were lost
+static double upload_thread(int latency_ms) {
+  char workdir[64];
+  server_t *server=calloc(sizeof(server_t),1);
+  phoenix_t *phoenix=calloc(sizeof(phoenix_t),1);
+  http_stats_t stats;
+  pthread_t thread;
+  double start, call, call_max=0;
+  int i, queued_max=0, stored;
+
+  sprintf(workdir,"/tmp/phoenix_upload_XXXXXX");
+  if(mkdtemp(workdir)==NULL || db_init(workdir)) {
+    print_fatal("Could not init database\n");
+  }
+
+  server->latency_ms=latency_ms;
+  if(server_start(server)) {
+    return -1;
+  }
+  pthread_create(&thread,NULL,server_thread,server);
+
+  phoenix->device_id="test_upload";
+  phoenix->certificate_hash="0123456789abcdef";
+  phoenix->certificate_not_after=ASN1_TIME_set(NULL,time(NULL)+3600);
+  phoenix->server=malloc(64);
+  sprintf(phoenix->server,"127.0.0.1:%d",server->port);
+  phoenix->http=calloc(sizeof(phoenix_http_t),1);
+  pthread_mutex_init(&phoenix->http->mutex,NULL);
+  phoenix->http->scheme="http";
+  phoenix_flush_set(MAX_SAMPLES_TO_SEND,0,UPLOAD_FLUSH_MS);
+  phoenix_http_start(phoenix);
+
+  for(i=0;i<UPLOAD_SAMPLES;i++) {
+    start=window_time_ms();
+    phoenix_send_sample(phoenix,1000+i,(unsigned char *)"test.upload",i);
+    //Applications written for the old API still call this, it leaves the
+    //uploader to the thread
+    phoenix_connection_handle(phoenix);
+    call=window_time_ms()-start;
+    if(call > call_max) {
+      call_max=call;
+    }
+    phoenix_http_stats(phoenix,&stats);
+    if(stats.queued > queued_max) {
+      queued_max=stats.queued;
+    }
+    usleep(1000000/UPLOAD_RATE);
+  }
+
+  //The tail is a partial batch, posted once it is UPLOAD_FLUSH_MS old
+  start=window_time_ms();
+  while(window_time_ms()-start < UPLOAD_TIMEOUT_MS) {
+    pthread_mutex_lock(&server->mutex);
+    i=server->samples;
+    pthread_mutex_unlock(&server->mutex);
+    if(i == UPLOAD_SAMPLES) {
+      break;
+    }
+    usleep(10000);
+  }
+  phoenix_http_stats(phoenix,&stats);
+  phoenix_http_close(phoenix);
+  inflight_flush();
+  stored=stored_samples();
+
+  server->run=0;
+  pthread_join(thread,NULL);
+  close(server->listen_fd);
+
+  printf("%10d %10.2f %10d %10llu %10.0f %10.0f\n", latency_ms, call_max, queued_max, (unsigned long long)stats.batches,
+      stats.batch_latency_ms, stats.batch_latency_max_ms);
+
+  if(server->samples != UPLOAD_SAMPLES || server->duplicates || stored) {
+    print_error("%d of %d samples received, %d twice, %d rows left in the store\n", server->samples, UPLOAD_SAMPLES, server->duplicates, stored);
+    call_max=-1;
+  }
+
+  db_close();
+  ASN1_TIME_free(phoenix->certificate_not_after);
+  free(phoenix->server);
+  free(phoenix->http);
+  free(phoenix);
+
+  return call_max;
+}
+
+//Asynchronous HTTP uploads against a stand-in server with latency: every
+//sample delivered once with one batch at a time, with several at once,
+//with failing requests and as frames, then on the upload thread.
+//Argument: latency in ms
+int main(int argc, char *argv[]) {
+  int latency_ms = argc > 1 ? atoi(argv[1]) : 100;
+  double serial, parallel, call_max;
+  int errors=0;
+
+  printf("%d samples, %d per batch\n", UPLOAD_SAMPLES, MAX_SAMPLES_TO_SEND);
+  printf("%8s %12s %10s %10s %10s %10s %10s %10s %10s\n", "body", "concurrency", "rtt ms", "seconds", "samples/s", "conns", "failed", "duplicates", "B/sample");
+
+  serial=upload(1,latency_ms,0,HTTP_FORMAT_JSON,0);
+  parallel=upload(8,latency_ms,0,HTTP_FORMAT_JSON,0);
+  if(serial < 0 || parallel < 0 || upload(8,latency_ms,5,HTTP_FORMAT_JSON,0) < 0) {
+    errors++;
+  }
+  //Frames, also when every 5th post fails, and JSON for a server without
+  if(upload(8,latency_ms,0,HTTP_FORMAT_FRAME,1) < 0 || upload(8,latency_ms,5,HTTP_FORMAT_FRAME,1) < 0 ||
+      upload(8,latency_ms,0,HTTP_FORMAT_FRAME,0) < 0) {
+    errors++;
+  }
+
+  //One round trip per batch against eight at once
+  if(serial > 0 && parallel > 0 && parallel*4 > serial) {
+    print_error("%.2f s with 8 batches at once, %.2f s with one\n", parallel, serial);
+    errors++;
+  }
+
+  printf("\nupload thread, %d samples/s stored\n", UPLOAD_RATE);
+  printf("%10s %10s %10s %10s %10s %10s\n", "rtt ms", "call ms", "queued", "batches", "latency ms", "max ms");
+  call_max=upload_thread(latency_ms);
+  //Storing a sample never waits for the network
+  if(call_max < 0 || call_max >= latency_ms) {
+    print_error("phoenix_send_sample() took up to %.2f ms\n", call_max);
+    errors++;
+  }
+
+  if(errors) {
+    print_error("%d upload errors\n", errors);
+    return -1;
+  }
+
+  print_info("Upload tests passed\n");
+  return 0;
+}
@@ -0,0 +1,307 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <mosquitto.h>
+#include "../src/phoenix.h"
+
+int debug=0;
+
+#define SESSION_TEST_SAMPLES 20000
+#define SESSION_TEST_STREAMS 4
+#define SESSION_TEST_MAX_SEQ 100000
+#define SESSION_TEST_TIMEOUT_S 120
+
+//Sequence numbers survive a restart and resume only reads what is unacked
+static int test_store(const char *workdir) {
+  phoenix_sample_t samples[FRAME_MAX_SAMPLES];
+  int64_t ids[FRAME_MAX_SAMPLES], seqs[FRAME_MAX_SAMPLES];
+  int64_t seq, first;
+  int i, num_samples, stream_id, errors=0;
+
+  if(db_init((char *)workdir)) {
+    print_error("Could not init database\n");
+    return 1;
+  }
+  stream_id=db_stream_id("test.session");
+
+  //Three batches of ten, the first acked
+  for(i=0;i<30;i++) {
+    db_sample_insert_stream(stream_id,1000+i,i*1.0);
+  }
+  num_samples=db_samples_read(samples,30);
+  first=session_next();
+  session_next();
+  session_next();
+  for(i=0;i<num_samples;i++) {
+    ids[i]=samples[i].id;
+    seqs[i]=first+i/10;
+  }
+  if(num_samples != 30 || session_record(ids,seqs,num_samples)) {
+    print_error("Could not record sequence numbers of %d samples\n", num_samples);
+    db_close();
+    return 1;
+  }
+  db_samples_sent(ids,10,1);
+
+  //Recorded samples are not read as new ones
+  if((num_samples=db_samples_read(samples,30)) != 0) {
+    print_error("%d delivered samples read as new\n", num_samples);
+    errors++;
+  }
+  db_close();
+
+  if(db_init((char *)workdir)) {
+    print_error("Could not init database again\n");
+    return 1;
+  }
+
+  if((seq=db_session_seq_get()) <= seqs[29]) {
+    print_error("Sequence %lld after restart, %lld was used\n", (long long)seq, (long long)seqs[29]);
+    errors++;
+  }
+
+  //Resume in batches no larger than limit, the unacked two in order
+  session_resume_start();
+  num_samples=session_resume_read(samples,seqs,15);
+  if(num_samples != 10 || seqs[0] != first+1 || seqs[9] != first+1) {
+    print_error("Resume read %d samples of seq %lld, expected 10 of %lld\n", num_samples, (long long)seqs[0], (long long)first+1);
+    errors++;
+  }
+  session_resumed(seqs[num_samples-1],1);
+  num_samples=session_resume_read(samples,seqs,15);
+  if(num_samples != 10 || seqs[0] != first+2) {
+    print_error("Resume read %d samples of seq %lld, expected 10 of %lld\n", num_samples, (long long)seqs[0], (long long)first+2);
+    errors++;
+  }
+  session_resumed(seqs[num_samples-1],1);
+  if(session_resume_read(samples,seqs,15) != 0 || session_resuming()) {
+    print_error("Resume did not end\n");
+    errors++;
+  }
+  db_close();
+
+  return errors;
+}
+
+static int test_backoff() {
+  int i, delay, previous=0, errors=0;
+
+  for(i=0;i<20;i++) {
+    delay=session_backoff_ms(i);
+    if(delay < PHOENIX_RECONNECT_MIN_MS/2 || delay > PHOENIX_RECONNECT_MAX_MS) {
+      print_error("Backoff %d ms on attempt %d\n", delay, i);
+      errors++;
+    }
+    previous=delay;
+  }
+  if(previous < PHOENIX_RECONNECT_MAX_MS/2) {
+    print_error("Backoff %d ms after 20 attempts\n", previous);
+    errors++;
+  }
+
+  return errors;
+}
+
+/*
+ * A device uploading through a local broker that is killed and restarted
+ */
+typedef struct {
+  pthread_mutex_t mutex;
+  unsigned char received[SESSION_TEST_MAX_SEQ];
+  int samples;
+  int duplicates;
+} subscriber_t;
+
+static void count_sample(const char *stream, long long timestamp, double value, void *arg) {
+  (*(int *)arg)++;
+}
+
+//Count every batch by its "seq" user property, samples once
+static void subscriber_message_callback(struct mosquitto *mosq, void *userdata, const struct mosquitto_message *message, const mosquitto_property *properties) {
+  subscriber_t *subscriber=userdata;
+  char *name=NULL, *value=NULL;
+  long long seq=-1;
+  int samples=0;
+
+  const mosquitto_property *property=mosquitto_property_read_string_pair(properties,MQTT_PROP_USER_PROPERTY,&name,&value,false);
+
+  while(property) {
+    if(strcmp(name,"seq") == 0) {
+      seq=atoll(value);
+    }
+    free(name);
+    free(value);
+    property=mosquitto_property_read_string_pair(property,MQTT_PROP_USER_PROPERTY,&name,&value,true);
+  }
+  if(seq < 0 || seq >= SESSION_TEST_MAX_SEQ) {
+    print_error("Message on %s without a usable seq\n", message->topic);
+    return;
+  }
+
+  if(strstr(message->topic,"/frame")) {
+    frame_decode(message->payload,message->payloadlen,count_sample,&samples);
+  }else{
+    samples=1;
+  }
+
+  pthread_mutex_lock(&subscriber->mutex);
+  if(subscriber->received[seq]++) {
+    subscriber->duplicates++;
+  }else{
+    subscriber->samples+=samples;
+  }
+  pthread_mutex_unlock(&subscriber->mutex);
+}
+
+static int subscriber_samples(subscriber_t *subscriber) {
+  int samples;
+
+  pthread_mutex_lock(&subscriber->mutex);
+  samples=subscriber->samples;
+  pthread_mutex_unlock(&subscriber->mutex);
+
+  return samples;
+}
+
+//Broker with persistence in workdir, saved on every change
+static pid_t broker_start(const char *mosquitto, const char *workdir, int port) {
+  char conf[256];
+  FILE *f;
+  pid_t pid;
+
+  sprintf(conf,"%s/mosquitto.conf",workdir);
+  if((f=fopen(conf,"w")) == NULL) {
+    return -1;
+  }
+  fprintf(f,"listener %d 127.0.0.1\nallow_anonymous true\n",port);
+  fprintf(f,"persistence true\npersistence_location %s/\nautosave_on_changes true\nautosave_interval 1\n",workdir);
+  fclose(f);
+
+  if((pid=fork()) == 0) {
+    execl(mosquitto,mosquitto,"-c",conf,(char *)NULL);
+    _exit(127);
+  }
+  usleep(500000);
+
+  return pid;
+}
+
+static void broker_kill(pid_t pid) {
+  kill(pid,SIGKILL);
+  waitpid(pid,NULL,0);
+}
+
+//Needs a provisioned device in the working directory, as reference_device
+static int test_broker(const char *mosquitto, int port) {
+  char workdir[64];
+  char code[64];
+  subscriber_t *subscriber=calloc(sizeof(subscriber_t),1);
+  struct mosquitto *mosq;
+  session_stats_t stats;
+  phoenix_t *phoenix;
+  long long timestamp=phoenix_get_timestamp();
+  int i, seconds, missing=0, errors=0;
+  pid_t broker;
+
+  sprintf(workdir,"/tmp/phoenix_session_XXXXXX");
+  if(mkdtemp(workdir)==NULL || db_init(workdir)) {
+    print_error("Could not init database\n");
+    return 1;
+  }
+  if((broker=broker_start(mosquitto,workdir,port)) < 0) {
+    print_error("Could not start %s\n", mosquitto);
+    return 1;
+  }
+
+  pthread_mutex_init(&subscriber->mutex,NULL);
+  mosquitto_lib_init();
+  mosq=mosquitto_new("session_test_subscriber",false,subscriber);
+  mosquitto_int_option(mosq,MOSQ_OPT_PROTOCOL_VERSION,MQTT_PROTOCOL_V5);
+  mosquitto_message_v5_callback_set(mosq,subscriber_message_callback);
+  if(mosquitto_connect(mosq,"127.0.0.1",port,60) != MOSQ_ERR_SUCCESS) {
+    print_error("Subscriber could not connect\n");
+    broker_kill(broker);
+    return 1;
+  }
+  mosquitto_subscribe(mosq,NULL,"/device/session_test/sample",1);
+  mosquitto_subscribe(mosq,NULL,"/device/session_test/frame",1);
+  mosquitto_loop_start(mosq);
+
+  phoenix=phoenix_init_with_server("127.0.0.1",port,0,"session_test");
+
+  //Half the samples, the broker dies in the middle of uploading them
+  for(i=0;i<SESSION_TEST_SAMPLES;i++) {
+    sprintf(code,"test.session.%d",i%SESSION_TEST_STREAMS);
+    phoenix_send_sample(phoenix,timestamp+i,(unsigned char *)code,i*1.0);
+    if(i == SESSION_TEST_SAMPLES/2) {
+      broker_kill(broker);
+      sleep(2);
+      broker=broker_start(mosquitto,workdir,port);
+    }
+  }
+
+  for(seconds=0;seconds<SESSION_TEST_TIMEOUT_S && subscriber_samples(subscriber) < SESSION_TEST_SAMPLES;seconds++) {
+    sleep(1);
+  }
+
+  session_stats(&stats);
+  for(i=1;i<stats.next_seq && i<SESSION_TEST_MAX_SEQ;i++) {
+    missing+=!subscriber->received[i];
+  }
+  print_info("%d of %d samples in %d s, %d batches, %d resent, %llu resumed, %llu sessions lost\n",
+      subscriber->samples, SESSION_TEST_SAMPLES, seconds, (int)stats.assigned, subscriber->duplicates,
+      (unsigned long long)stats.resumed, (unsigned long long)stats.session_lost);
+
+  if(subscriber->samples != SESSION_TEST_SAMPLES || missing) {
+    print_error("%d samples and %d batches lost\n", SESSION_TEST_SAMPLES-subscriber->samples, missing);
+    errors++;
+  }
+  //Only the unacked tail goes out again, not everything ever in flight
+  if(subscriber->duplicates > WINDOW_MAX) {
+    print_error("%d batches resent, at most %d were in flight\n", subscriber->duplicates, WINDOW_MAX);
+    errors++;
+  }
+
+  phoenix_close(phoenix);
+  mosquitto_disconnect(mosq);
+  mosquitto_loop_stop(mosq,false);
+  mosquitto_destroy(mosq);
+  mosquitto_lib_cleanup();
+  broker_kill(broker);
+  db_close();
+  free(subscriber);
+
+  return errors;
+}
+
+//Delivery sequence numbers, resume and backoff on the store. With the path
+//of a mosquitto binary and a port as arguments also a device uploading
+//through a broker that is killed and restarted mid-upload
+int main(int argc, char *argv[]) {
+  char workdir[64];
+  int errors=0;
+
+  sprintf(workdir,"/tmp/phoenix_session_XXXXXX");
+  if(mkdtemp(workdir)==NULL) {
+    print_fatal("Could not create %s\n", workdir);
+  }
+
+  errors+=test_store(workdir);
+  errors+=test_backoff();
+
+  if(argc > 1) {
+    errors+=test_broker(argv[1],argc > 2 ? atoi(argv[2]) : 18831);
+  }
+
+  if(errors) {
+    print_error("%d session errors\n", errors);
+    return -1;
+  }
+
+  print_info("Session tests passed\n");
+  return 0;
+}
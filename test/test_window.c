@@ -0,0 +1,315 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <mosquitto.h>
+#include "../src/phoenix.h"
+
+int debug=0;
+
+#define PROXY_PORT 18830
+#define PROXY_CHUNKS 4096
+#define BROKER_MESSAGES 20000
+
+//Simulated link: every message is acked rtt ms after it was sent, the
+//window is refilled whenever it has room
+static double simulate(double *now, double rtt, double queue_per_message, int rounds) {
+  static int mid=0;
+  int i, n, sent[WINDOW_MAX+1], num_sent;
+  double ack;
+
+  for(i=0;i<rounds;i++) {
+    num_sent=0;
+    n=window_room();
+    while(n-- > 0) {
+      window_sent(++mid,*now);
+      sent[num_sent++]=mid;
+    }
+    //A queue in front of the link adds delay per message in flight
+    ack=*now + rtt + queue_per_message*num_sent;
+    for(n=0;n<num_sent;n++) {
+      window_acked(sent[n],ack);
+    }
+    *now=ack;
+  }
+
+  return *now;
+}
+
+static int test_simulated() {
+  window_stats_t stats;
+  double now=1000;
+  int errors=0, grown;
+
+  window_reset();
+
+  //A long fat link without queueing, the window opens up to the max
+  simulate(&now,600,0,40);
+  window_stats(&stats);
+  grown=stats.window;
+  if(stats.window != WINDOW_MAX) {
+    print_error("Window %d on an idle satellite link, expected %d\n", stats.window, WINDOW_MAX);
+    errors++;
+  }
+
+  //A congested broker, round trips grow with the number in flight
+  simulate(&now,20,2,40);
+  window_stats(&stats);
+  print_info("Window %d on a 600 ms link, %d on a congested one (srtt %.0f ms, min %.0f ms)\n", grown, stats.window,
+      stats.srtt_ms, stats.min_rtt_ms);
+  if(stats.window >= grown/4 || stats.decreases == 0) {
+    print_error("Window %d after congestion, %llu decreases\n", stats.window, (unsigned long long)stats.decreases);
+    errors++;
+  }
+
+  //Errors halve it, never below the minimum
+  grown=stats.window;
+  now+=10000;
+  window_error(now);
+  window_stats(&stats);
+  if(stats.window > grown/2+1) {
+    print_error("Window %d after error, was %d\n", stats.window, grown);
+    errors++;
+  }
+  for(grown=0;grown<20;grown++) {
+    now+=10000;
+    window_error(now);
+  }
+  window_stats(&stats);
+  if(stats.window != WINDOW_MIN) {
+    print_error("Window %d after errors, expected %d\n", stats.window, WINDOW_MIN);
+    errors++;
+  }
+
+  //Lost acks free their slots after the timeout
+  window_reset();
+  window_sent(1,now);
+  window_sent(2,now);
+  window_expire(now+WINDOW_ACK_TIMEOUT_MS+1);
+  window_stats(&stats);
+  if(stats.in_flight != 0 || stats.expired != 2) {
+    print_error("%d in flight, %llu expired after timeout\n", stats.in_flight, (unsigned long long)stats.expired);
+    errors++;
+  }
+
+  return errors;
+}
+
+/*
+ * Delaying TCP proxy between the client and a real broker
+ */
+typedef struct {
+  double due;
+  int len;
+  char data[1024];
+} proxy_chunk_t;
+
+typedef struct {
+  proxy_chunk_t *chunks;
+  int head;
+  int count;
+} proxy_queue_t;
+
+typedef struct {
+  int listen_fd;
+  struct sockaddr_in broker;
+  double delay_ms;
+  volatile int run;
+} proxy_t;
+
+//Read what is available on from, it is written to the other side delay_ms later
+static int proxy_read(int fd, proxy_queue_t *queue, double delay_ms) {
+  proxy_chunk_t *chunk;
+
+  if(queue->count == PROXY_CHUNKS) {
+    return 0;
+  }
+  chunk=&queue->chunks[(queue->head+queue->count) % PROXY_CHUNKS];
+  chunk->len=read(fd,chunk->data,sizeof(chunk->data));
+  if(chunk->len <= 0) {
+    return -1;
+  }
+  chunk->due=window_time_ms()+delay_ms;
+  queue->count++;
+
+  return 0;
+}
+
+static int proxy_write(int fd, proxy_queue_t *queue, double now) {
+  proxy_chunk_t *chunk;
+
+  while(queue->count > 0 && queue->chunks[queue->head].due <= now) {
+    chunk=&queue->chunks[queue->head];
+    if(write(fd,chunk->data,chunk->len) != chunk->len) {
+      return -1;
+    }
+    queue->head=(queue->head+1) % PROXY_CHUNKS;
+    queue->count--;
+  }
+
+  return 0;
+}
+
+static void *proxy_thread(void *arg) {
+  proxy_t *proxy=arg;
+  proxy_queue_t up={0}, down={0};
+  struct pollfd fds[2];
+  double now, next;
+  int client, broker, timeout;
+
+  client=accept(proxy->listen_fd,NULL,NULL);
+  broker=socket(AF_INET,SOCK_STREAM,0);
+  if(client < 0 || connect(broker,(struct sockaddr *)&proxy->broker,sizeof(proxy->broker))) {
+    print_error("Proxy could not connect to the broker\n");
+    return NULL;
+  }
+  up.chunks=calloc(sizeof(proxy_chunk_t),PROXY_CHUNKS);
+  down.chunks=calloc(sizeof(proxy_chunk_t),PROXY_CHUNKS);
+
+  while(proxy->run) {
+    now=window_time_ms();
+    next=now+100;
+    if(up.count && up.chunks[up.head].due < next) {
+      next=up.chunks[up.head].due;
+    }
+    if(down.count && down.chunks[down.head].due < next) {
+      next=down.chunks[down.head].due;
+    }
+    timeout = next > now ? (int)(next-now)+1 : 0;
+
+    fds[0].fd=client;
+    fds[0].events=POLLIN;
+    fds[1].fd=broker;
+    fds[1].events=POLLIN;
+    poll(fds,2,timeout);
+
+    if(fds[0].revents & (POLLIN|POLLHUP) && proxy_read(client,&up,proxy->delay_ms)) {
+      break;
+    }
+    if(fds[1].revents & (POLLIN|POLLHUP) && proxy_read(broker,&down,proxy->delay_ms)) {
+      break;
+    }
+    now=window_time_ms();
+    if(proxy_write(broker,&up,now) || proxy_write(client,&down,now)) {
+      break;
+    }
+  }
+
+  close(client);
+  close(broker);
+  free(up.chunks);
+  free(down.chunks);
+
+  return NULL;
+}
+
+static void broker_publish_callback(struct mosquitto *mosq, void *userdata, int mid) {
+  window_acked(mid,window_time_ms());
+  (*(volatile int *)userdata)++;
+}
+
+//Publish through the proxy with the window deciding how much is in flight
+static int test_broker(const char *host, int port, double delay_ms) {
+  struct sockaddr_in addr;
+  struct hostent *he=gethostbyname(host);
+  struct mosquitto *mosq;
+  window_stats_t stats;
+  pthread_t thread;
+  proxy_t proxy;
+  double start, elapsed;
+  volatile int acked=0;
+  int sent=0, mid, one=1;
+  char payload[32]={0};
+
+  if(he == NULL) {
+    print_error("Unknown broker %s\n", host);
+    return 1;
+  }
+
+  memset(&proxy,0,sizeof(proxy));
+  proxy.broker.sin_family=AF_INET;
+  proxy.broker.sin_port=htons(port);
+  memcpy(&proxy.broker.sin_addr,he->h_addr_list[0],sizeof(proxy.broker.sin_addr));
+  proxy.delay_ms=delay_ms/2;
+  proxy.run=1;
+
+  proxy.listen_fd=socket(AF_INET,SOCK_STREAM,0);
+  setsockopt(proxy.listen_fd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+  memset(&addr,0,sizeof(addr));
+  addr.sin_family=AF_INET;
+  addr.sin_port=htons(PROXY_PORT);
+  addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+  if(bind(proxy.listen_fd,(struct sockaddr *)&addr,sizeof(addr)) || listen(proxy.listen_fd,1)) {
+    print_error("Could not listen on %d\n", PROXY_PORT);
+    return 1;
+  }
+  pthread_create(&thread,NULL,proxy_thread,&proxy);
+
+  mosquitto_lib_init();
+  mosq=mosquitto_new(NULL,true,(void *)&acked);
+  mosquitto_publish_callback_set(mosq,broker_publish_callback);
+  mosquitto_max_inflight_messages_set(mosq,WINDOW_MAX);
+  if(mosquitto_connect(mosq,"127.0.0.1",PROXY_PORT,60) != MOSQ_ERR_SUCCESS) {
+    print_error("Could not connect through the proxy\n");
+    return 1;
+  }
+  mosquitto_loop_start(mosq);
+
+  window_reset();
+  start=window_time_ms();
+  while(acked < BROKER_MESSAGES) {
+    if(sent < BROKER_MESSAGES && window_room() > 0) {
+      if(mosquitto_publish(mosq,&mid,"/device/window/sample",sizeof(payload),payload,1,false) == MOSQ_ERR_SUCCESS) {
+        window_sent(mid,window_time_ms());
+        sent++;
+      }
+    }else{
+      usleep(100);
+    }
+  }
+  elapsed=window_time_ms()-start;
+  window_stats(&stats);
+
+  print_info("%.0f ms link: %.0f msgs/s, window %d, srtt %.1f ms, min rtt %.1f ms\n", delay_ms,
+      BROKER_MESSAGES/(elapsed/1000.0), stats.window, stats.srtt_ms, stats.min_rtt_ms);
+
+  proxy.run=0;
+  mosquitto_disconnect(mosq);
+  mosquitto_loop_stop(mosq,false);
+  mosquitto_destroy(mosq);
+  mosquitto_lib_cleanup();
+  pthread_join(thread,NULL);
+  close(proxy.listen_fd);
+
+  //A fixed window of 20 would give 20 messages per round trip
+  if(stats.window <= WINDOW_INITIAL || BROKER_MESSAGES/(elapsed/1000.0) < WINDOW_INITIAL*1000.0/delay_ms) {
+    print_error("Window did not open up on a %.0f ms link\n", delay_ms);
+    return 1;
+  }
+
+  return 0;
+}
+
+//Window controller on a simulated link. With a broker host as argument the
+//same runs over a real connection through a proxy adding 300 ms round trip
+int main(int argc, char *argv[]) {
+  int errors=test_simulated();
+
+  if(argc > 1) {
+    errors+=test_broker(argv[1],argc > 2 ? atoi(argv[2]) : 1883,argc > 3 ? atof(argv[3]) : 300);
+  }
+
+  if(errors) {
+    print_error("%d window errors\n", errors);
+    return -1;
+  }
+
+  print_info("Window tests passed\n");
+  return 0;
+}